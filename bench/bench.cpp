@@ -0,0 +1,265 @@
+/*
+Benchmarks of the per record kernels
+
+ Each step of the path of one SML record is run on a recorded Itron
+ record (see Readme, SML Messages) and the cost per call is printed as
+ one JSON document, to compare firmware versions and see where the
+ time per record goes.
+
+ Host:   pio run -e bench_native && .pio/build/bench_native/program
+ Device: pio run -e d1_mini_bench -t upload && pio device monitor -e d1_mini_bench
+ On the device calls are counted in cpu cycles (ESP.getCycleCount()).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sml.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#define BENCH_CALLS 1000
+#define bench_printf Serial.printf
+static inline uint32_t bench_cycles() { return ESP.getCycleCount(); }
+static inline uint32_t bench_mhz() { return ESP.getCpuFreqMHz(); }
+#else
+#include <time.h>
+#define BENCH_CALLS 100000
+#define bench_printf printf
+static inline uint32_t bench_cycles() { return 0; }  // no portable cycle counter on the host
+static inline uint32_t bench_mhz() { return 0; }
+static inline void yield() {}
+#endif
+
+#ifndef VERSION
+#define VERSION "dev"
+#endif
+
+// Record body between start and end escape sequences (Readme example, xx=0x52)
+static uint8_t record[] = {
+  0x76,0x09,0xae,0x01,0x00,0x00,0x00,0x10,0xb6,0x88,0x62,0x00,0x62,0x00,0x72,0x65,
+  0x00,0x00,0x01,0x01,0x76,0x01,0x01,0x09,0x00,0x00,0x00,0x00,0x00,0x05,0x93,0xdb,
+  0x0b,0x0a,0x01,0x49,0x54,0x52,0x52,0x52,0x52,0x52,0x52,0x72,0x62,0x01,0x65,0x00,
+  0x05,0x93,0xdc,0x01,0x63,0xf5,0x44,0x00,0x76,0x09,0xae,0x01,0x00,0x00,0x00,0x10,
+  0xb6,0x89,0x62,0x00,0x62,0x00,0x72,0x65,0x00,0x00,0x07,0x01,0x77,0x01,0x0b,0x0a,
+  0x01,0x49,0x54,0x52,0x52,0x52,0x52,0x52,0x52,0x07,0x01,0x00,0x62,0x0a,0xff,0xff,
+  0x72,0x62,0x01,0x65,0x00,0x05,0x93,0xdc,0x74,0x77,0x07,0x01,0x00,0x60,0x32,0x01,
+  0x01,0x01,0x01,0x01,0x01,0x04,0x49,0x54,0x52,0x01,0x77,0x07,0x01,0x00,0x60,0x01,
+  0x00,0xff,0x01,0x01,0x01,0x01,0x0b,0x0a,0x01,0x49,0x54,0x52,0x52,0x52,0x52,0x52,
+  0x52,0x01,0x77,0x07,0x01,0x00,0x01,0x08,0x00,0xff,0x65,0x00,0x1c,0x01,0x04,0x01,
+  0x62,0x1e,0x52,0x03,0x69,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x5a,0x01,0x77,0x07,
+  0x01,0x00,0x02,0x08,0x00,0xff,0x01,0x01,0x62,0x1e,0x52,0x03,0x69,0x00,0x00,0x00,
+  0x00,0x00,0x00,0x00,0x00,0x01,0x01,0x01,0x63,0x3c,0xdc,0x00,0x76,0x09,0xae,0x01,
+  0x00,0x00,0x00,0x10,0xb6,0x8a,0x62,0x00,0x62,0x00,0x72,0x65,0x00,0x00,0x02,0x01,
+  0x71,0x01,0x63,0x67,0xa9,0x00,0x00,0x00
+};
+
+static uint8_t wire[sizeof(record) + 16];  // record with escape sequences as received
+static size_t wire_len = 0;
+
+static char frame_buf[sizeof(record) + 4];  // framer stores the end escape sequence too
+static itron_3hz_t itron;
+static sml_obis_table_t obis;
+static char out[256];
+volatile uint64_t sink;  // results go here so the compiler cannot drop the calls
+volatile size_t sink_frame;
+volatile uint32_t bench_exp = 2;
+volatile uint32_t bench_dt = 7;
+
+static void build_wire() {
+  static const uint8_t start[] = { 0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x01, 0x01, 0x01 };
+  static const uint8_t end[] = { 0x1b, 0x1b, 0x1b, 0x1b, 0x1a, 0x00, 0x12, 0x34 };
+  memcpy(wire, start, sizeof(start));
+  memcpy(&wire[sizeof(start)], record, sizeof(record));
+  memcpy(&wire[sizeof(start) + sizeof(record)], end, sizeof(end));
+  wire_len = sizeof(start) + sizeof(record) + sizeof(end);
+}
+
+// Escape sequence framing byte by byte (reference path), one whole record per call
+static void bench_frame() {
+  sml_framer_t framer = { SML_FRAME_NONE, 0, frame_buf, sizeof(frame_buf) };
+  for( size_t i = 0; i < wire_len; i++ ) {
+    if( sml_frame_put(&framer, wire[i]) == SML_PUT_DONE ) {
+      sink_frame = framer.count;
+    }
+  }
+}
+
+// Same with block framing as in read_serial_sml(), fed in 64 byte blocks like the staging buffer
+static void bench_frame_bulk() {
+  sml_framer_t framer = { SML_FRAME_NONE, 0, frame_buf, sizeof(frame_buf) };
+  for( size_t pos = 0; pos < wire_len; ) {
+    size_t block = wire_len - pos < 64 ? wire_len - pos : 64;
+    size_t end = pos + block;
+    while( pos < end ) {
+      sml_put_t event;
+      pos += sml_frame_write(&framer, &wire[pos], end - pos, &event);
+      if( event == SML_PUT_DONE ) {
+        sink_frame = framer.count;
+      }
+    }
+  }
+}
+
+// Block framing must find the same records as the byte by byte reference for any block size
+static bool check_frame_bulk() {
+  static uint8_t stream[3 * sizeof(wire) + 8];
+  static char ref_buf[sizeof(frame_buf)];
+  static char bulk_buf[sizeof(frame_buf)];
+  size_t len = 0;
+  stream[len++] = 0x1b;  // garbage and a partial start sequence before the records
+  stream[len++] = 0x42;
+  for( int i = 0; i < 3; i++ ) {
+    memcpy(&stream[len], wire, wire_len);
+    len += wire_len;
+  }
+  for( size_t block = 1; block <= 70; block++ ) {
+    sml_framer_t ref = { SML_FRAME_NONE, 0, ref_buf, sizeof(ref_buf) };
+    sml_framer_t bulk = { SML_FRAME_NONE, 0, bulk_buf, sizeof(bulk_buf) };
+    size_t ref_pos = 0;
+    size_t pos = 0;
+    while( pos < len ) {
+      size_t end = (len - pos < block) ? len : pos + block;
+      while( pos < end ) {
+        sml_put_t event;
+        pos += sml_frame_write(&bulk, &stream[pos], end - pos, &event);
+        if( event == SML_PUT_BUSY ) {
+          continue;
+        }
+        sml_put_t expect = SML_PUT_BUSY;  // reference must report the same event at the same byte
+        while( ref_pos < pos && (expect = sml_frame_put(&ref, stream[ref_pos++])) == SML_PUT_BUSY );
+        if( expect != event || ref_pos != pos || ref.count != bulk.count
+         || (event == SML_PUT_DONE && memcmp(ref_buf, bulk_buf, ref.count)) ) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+static void bench_read_sml() {
+  memset(&itron, 0, sizeof(itron));
+  read_sml(&itron, (char *)record, 0xffff, 0);
+  sink = itron.valid;
+}
+
+// Same with the generic OBIS table collected
+static void bench_read_sml_obis() {
+  memset(&itron, 0, sizeof(itron));
+  itron.obis = &obis;
+  read_sml(&itron, (char *)record, 0xffff, 0);
+  itron.obis = 0;
+  sink = obis.count;
+}
+
+// Items of one A+ entry as read_sml() hands them to the parser
+static void bench_parse() {
+  static const uint8_t obis[] = { 0x01, 0x00, 0x01, 0x08, 0x00, 0xff };
+  uint64_t open = SML_OPEN, list = SML_LIST, uptime = 365020, unit = 30, value = 90;
+  int64_t scale = -1;
+  parse_itron_3hz(&itron, 2, 0, 6, &open);
+  parse_itron_3hz(&itron, 2, 0, 6, &list);
+  parse_itron_3hz(&itron, 4, 1, 6, &uptime);
+  parse_itron_3hz(&itron, 5, 0, 0, obis);
+  parse_itron_3hz(&itron, 5, 3, 6, &unit);
+  parse_itron_3hz(&itron, 5, 4, 5, &scale);
+  parse_itron_3hz(&itron, 5, 5, 6, &value);
+  sink = itron.aPlus;
+}
+
+static void bench_pow10() {
+  sink = pow10(123456789, bench_exp) + pow10(123456789, -(int8_t)bench_exp);
+}
+
+// 64 bit power math as in update_power() and is_power_valid()
+static void bench_power() {
+  sink = sml_power_w(1234567890ULL + bench_dt, 1234567000ULL, bench_dt);
+}
+
+static void bench_hex() {
+  hex_str(out, sizeof(out), itron.serial, sizeof(itron.serial), '-');
+  sink = out[0];
+}
+
+// Formatting of the /json energy section as print_json() does it
+static void bench_json() {
+  sink = itron_json(out, sizeof(out), &itron, itron.detailed);
+}
+
+static void bench_line() {
+  sink = itron_line(out, sizeof(out), &itron, 1760000000123ULL);
+}
+
+typedef struct bench {
+  const char *name;
+  void (*fn)();
+} bench_t;
+
+static const bench_t benches[] = {
+  { "frame", bench_frame },
+  { "frame_bulk", bench_frame_bulk },
+  { "read_sml", bench_read_sml },
+  { "read_sml_obis", bench_read_sml_obis },
+  { "parse_itron_3hz", bench_parse },
+  { "pow10", bench_pow10 },
+  { "power", bench_power },
+  { "hex_str", bench_hex },
+  { "json", bench_json },
+  { "line_protocol", bench_line },
+};
+
+static uint64_t now_ns() {
+#ifdef ARDUINO
+  return micros64() * 1000;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void run_benches() {
+  build_wire();
+  bench_frame();
+  bench_read_sml();  // valid itron data for the formatting benchmarks
+
+  bench_printf("{\n \"version\": \"%s\",\n \"record_bytes\": %u,\n", VERSION, (unsigned)sizeof(record));
+  bench_printf(" \"framed_bytes\": %u,\n \"valid\": %u,\n", (unsigned)sink_frame, itron.valid);
+  bench_printf(" \"bulk_matches\": %s,\n", check_frame_bulk() ? "true" : "false");
+  bench_printf(" \"cpu_mhz\": %u,\n \"calls\": %u,\n \"results\": [", bench_mhz(), BENCH_CALLS);
+  for( size_t b = 0; b < sizeof(benches) / sizeof(*benches); b++ ) {
+    benches[b].fn();  // warm up caches
+    uint64_t start_ns = now_ns();
+    uint32_t start = bench_cycles();
+    for( uint32_t i = 0; i < BENCH_CALLS; i++ ) {
+      benches[b].fn();
+    }
+    uint32_t cycles = bench_cycles() - start;
+    uint64_t ns = now_ns() - start_ns;
+    bench_printf("%s\n  { \"name\": \"%s\", ", b ? "," : "", benches[b].name);
+    bench_printf("\"ns_per_call\": %u", (unsigned)(ns / BENCH_CALLS));
+    if( bench_mhz() ) {
+      bench_printf(", \"cycles_per_call\": %u", cycles / BENCH_CALLS);
+    }
+    bench_printf(" }");
+    yield();
+  }
+  bench_printf("\n ]\n}\n");
+}
+
+#ifdef ARDUINO
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  run_benches();
+}
+
+void loop() {
+  delay(1000);
+}
+#else
+int main() {
+  run_benches();
+  return 0;
+}
+#endif
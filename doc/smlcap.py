@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""Read sml capture files downloaded with curl -o capture.bin 'http://power3/sml?n=20'
+
+File:   b"SMLCAP\\x01\\x00" then records
+Record: uint32 len, uint32 unix time [s], uint16 [ms], uint8 reason bits, uint8 reserved,
+        then len bytes sml data (between start and end escape sequence), all little endian
+
+Lists the records, optionally with hex dump, or writes them as raw sml stream
+with escape sequences (e.g. for libsml tools).
+"""
+import argparse
+import struct
+import sys
+import time
+
+MAGIC = b"SMLCAP\x01\x00"
+HEADER = struct.Struct("<IIHBB")
+REASONS = {1: "invalid", 2: "A+ rejected", 4: "A- rejected", 8: "coarse"}
+
+
+def records(data):
+    if data[:len(MAGIC)] != MAGIC:
+        sys.exit("not an sml capture file")
+    pos = len(MAGIC)
+    while pos + HEADER.size <= len(data):
+        length, sec, ms, reason, _ = HEADER.unpack_from(data, pos)
+        pos += HEADER.size
+        if pos + length > len(data):
+            print("truncated record at offset %d" % (pos - HEADER.size), file=sys.stderr)
+            break
+        yield sec, ms, reason, data[pos:pos + length]
+        pos += length
+
+
+def wire(sml):
+    # padding is already part of the sml data, checksum is not captured
+    pad = (4 - len(sml) % 4) % 4
+    return b"\x1b\x1b\x1b\x1b\x01\x01\x01\x01" + sml + b"\x00" * pad + b"\x1b\x1b\x1b\x1b\x1a" + bytes([pad]) + b"\x00\x00"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("capture", help="capture file from /sml?n=")
+    parser.add_argument("--hex", action="store_true", help="dump sml data as hex")
+    parser.add_argument("--raw", metavar="FILE", help="write records as raw sml stream")
+    args = parser.parse_args()
+
+    with open(args.capture, "rb") as f:
+        data = f.read()
+
+    out = open(args.raw, "wb") if args.raw else None
+    for sec, ms, reason, sml in records(data):
+        stamp = time.strftime("%Y-%m-%dT%H:%M:%S", time.localtime(sec))
+        why = ", ".join(text for bit, text in REASONS.items() if reason & bit) or "ok"
+        print("%s.%03u %5u bytes %s" % (stamp, ms, len(sml), why))
+        if args.hex:
+            for pos in range(0, len(sml), 32):
+                print("  " + sml[pos:pos + 32].hex(","))
+        if out:
+            out.write(wire(sml))
+    if out:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,634 @@
+/*
+Linux emulator of the firmware
+ Runs setup() and loop() of src/main.cpp against the shims in emu/include
+ and reports loop latency, serial throughput and memory as JSON lines on
+ stdout. See Readme, Emulator.
+ */
+#include "emu.h"
+
+#include <LittleFS.h>
+#include <Updater.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266mDNS.h>
+#include <coredecls.h>
+#include <user_interface.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+
+#define EMU_RTC_SIZE 512
+
+emu_config_t emu = { 0, 1.0, "127.0.0.1", 8000, "emu_fs", 0, false, 0, 10, false, 0 };
+emu_counters_t emu_count = {};
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+MDNSResponder MDNS;
+UpdaterClass Update;
+
+void setup();
+void loop();
+void post_data();
+extern int influx_status;
+extern uint32_t influx_connects;
+
+static uint64_t start_us = 0;
+static char **emu_argv = 0;
+static volatile sig_atomic_t emu_stop = 0;
+static uint32_t rtc_memory[EMU_RTC_SIZE / 4];
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+uint64_t micros64() {
+  return now_us() - start_us;
+}
+
+uint32_t micros() {
+  return micros64();
+}
+
+uint32_t millis() {
+  return micros64() / 1000;
+}
+
+void delay( unsigned long ms ) {
+  uint64_t start = micros64();
+  uint64_t end = start + ms * 1000ULL;
+  do {
+    uint64_t now = micros64();
+    emu_poll(now < end ? (end - now + 999) / 1000 : 0);
+  } while( micros64() < end );
+  emu_count.idle_us += micros64() - start;
+}
+
+void yield() {
+  emu_poll(0);
+}
+
+void pinMode( uint8_t pin, uint8_t mode ) {}
+void digitalWrite( uint8_t pin, uint8_t value ) {}
+void analogWrite( uint8_t pin, int value ) {}
+void analogWriteRange( uint32_t range ) {}
+
+size_t Print::write( const uint8_t *buf, size_t len ) {
+  size_t n = 0;
+  while( len-- && write(*buf++) ) {
+    n++;
+  }
+  return n;
+}
+
+// Like the ESP8266 core: formatted on the stack up to 64 chars, on the heap above
+size_t Print::printf( const char *fmt, ... ) {
+  char buf[64];
+  char *out = buf;
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if( len < 0 ) {
+    return 0;
+  }
+  if( len >= (int)sizeof(buf) ) {
+    out = (char *)malloc(len + 1);
+    if( !out ) {
+      return 0;
+    }
+    va_start(args, fmt);
+    vsnprintf(out, len + 1, fmt, args);
+    va_end(args);
+  }
+  size_t n = write((const uint8_t *)out, len);
+  if( out != buf ) {
+    free(out);
+  }
+  return n;
+}
+
+int Stream::timedRead() {
+  uint32_t start = millis();
+  do {
+    int c = read();
+    if( c >= 0 ) {
+      return c;
+    }
+    yield();
+  } while( millis() - start < _timeout );
+  return -1;
+}
+
+size_t Stream::readBytes( uint8_t *buf, size_t len ) {
+  size_t n = 0;
+  int c;
+  while( n < len && (c = timedRead()) >= 0 ) {
+    buf[n++] = c;
+  }
+  return n;
+}
+
+size_t Stream::readBytesUntil( char terminator, char *buf, size_t len ) {
+  size_t n = 0;
+  int c;
+  while( n < len && (c = timedRead()) >= 0 && c != terminator ) {
+    buf[n++] = c;
+  }
+  return n;
+}
+
+String IPAddress::toString() const {
+  char str[16];
+  snprintf(str, sizeof(str), "%u.%u.%u.%u", _addr[0], _addr[1], _addr[2], _addr[3]);
+  return String(str);
+}
+
+/*
+Serial input
+ A regular file is replayed like the meter sends: bytes at the baud rate,
+ a new record at most once per second (both times -x). They go into an rx
+ buffer of the size set with setRxBufferSize() like the UART interrupt
+ does, bytes that do not fit are lost and counted as overruns.
+ A fifo or pty delivers what was written, up to the free buffer space.
+ */
+static int serial_fd = -1;
+static FILE *serial_file = 0;   // regular file, replayed
+static uint32_t serial_baud = 9600;
+static uint64_t serial_next_us = 0;    // arrival of the next byte of the file
+static uint64_t serial_record_us = 0;  // arrival of the start of the current record
+static uint64_t serial_tail = 0;       // last 8 bytes, to find the end escape sequence
+static bool serial_new_record = true;
+static std::vector<uint8_t> serial_rx(256);
+static size_t serial_head = 0;  // next write position
+static size_t serial_len = 0;
+
+static void serial_push( const uint8_t *data, size_t len ) {
+  for( size_t i = 0; i < len; i++ ) {
+    if( serial_len == serial_rx.size() ) {
+      emu_count.serial_overruns += len - i;
+      break;
+    }
+    serial_rx[serial_head] = data[i];
+    serial_head = (serial_head + 1) % serial_rx.size();
+    serial_len++;
+    emu_count.serial_bytes++;
+  }
+  if( serial_len > emu_count.serial_high_water ) {
+    emu_count.serial_high_water = serial_len;
+  }
+}
+
+// Bytes of the file that arrived until now, returns the count
+static size_t serial_replay( uint8_t *buf, size_t size ) {
+  uint64_t now = micros64();
+  double byte_us = 10e6 / serial_baud / emu.speed;
+  size_t n = 0;
+  while( serial_next_us <= now && n < size ) {
+    int c = getc(serial_file);
+    if( c == EOF ) {
+      emu_count.serial_eof = true;
+      break;
+    }
+    if( serial_new_record ) {
+      serial_record_us = serial_next_us;
+      serial_new_record = false;
+    }
+    buf[n++] = c;
+    serial_next_us += byte_us;
+    serial_tail = (serial_tail << 8) | c;
+    if( (serial_tail >> 24) == 0x1b1b1b1b1aULL ) {  // end escape: next record in the next meter second
+      serial_next_us = std::max(serial_next_us, serial_record_us + (uint64_t)(1e6 / emu.speed));
+      serial_new_record = true;
+    }
+  }
+  return n;
+}
+
+static void serial_fill() {
+  uint8_t buf[4096];
+  if( serial_fd < 0 || emu_count.serial_eof ) {
+    return;
+  }
+  if( serial_file ) {
+    size_t n;
+    do {
+      n = serial_replay(buf, sizeof(buf));
+      serial_push(buf, n);
+    } while( n == sizeof(buf) );
+  }
+  else {
+    size_t space = serial_rx.size() - serial_len;
+    ssize_t n = space ? ::read(serial_fd, buf, std::min(space, sizeof(buf))) : -1;
+    if( n == 0 && !isatty(serial_fd) ) {
+      emu_count.serial_eof = true;
+    }
+    else if( n > 0 ) {
+      serial_push(buf, n);
+    }
+  }
+}
+
+static void serial_open() {
+  if( !emu.serial ) {
+    return;
+  }
+  serial_fd = open(emu.serial, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if( serial_fd < 0 ) {
+    fprintf(stderr, "emu: cannot open serial input %s: %s\n", emu.serial, strerror(errno));
+    exit(1);
+  }
+  struct stat st;
+  if( fstat(serial_fd, &st) == 0 && S_ISREG(st.st_mode) ) {
+    serial_file = fdopen(serial_fd, "rb");
+  }
+}
+
+// fd to wake emu_poll() for serial input or -1
+int emu_serial_fd() {
+  return serial_file ? -1 : serial_fd;
+}
+
+void HardwareSerial::begin( unsigned long baud ) {
+  serial_baud = baud;
+  serial_next_us = micros64();
+}
+
+size_t HardwareSerial::setRxBufferSize( size_t size ) {
+  serial_rx.assign(size, 0);
+  serial_head = 0;
+  serial_len = 0;
+  return size;
+}
+
+int HardwareSerial::available() {
+  serial_fill();
+  return serial_len;
+}
+
+int HardwareSerial::peek() {
+  serial_fill();
+  return serial_len ? serial_rx[(serial_head + serial_rx.size() - serial_len) % serial_rx.size()] : -1;
+}
+
+int HardwareSerial::read() {
+  int c = peek();
+  if( c >= 0 ) {
+    serial_len--;
+  }
+  return c;
+}
+
+size_t HardwareSerial::read( uint8_t *buf, size_t len ) {
+  serial_fill();
+  size_t n = 0;
+  while( n < len && serial_len ) {
+    buf[n++] = serial_rx[(serial_head + serial_rx.size() - serial_len) % serial_rx.size()];
+    serial_len--;
+  }
+  return n;
+}
+
+size_t HardwareSerial::write( uint8_t c ) {
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::write( const uint8_t *buf, size_t len ) {
+  if( emu.log ) {
+    fwrite(buf, 1, len, stderr);
+  }
+  return len;
+}
+
+/*
+ESP
+ Heap figures come from the model of the device heap in heap.cpp.
+ RTC user memory is kept in a file over ESP.restart(), which runs the
+ emulator again with the same arguments, and is gone after that like
+ after a power cycle.
+ */
+static void rtc_path( char *path, size_t size ) {
+  snprintf(path, size, "%s/.rtc", emu.fs_dir);
+}
+
+static void rtc_load() {
+  char path[256];
+  rtc_path(path, sizeof(path));
+  FILE *f = fopen(path, "rb");
+  if( f ) {
+    if( fread(rtc_memory, 1, sizeof(rtc_memory), f) != sizeof(rtc_memory) ) {
+      memset(rtc_memory, 0, sizeof(rtc_memory));
+    }
+    fclose(f);
+    unlink(path);
+  }
+}
+
+void EspClass::restart() {
+  char path[256];
+  rtc_path(path, sizeof(path));
+  mkdir(emu.fs_dir, 0755);
+  FILE *f = fopen(path, "wb");
+  if( f ) {
+    fwrite(rtc_memory, 1, sizeof(rtc_memory), f);
+    fclose(f);
+  }
+  fprintf(stderr, "emu: restart\n");
+  fflush(stdout);
+  execv("/proc/self/exe", emu_argv);
+  fprintf(stderr, "emu: restart failed: %s\n", strerror(errno));
+  exit(1);
+}
+
+uint32_t EspClass::getFreeHeap() {
+  return emu_heap_free();
+}
+
+uint32_t EspClass::getMaxFreeBlockSize() {
+  return emu_heap_max_block();
+}
+
+uint8_t EspClass::getHeapFragmentation() {
+  return emu_heap_fragmentation();
+}
+
+uint32_t EspClass::getCycleCount() {
+  return micros64() * 80;
+}
+
+static uint8_t cpu_mhz = 80;
+
+uint8_t EspClass::getCpuFreqMHz() {
+  return cpu_mhz;
+}
+
+bool system_update_cpu_freq( uint8_t freq ) {
+  cpu_mhz = freq;
+  return true;
+}
+
+uint32_t EspClass::getFreeSketchSpace() {
+  return 1024 * 1024;
+}
+
+bool EspClass::rtcUserMemoryRead( uint32_t offset, uint32_t *data, size_t size ) {
+  if( offset * 4 + size > sizeof(rtc_memory) ) {
+    return false;
+  }
+  memcpy(data, (uint8_t *)rtc_memory + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite( uint32_t offset, uint32_t *data, size_t size ) {
+  if( offset * 4 + size > sizeof(rtc_memory) ) {
+    return false;
+  }
+  memcpy((uint8_t *)rtc_memory + offset * 4, data, size);
+  return true;
+}
+
+// Same polynomial and conventions as the ESP8266 core (no final inversion)
+uint32_t crc32( const void *data, size_t length, uint32_t crc ) {
+  const uint8_t *p = (const uint8_t *)data;
+  while( length-- ) {
+    uint8_t c = *p++;
+    for( uint32_t i = 0x80; i > 0; i >>= 1 ) {
+      bool bit = crc & 0x80000000;
+      if( c & i ) {
+        bit = !bit;
+      }
+      crc <<= 1;
+      if( bit ) {
+        crc ^= 0x04c11db7;
+      }
+    }
+  }
+  return crc;
+}
+
+/*
+Loop statistics
+ Durations of loop() calls go into a log-linear histogram (16 steps per
+ power of two) for the percentiles of each report interval.
+ */
+#define HIST_BUCKETS (29 * 16)
+
+typedef struct loop_stats {
+  uint64_t loops;
+  uint64_t busy_us;   // in loop() without delay()
+  uint32_t max_us;
+  uint64_t hist[HIST_BUCKETS];
+} loop_stats_t;
+
+static size_t hist_bucket( uint32_t us ) {
+  if( us < 16 ) {
+    return us;
+  }
+  int e = 31 - __builtin_clz(us);
+  return (e - 3) * 16 + ((us >> (e - 4)) & 15);
+}
+
+static uint32_t hist_upper( size_t bucket ) {
+  if( bucket < 16 ) {
+    return bucket;
+  }
+  int e = bucket / 16 + 3;
+  return ((uint64_t)(16 + bucket % 16 + 1) << (e - 4)) - 1;
+}
+
+static uint32_t hist_percentile( const loop_stats_t *stats, double percent ) {
+  uint64_t rank = stats->loops * percent / 100;
+  uint64_t seen = 0;
+  for( size_t i = 0; i < HIST_BUCKETS; i++ ) {
+    seen += stats->hist[i];
+    if( seen > rank ) {
+      return std::min(hist_upper(i), stats->max_us);
+    }
+  }
+  return stats->max_us;
+}
+
+static void report( const loop_stats_t *stats, uint64_t interval_us, const emu_counters_t *prev ) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double s = interval_us / 1e6;
+  printf("{\"time_s\": %.1f, \"loops\": %llu, \"loops_per_s\": %.0f, ", micros64() / 1e6, (unsigned long long)stats->loops, stats->loops / s);
+  printf("\"busy_percent\": %.1f, ", stats->busy_us * 100.0 / interval_us);
+  printf("\"loop_us\": {\"p50\": %u, \"p99\": %u, ", hist_percentile(stats, 50), hist_percentile(stats, 99));
+  printf("\"p999\": %u, \"max\": %u}, ", hist_percentile(stats, 99.9), stats->max_us);
+  printf("\"serial\": {\"bytes\": %llu, ", (unsigned long long)(emu_count.serial_bytes - prev->serial_bytes));
+  printf("\"bytes_per_s\": %.0f, ", (emu_count.serial_bytes - prev->serial_bytes) / s);
+  printf("\"overruns\": %llu, ", (unsigned long long)(emu_count.serial_overruns - prev->serial_overruns));
+  printf("\"rx_high_water\": %zu, \"eof\": %s}, ", emu_count.serial_high_water, emu_count.serial_eof ? "true" : "false");
+  printf("\"tcp\": {\"connects\": %llu, ", (unsigned long long)(emu_count.tcp_connects - prev->tcp_connects));
+  printf("\"accepts\": %llu, ", (unsigned long long)(emu_count.tcp_accepts - prev->tcp_accepts));
+  printf("\"in\": %llu, ", (unsigned long long)(emu_count.tcp_in - prev->tcp_in));
+  printf("\"out\": %llu}, ", (unsigned long long)(emu_count.tcp_out - prev->tcp_out));
+  printf("\"udp_packets\": %llu, ", (unsigned long long)(emu_count.udp_packets - prev->udp_packets));
+  printf("\"heap\": {\"used\": %u, \"peak\": %u, \"free\": %u, ", emu_heap.used, emu_heap.peak, ESP.getFreeHeap());
+  printf("\"max_block\": %u, \"fragmentation\": %u, ", ESP.getMaxFreeBlockSize(), ESP.getHeapFragmentation());
+  printf("\"oom\": %llu, \"maxrss_kb\": %ld}}\n", (unsigned long long)emu_heap.oom, usage.ru_maxrss);
+  fflush(stdout);
+}
+
+/*
+InfluxDB soak
+ post_data() runs back to back with a loop() pass in between against the
+ stand-in (emu/standin.py influx). After a warm up of 1% of the posts the
+ largest free heap block is taken as reference, it must not shrink below
+ that until the end. All posts must succeed on the kept alive connection
+ (no reconnect after the warm up). Prints a JSON line with the rate every
+ report interval and a result line, exit code 1 on failure.
+ */
+static int soak() {
+  uint32_t warmup = std::max(emu.soak_posts / 100, (uint32_t)100);
+  uint32_t reference = 0;
+  uint32_t min_block = UINT32_MAX;
+  uint64_t errors = 0;
+  uint64_t start_us = micros64();
+  uint64_t report_us = start_us;
+  uint32_t report_posts = 0;
+  uint32_t connects = 0;  // at the end of the warm up
+  uint32_t posts = 0;
+  while( posts < emu.soak_posts && !emu_stop ) {
+    loop();
+    emu_poll(0);
+    post_data();
+    posts++;
+    if( influx_status < 200 || influx_status > 299 ) {
+      errors++;
+    }
+    uint32_t block = emu_heap_max_block();
+    if( posts == warmup ) {
+      reference = block;
+      connects = influx_connects;
+    }
+    else if( posts > warmup ) {
+      min_block = std::min(min_block, block);
+    }
+    uint64_t now = micros64();
+    if( now - report_us >= emu.report_s * 1000000ULL || posts == emu.soak_posts ) {
+      printf("{\"time_s\": %.1f, \"posts\": %u, \"posts_per_s\": %.1f, ", now / 1e6, posts, (posts - report_posts) * 1e6 / (now - report_us));
+      printf("\"errors\": %llu, \"connects\": %u, ", (unsigned long long)errors, influx_connects);
+      printf("\"heap\": {\"free\": %u, \"max_block\": %u, ", emu_heap_free(), block);
+      printf("\"fragmentation\": %u, \"oom\": %llu}}\n", emu_heap_fragmentation(), (unsigned long long)emu_heap.oom);
+      report_us = now;
+      report_posts = posts;
+    }
+  }
+  bool flat = posts > warmup && min_block >= reference && !emu_heap.oom;
+  uint32_t reconnects = posts > warmup ? influx_connects - connects : 0;
+  bool ok = flat && errors == 0 && reconnects == 0;
+  printf("{\"soak\": \"%s\", \"posts\": %u, \"errors\": %llu, ", ok ? "pass" : "fail", posts, (unsigned long long)errors);
+  printf("\"reconnects\": %u, \"posts_per_s\": %.1f, ", reconnects, posts * 1e6 / (micros64() - start_us));
+  printf("\"max_block\": {\"reference\": %u, \"min\": %u}}\n", reference, posts > warmup ? min_block : 0);
+  return ok ? 0 : 1;
+}
+
+static void on_signal( int sig ) {
+  emu_stop = 1;
+}
+
+static void usage( const char *name ) {
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    " -s path     meter input: file replayed at the baud rate, fifo or pty\n"
+    " -x factor   replay speed of a file (default 1)\n"
+    " -e          stop once the file is replayed\n"
+    " -H address  stand-in servers for all host names (default 127.0.0.1)\n"
+    " -p offset   added to the web and modbus ports (default 8000)\n"
+    " -f dir      LittleFS directory (default emu_fs)\n"
+    " -m path     write the IR mirror output to path\n"
+    " -t seconds  stop after seconds\n"
+    " -r seconds  statistics interval (default 10)\n"
+    " -P posts    InfluxDB soak: post back to back, fail if the max free heap block shrinks\n"
+    " -l          syslog and serial output to stderr\n", name);
+  exit(2);
+}
+
+int main( int argc, char **argv ) {
+  int opt;
+  while( (opt = getopt(argc, argv, "s:x:eH:p:f:m:t:r:lP:")) != -1 ) {
+    switch( opt ) {
+      case 's': emu.serial = optarg; break;
+      case 'x': emu.speed = atof(optarg); break;
+      case 'e': emu.exit_at_eof = true; break;
+      case 'H': emu.host = optarg; break;
+      case 'p': emu.port_offset = atoi(optarg); break;
+      case 'f': emu.fs_dir = optarg; break;
+      case 'm': emu.mirror = optarg; break;
+      case 't': emu.seconds = atoi(optarg); break;
+      case 'r': emu.report_s = atoi(optarg); break;
+      case 'l': emu.log = true; break;
+      case 'P': emu.soak_posts = strtoul(optarg, 0, 10); break;
+      default: usage(argv[0]);
+    }
+  }
+  if( emu.speed <= 0 || !emu.report_s ) {
+    usage(argv[0]);
+  }
+  emu_argv = argv;
+  start_us = now_us();
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+  static char stdout_buf[4096];  // not from the heap model
+  setvbuf(stdout, stdout_buf, _IOLBF, sizeof(stdout_buf));
+
+  rtc_load();
+  serial_open();
+  setup();
+  emu_heap_start();
+  if( emu.soak_posts ) {
+    return soak();
+  }
+
+  loop_stats_t stats = {};
+  emu_counters_t prev = emu_count;
+  uint64_t report_us = micros64();
+  uint64_t eof_us = 0;
+  while( !emu_stop ) {
+    uint64_t idle = emu_count.idle_us;
+    uint64_t start = micros64();
+    loop();
+    uint64_t us = micros64() - start;
+    stats.loops++;
+    stats.busy_us += us - (emu_count.idle_us - idle);
+    stats.max_us = std::max(stats.max_us, (uint32_t)std::min(us, (uint64_t)UINT32_MAX));
+    stats.hist[hist_bucket(std::min(us, (uint64_t)UINT32_MAX))]++;
+    emu_poll(0);
+
+    uint64_t now = micros64();
+    if( now - report_us >= emu.report_s * 1000000ULL ) {
+      report(&stats, now - report_us, &prev);
+      memset(&stats, 0, sizeof(stats));
+      prev = emu_count;
+      report_us = now;
+    }
+    if( emu.seconds && now >= emu.seconds * 1000000ULL ) {
+      break;
+    }
+    if( emu.exit_at_eof && emu_count.serial_eof && !Serial.available() ) {
+      if( !eof_us ) {
+        eof_us = now;
+      }
+      else if( now - eof_us > 3000000 ) {  // time to post the last records
+        break;
+      }
+    }
+  }
+  if( stats.loops ) {
+    report(&stats, micros64() - report_us, &prev);
+  }
+  return 0;
+}
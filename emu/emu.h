@@ -0,0 +1,65 @@
+/*
+Linux emulator internals shared by the shims
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncTCP.h>
+
+typedef struct emu_config {
+  const char *serial;    // meter input: file (replayed at the baud rate), fifo or pty
+  double speed;          // replay speed factor for a file
+  const char *host;      // address of the stand-in servers
+  uint16_t port_offset;  // added to listening ports (80 and 502 need root)
+  const char *fs_dir;    // LittleFS and RTC memory
+  const char *mirror;    // file for the IR mirror output or 0
+  bool log;              // syslog and serial output to stderr
+  uint32_t seconds;      // stop after, 0: run until interrupted
+  uint32_t report_s;     // interval of the statistics on stdout
+  bool exit_at_eof;      // stop once the serial file is replayed
+  uint32_t soak_posts;   // InfluxDB soak: post this often, then check the heap
+} emu_config_t;
+
+extern emu_config_t emu;
+
+typedef struct emu_counters {
+  uint64_t serial_bytes;     // delivered to the rx buffer
+  uint64_t serial_overruns;  // lost because the rx buffer was full
+  size_t serial_high_water;  // fullest rx buffer
+  bool serial_eof;
+  uint64_t tcp_connects;     // outgoing connections
+  uint64_t tcp_accepts;      // incoming connections
+  uint64_t tcp_out;          // bytes sent
+  uint64_t tcp_in;           // bytes received
+  uint64_t udp_packets;
+  uint64_t idle_us;          // time spent in delay()
+} emu_counters_t;
+
+extern emu_counters_t emu_count;
+
+#ifndef EMU_HEAP
+#define EMU_HEAP 52000  // free heap of the firmware on the device after setup [bytes]
+#endif
+
+typedef struct emu_heap {
+  uint32_t used;  // [bytes] in the model of the device heap, with headers
+  uint32_t peak;
+  uint64_t oom;   // allocations that would have failed on the device
+} emu_heap_t;
+
+extern emu_heap_t emu_heap;
+
+// Model of the device heap (heap.cpp), starts empty after setup()
+void emu_heap_start();
+uint32_t emu_heap_free();
+uint32_t emu_heap_max_block();
+uint8_t emu_heap_fragmentation();
+
+// Service sockets and serial input, wait up to timeout_ms for an event
+void emu_poll( uint32_t timeout_ms );
+void emu_add_server( AsyncServer *server );
+void emu_add_client( AsyncClient *client );
+void emu_remove_client( AsyncClient *client );
+
+// Address of the stand-in servers for any host name
+bool emu_address( uint16_t port, struct sockaddr_in *addr );
@@ -0,0 +1,85 @@
+/*
+LittleFS of the Linux emulator
+ Paths are relative to the directory given with -f.
+ */
+#include "emu.h"
+
+#include <LittleFS.h>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+FS LittleFS;
+
+static std::string fs_path( const char *path ) {
+  return std::string(emu.fs_dir) + (path[0] == '/' ? "" : "/") + path;
+}
+
+size_t File::size() {
+  struct stat st;
+  return _file && fstat(fileno(_file.get()), &st) == 0 ? st.st_size : 0;
+}
+
+bool File::seek( uint32_t pos ) {
+  return _file && fseek(_file.get(), pos, SEEK_SET) == 0;
+}
+
+int File::available() {
+  return _file ? size() - ftell(_file.get()) : 0;
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read( uint8_t *buf, size_t len ) {
+  return _file ? fread(buf, 1, len, _file.get()) : 0;
+}
+
+size_t File::write( const uint8_t *buf, size_t len ) {
+  if( !_file ) {
+    return 0;
+  }
+  size_t n = fwrite(buf, 1, len, _file.get());
+  fflush(_file.get());
+  return n;
+}
+
+bool FS::begin() {
+  ::mkdir(emu.fs_dir, 0755);
+  struct stat st;
+  return stat(emu.fs_dir, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+File FS::open( const char *path, const char *mode ) {
+  std::string m = mode;
+  m = (m == "r") ? "rb" : (m == "w") ? "wb" : (m == "a") ? "ab" : m;
+  return File(fopen(fs_path(path).c_str(), m.c_str()));
+}
+
+bool FS::remove( const char *path ) {
+  return unlink(fs_path(path).c_str()) == 0;
+}
+
+bool FS::mkdir( const char *path ) {
+  return ::mkdir(fs_path(path).c_str(), 0755) == 0;
+}
+
+Dir FS::openDir( const char *path ) {
+  std::vector<std::string> names;
+  DIR *dir = opendir(fs_path(path).c_str());
+  struct dirent *entry;
+  while( dir && (entry = readdir(dir)) ) {
+    if( entry->d_name[0] != '.' ) {
+      names.push_back(entry->d_name);
+    }
+  }
+  if( dir ) {
+    closedir(dir);
+  }
+  std::sort(names.begin(), names.end());
+  return Dir(names);
+}
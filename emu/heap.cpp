@@ -0,0 +1,228 @@
+/*
+Device heap model of the Linux emulator
+ malloc() and friends are wrapped: allocations after setup() are placed in
+ a model of the EMU_HEAP bytes the device has free after setup, in 8 byte
+ blocks with a 4 byte header and best fit like umm_malloc of the ESP8266
+ core. Free ranges are coalesced, so free heap, largest free block and
+ fragmentation behave like on the device and heap churn shows up as a
+ shrinking max block. The real memory still comes from glibc. Allocations
+ that do not fit the model are counted as out of memory (the device would
+ have returned 0). The emulator is single threaded.
+ */
+#include "emu.h"
+
+#include <malloc.h>
+#include <math.h>
+
+extern "C" {
+void *__libc_malloc( size_t size );
+void *__libc_calloc( size_t n, size_t size );
+void *__libc_realloc( void *ptr, size_t size );
+void __libc_free( void *ptr );
+}
+
+#define HEAP_BLOCK 8        // umm_malloc block size
+#define HEAP_HEADER 4       // per allocation
+#define HEAP_RANGES 2048    // free ranges of the model
+#define HEAP_ENTRIES 16384  // live allocations of the model (power of 2)
+
+typedef struct heap_range {
+  uint32_t start;  // [blocks]
+  uint32_t len;    // [blocks]
+} heap_range_t;
+
+typedef struct heap_entry {
+  void *ptr;       // 0: empty
+  heap_range_t range;
+} heap_entry_t;
+
+emu_heap_t emu_heap = {};
+
+static bool tracking = false;
+static heap_range_t ranges[HEAP_RANGES];  // free ranges ordered by start
+static size_t range_count = 0;
+static heap_entry_t entries[HEAP_ENTRIES];
+
+static size_t slot_of( const void *ptr ) {
+  return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 50 & (HEAP_ENTRIES - 1);
+}
+
+static heap_entry_t *entry_find( const void *ptr ) {
+  for( size_t i = slot_of(ptr); entries[i].ptr; i = (i + 1) & (HEAP_ENTRIES - 1) ) {
+    if( entries[i].ptr == ptr ) {
+      return &entries[i];
+    }
+  }
+  return 0;
+}
+
+static bool entry_add( void *ptr, heap_range_t range ) {
+  size_t i = slot_of(ptr);
+  for( size_t n = 0; entries[i].ptr; n++, i = (i + 1) & (HEAP_ENTRIES - 1) ) {
+    if( n >= HEAP_ENTRIES / 2 ) {
+      return false;  // too crowded
+    }
+  }
+  entries[i].ptr = ptr;
+  entries[i].range = range;
+  return true;
+}
+
+// Remove with backward shift, so lookups need no tombstones
+static void entry_remove( heap_entry_t *entry ) {
+  size_t hole = entry - entries;
+  size_t i = hole;
+  entries[hole].ptr = 0;
+  for( ;; ) {
+    i = (i + 1) & (HEAP_ENTRIES - 1);
+    if( !entries[i].ptr ) {
+      return;
+    }
+    size_t home = slot_of(entries[i].ptr);
+    if( ((i - home) & (HEAP_ENTRIES - 1)) >= ((i - hole) & (HEAP_ENTRIES - 1)) ) {
+      entries[hole] = entries[i];
+      entries[i].ptr = 0;
+      hole = i;
+    }
+  }
+}
+
+static uint32_t blocks_of( size_t size ) {
+  return (size + HEAP_HEADER + HEAP_BLOCK - 1) / HEAP_BLOCK;
+}
+
+// Best fit, returns false if no free range is large enough
+static bool range_alloc( uint32_t len, heap_range_t *range ) {
+  size_t best = range_count;
+  for( size_t i = 0; i < range_count; i++ ) {
+    if( ranges[i].len >= len && (best == range_count || ranges[i].len < ranges[best].len) ) {
+      best = i;
+    }
+  }
+  if( best == range_count ) {
+    return false;
+  }
+  range->start = ranges[best].start;
+  range->len = len;
+  ranges[best].start += len;
+  ranges[best].len -= len;
+  if( !ranges[best].len ) {
+    memmove(&ranges[best], &ranges[best + 1], (range_count - best - 1) * sizeof(ranges[0]));
+    range_count--;
+  }
+  emu_heap.used += len * HEAP_BLOCK;
+  emu_heap.peak = std::max(emu_heap.peak, emu_heap.used);
+  return true;
+}
+
+static void range_free( heap_range_t range ) {
+  size_t i = 0;
+  while( i < range_count && ranges[i].start < range.start ) {
+    i++;
+  }
+  emu_heap.used -= range.len * HEAP_BLOCK;
+  bool prev = i > 0 && ranges[i - 1].start + ranges[i - 1].len == range.start;
+  bool next = i < range_count && range.start + range.len == ranges[i].start;
+  if( prev && next ) {
+    ranges[i - 1].len += range.len + ranges[i].len;
+    memmove(&ranges[i], &ranges[i + 1], (range_count - i - 1) * sizeof(ranges[0]));
+    range_count--;
+  }
+  else if( prev ) {
+    ranges[i - 1].len += range.len;
+  }
+  else if( next ) {
+    ranges[i].start = range.start;
+    ranges[i].len += range.len;
+  }
+  else if( range_count < HEAP_RANGES ) {
+    memmove(&ranges[i + 1], &ranges[i], (range_count - i) * sizeof(ranges[0]));
+    ranges[i] = range;
+    range_count++;
+  }
+  // else: the range is lost to the model, like a heap too fragmented to count
+}
+
+static void track( void *ptr, size_t size ) {
+  heap_range_t range;
+  if( !ptr || !tracking ) {
+    return;
+  }
+  if( !range_alloc(blocks_of(size), &range) ) {
+    emu_heap.oom++;
+    return;
+  }
+  if( !entry_add(ptr, range) ) {
+    range_free(range);
+  }
+}
+
+static void untrack( void *ptr ) {
+  heap_entry_t *entry = ptr ? entry_find(ptr) : 0;
+  if( entry ) {
+    range_free(entry->range);
+    entry_remove(entry);
+  }
+}
+
+extern "C" void *malloc( size_t size ) {
+  void *ptr = __libc_malloc(size);
+  track(ptr, size);
+  return ptr;
+}
+
+extern "C" void *calloc( size_t n, size_t size ) {
+  void *ptr = __libc_calloc(n, size);
+  track(ptr, n * size);
+  return ptr;
+}
+
+extern "C" void *realloc( void *ptr, size_t size ) {
+  untrack(ptr);
+  void *moved = __libc_realloc(ptr, size);
+  track(moved, size);
+  return moved;
+}
+
+extern "C" void free( void *ptr ) {
+  untrack(ptr);
+  __libc_free(ptr);
+}
+
+// Allocations from now on are placed in the model of the device heap
+void emu_heap_start() {
+  range_count = 1;
+  ranges[0].start = 0;
+  ranges[0].len = EMU_HEAP / HEAP_BLOCK;
+  emu_heap.used = 0;
+  emu_heap.peak = 0;
+  tracking = true;
+}
+
+uint32_t emu_heap_free() {
+  uint32_t free = 0;
+  for( size_t i = 0; i < range_count; i++ ) {
+    free += ranges[i].len * HEAP_BLOCK;
+  }
+  return free;
+}
+
+uint32_t emu_heap_max_block() {
+  uint32_t max = 0;
+  for( size_t i = 0; i < range_count; i++ ) {
+    max = std::max(max, ranges[i].len);
+  }
+  return max ? max * HEAP_BLOCK - HEAP_HEADER : 0;
+}
+
+// As in the ESP8266 core: 100 - sqrt(sum of free block sizes squared) * 100 / free
+uint8_t emu_heap_fragmentation() {
+  double squares = 0;
+  uint32_t free = 0;
+  for( size_t i = 0; i < range_count; i++ ) {
+    double size = ranges[i].len * HEAP_BLOCK;
+    squares += size * size;
+    free += ranges[i].len * HEAP_BLOCK;
+  }
+  return free ? 100 - (uint8_t)(sqrt(squares) * 100 / free) : 0;
+}
@@ -0,0 +1,136 @@
+/*
+Arduino and ESP8266 core for the Linux emulator
+ Only what src/main.cpp uses. Time is the host monotonic clock, delay()
+ and yield() service the emulated network like the ESP system context.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <functional>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+template<class A, class B> auto min( A a, B b ) -> decltype(a + b) { return a < b ? a : b; }
+template<class A, class B> auto max( A a, B b ) -> decltype(a + b) { return a > b ? a : b; }
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define D1 5
+#define D4 2
+#define NOT_A_PIN -1
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+
+uint32_t millis();
+uint32_t micros();
+uint64_t micros64();
+void delay( unsigned long ms );
+void yield();
+
+void pinMode( uint8_t pin, uint8_t mode );
+void digitalWrite( uint8_t pin, uint8_t value );
+void analogWrite( uint8_t pin, int value );
+void analogWriteRange( uint32_t range );
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write( uint8_t c ) = 0;
+  virtual size_t write( const uint8_t *buf, size_t len );
+  size_t write( const char *str ) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write( const char *buf, size_t len ) { return write((const uint8_t *)buf, len); }
+  size_t print( const char *str ) { return write(str); }
+  size_t print( char c ) { return write((uint8_t)c); }
+  size_t print( int value ) { return printf("%d", value); }
+  size_t print( unsigned value ) { return printf("%u", value); }
+  size_t println( const char *str = "" ) { return write(str) + write("\r\n"); }
+  size_t printf( const char *fmt, ... ) __attribute__((format(printf, 2, 3)));
+  virtual void flush() {}
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() { return -1; }
+  void setTimeout( unsigned long ms ) { _timeout = ms; }
+  size_t readBytes( char *buf, size_t len ) { return readBytes((uint8_t *)buf, len); }
+  virtual size_t readBytes( uint8_t *buf, size_t len );
+  size_t readBytesUntil( char terminator, char *buf, size_t len );
+
+protected:
+  int timedRead();
+  unsigned long _timeout = 1000;
+};
+
+class String {
+public:
+  String( const char *str = "" ) : _str(str ? str : "") {}
+  String( const std::string &str ) : _str(str) {}
+  const char *c_str() const { return _str.c_str(); }
+  size_t length() const { return _str.size(); }
+  long toInt() const { return atol(_str.c_str()); }
+  bool operator==( const char *str ) const { return _str == str; }
+  bool operator==( const String &str ) const { return _str == str._str; }
+  bool operator!=( const char *str ) const { return _str != str; }
+
+private:
+  std::string _str;
+};
+
+class IPAddress {
+public:
+  IPAddress( uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0 ) : _addr{a, b, c, d} {}
+  String toString() const;
+
+private:
+  uint8_t _addr[4];
+};
+
+// Meter input: bytes of a file arrive at the baud rate, a fifo or pty as written
+class HardwareSerial : public Stream {
+public:
+  void begin( unsigned long baud );
+  size_t setRxBufferSize( size_t size );
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t read( uint8_t *buf, size_t len );
+  size_t readBytes( uint8_t *buf, size_t len ) override { return read(buf, len); }
+  size_t write( uint8_t c ) override;
+  size_t write( const uint8_t *buf, size_t len ) override;
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  void restart();
+  uint32_t getFreeHeap();
+  uint32_t getMaxFreeBlockSize();
+  uint8_t getHeapFragmentation();
+  uint32_t getCycleCount();
+  uint8_t getCpuFreqMHz();
+  uint32_t getFreeSketchSpace();
+  bool rtcUserMemoryRead( uint32_t offset, uint32_t *data, size_t size );
+  bool rtcUserMemoryWrite( uint32_t offset, uint32_t *data, size_t size );
+};
+
+extern EspClass ESP;
@@ -0,0 +1,26 @@
+/*
+WiFi of the Linux emulator: always connected, sockets use the host network
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <WiFiUdp.h>
+
+#define WIFI_STA 1
+
+typedef enum { WIFI_NONE_SLEEP = 0, WIFI_LIGHT_SLEEP = 1, WIFI_MODEM_SLEEP = 2 } WiFiSleepType_t;
+
+class WiFiClass {
+public:
+  void mode( int mode ) {}
+  void hostname( const char *name ) {}
+  bool isConnected() { return true; }
+  bool setSleepMode( WiFiSleepType_t type, uint8_t listenInterval = 0 ) { _sleep = type; return true; }
+  WiFiSleepType_t getSleepMode() { return _sleep; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+private:
+  WiFiSleepType_t _sleep = WIFI_NONE_SLEEP;
+};
+
+extern WiFiClass WiFi;
@@ -0,0 +1,11 @@
+#pragma once
+#include <Arduino.h>
+
+class MDNSResponder {
+public:
+  bool begin( const char *hostname ) { return true; }
+  void addService( const char *service, const char *proto, uint16_t port ) {}
+  void update() {}
+};
+
+extern MDNSResponder MDNS;
@@ -0,0 +1,74 @@
+/*
+Async TCP of the Linux emulator
+ Non blocking sockets polled from delay(), yield() and between loop()
+ calls, callbacks run there like in the ESP system context. Closing only
+ marks the client, onDisconnect follows on the next poll.
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <string>
+
+class AsyncClient;
+
+typedef std::function<void(void *, AsyncClient *)> AcConnectHandler;
+typedef std::function<void(void *, AsyncClient *, void *data, size_t len)> AcDataHandler;
+typedef std::function<void(void *, AsyncClient *, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void *, AsyncClient *, uint32_t time)> AcTimeoutHandler;
+
+class AsyncClient {
+public:
+  AsyncClient( int fd = -1 );
+  virtual ~AsyncClient();
+  void onDisconnect( AcConnectHandler cb, void *arg = 0 ) { _disconnect = std::move(cb); _disconnect_arg = arg; }
+  void onData( AcDataHandler cb, void *arg = 0 ) { _data = std::move(cb); _data_arg = arg; }
+  void onAck( AcAckHandler cb, void *arg = 0 ) { _ack = std::move(cb); _ack_arg = arg; }
+  void onTimeout( AcTimeoutHandler cb, void *arg = 0 ) { _timeout = std::move(cb); _timeout_arg = arg; }
+  size_t space();
+  size_t add( const char *data, size_t len, uint8_t flags = 0 );
+  bool send();
+  size_t write( const char *data, size_t len ) { len = add(data, len); send(); return len; }
+  void close( bool now = false ) { _closing = true; }
+  void abort() { _closing = true; }
+  bool connected() { return _fd >= 0 && !_closing; }
+  void setRxTimeout( uint32_t timeout_s ) { _rx_timeout_s = timeout_s; }
+  void setNoDelay( bool nodelay );
+
+  // emulator: socket events, returns false once the client was closed
+  bool _poll( short revents );
+  bool _sent() const { return _out.empty(); }
+  int _fd;
+
+private:
+  std::string _out;
+  bool _closing = false;
+  bool _gone = false;
+  uint32_t _rx_timeout_s = 0;
+  uint32_t _rx_ms;
+  AcConnectHandler _disconnect;
+  void *_disconnect_arg = 0;
+  AcDataHandler _data;
+  void *_data_arg = 0;
+  AcAckHandler _ack;
+  void *_ack_arg = 0;
+  AcTimeoutHandler _timeout;
+  void *_timeout_arg = 0;
+};
+
+class AsyncServer {
+public:
+  AsyncServer( uint16_t port ) : _port(port) {}
+  void onClient( AcConnectHandler cb, void *arg ) { _client = std::move(cb); _client_arg = arg; }
+  void begin();
+  void setNoDelay( bool nodelay ) { _nodelay = nodelay; }
+
+  // emulator: accept waiting connections
+  void _accept();
+  int _fd = -1;
+
+private:
+  uint16_t _port;
+  bool _nodelay = false;
+  AcConnectHandler _client;
+  void *_client_arg = 0;
+};
@@ -0,0 +1,187 @@
+/*
+Async web server of the Linux emulator
+ HTTP/1.1 on the emulated AsyncServer, one request per connection. The
+ request is parsed as data arrives, bodies of uploads are passed to the
+ upload handler as one chunk. Responses are filled into the send buffer
+ of the client as it drains like in ESPAsyncWebServer, so slow clients
+ and streamed responses behave as on the device.
+ */
+#pragma once
+
+#include <ESPAsyncTCP.h>
+#include <map>
+#include <vector>
+
+typedef enum {
+  HTTP_GET = 0b00000001,
+  HTTP_POST = 0b00000010,
+  HTTP_DELETE = 0b00000100,
+  HTTP_PUT = 0b00001000,
+  HTTP_PATCH = 0b00010000,
+  HTTP_HEAD = 0b00100000,
+  HTTP_OPTIONS = 0b01000000,
+  HTTP_ANY = 0b01111111,
+} WebRequestMethod;
+typedef uint8_t WebRequestMethodComposite;
+
+class AsyncWebServerRequest;
+
+class AsyncWebParameter {
+public:
+  AsyncWebParameter( const std::string &value ) : _value(value) {}
+  const String &value() const { return _value; }
+
+private:
+  String _value;
+};
+
+typedef AsyncWebParameter AsyncWebHeader;
+
+class AsyncWebServerResponse {
+public:
+  AsyncWebServerResponse( int code = 200, const char *contentType = "" ) : _code(code), _contentType(contentType) {}
+  virtual ~AsyncWebServerResponse() {}
+  void addHeader( const char *name, const char *value ) { _headers += std::string(name) + ": " + value + "\r\n"; }
+  void setCode( int code ) { _code = code; }
+  void setContentLength( size_t len ) { _contentLength = len; }
+
+  // emulator: status line and headers, then body parts until 0
+  std::string _head();
+  virtual size_t _fill( uint8_t *buf, size_t maxLen ) { return 0; }
+
+protected:
+  int _code;
+  String _contentType;
+  size_t _contentLength = 0;
+  bool _sendContentLength = true;
+  bool _chunked = false;
+  std::string _headers;
+};
+
+// Response with content in memory (strings and flash data)
+class AsyncBasicResponse : public AsyncWebServerResponse {
+public:
+  AsyncBasicResponse( int code, const char *contentType, const uint8_t *data, size_t len );
+  size_t _fill( uint8_t *buf, size_t maxLen ) override;
+
+private:
+  std::string _content;
+  size_t _pos = 0;
+};
+
+// Response filled on demand by _fillBuffer() of a subclass, framed if chunked
+class AsyncAbstractResponse : public AsyncWebServerResponse {
+public:
+  virtual bool _sourceValid() const { return false; }
+  virtual size_t _fillBuffer( uint8_t *buf, size_t maxLen ) { return 0; }
+  size_t _fill( uint8_t *buf, size_t maxLen ) override;
+
+private:
+  bool _last_sent = false;  // chunked: the chunk of size 0 is out
+};
+
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)> AwsResponseFiller;
+
+class AsyncCallbackResponse : public AsyncAbstractResponse {
+public:
+  AsyncCallbackResponse( const char *contentType, size_t len, AwsResponseFiller callback, bool chunked );
+  bool _sourceValid() const override { return true; }
+  size_t _fillBuffer( uint8_t *buf, size_t maxLen ) override;
+
+private:
+  AwsResponseFiller _callback;
+  size_t _index = 0;
+};
+
+// Response printed into a buffer before it is sent
+class AsyncResponseStream : public AsyncWebServerResponse, public Print {
+public:
+  AsyncResponseStream( const char *contentType, size_t bufferSize );
+  size_t write( uint8_t c ) override { return write(&c, 1); }
+  size_t write( const uint8_t *data, size_t len ) override;
+  using Print::write;
+  size_t _fill( uint8_t *buf, size_t maxLen ) override;
+
+private:
+  std::string _content;
+  size_t _pos = 0;
+};
+
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len, bool final)> ArUploadHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)> ArBodyHandlerFunction;
+typedef std::function<void(void)> ArDisconnectHandler;
+
+class AsyncCallbackWebHandler {
+public:
+  std::string _uri;
+  WebRequestMethodComposite _method = HTTP_ANY;
+  ArRequestHandlerFunction _onRequest;
+  ArUploadHandlerFunction _onUpload;
+  ArBodyHandlerFunction _onBody;
+};
+
+class AsyncWebServer;
+
+class AsyncWebServerRequest {
+public:
+  AsyncWebServerRequest( AsyncWebServer *server, AsyncClient *client );
+  ~AsyncWebServerRequest();
+  AsyncClient *client() { return _client; }
+  int method() const { return _method; }
+  const String &url() const { return _url; }
+
+  void send( AsyncWebServerResponse *response );
+  void send( int code, const char *contentType = "", const char *content = "" );
+  void redirect( const char *url );
+  AsyncWebServerResponse *beginResponse( int code, const char *contentType = "", const char *content = "" );
+  AsyncWebServerResponse *beginResponse_P( int code, const char *contentType, const uint8_t *content, size_t len );
+  AsyncWebServerResponse *beginResponse( const char *contentType, size_t len, AwsResponseFiller callback );
+  AsyncWebServerResponse *beginChunkedResponse( const char *contentType, AwsResponseFiller callback );
+  AsyncResponseStream *beginResponseStream( const char *contentType, size_t bufferSize = 1460 );
+  void onDisconnect( ArDisconnectHandler fn ) { _onDisconnect = fn; }
+
+  bool hasParam( const char *name, bool post = false ) const;
+  const AsyncWebParameter *getParam( const char *name, bool post = false ) const;
+  bool hasHeader( const char *name ) const;
+  const AsyncWebHeader *getHeader( const char *name ) const;
+
+private:
+  void onData( const uint8_t *data, size_t len );
+  void parseHead();
+  void dispatch();
+  void sendMore();
+
+  AsyncWebServer *_server;
+  AsyncClient *_client;
+  std::string _in;
+  size_t _head_len = 0;
+  size_t _body_len = 0;
+  int _method = 0;
+  String _url;
+  std::map<std::string, AsyncWebParameter> _params;
+  std::map<std::string, AsyncWebHeader> _headers;
+  AsyncWebServerResponse *_response = 0;
+  bool _dispatched = false;
+  bool _head_sent = false;
+  bool _body_done = false;
+  ArDisconnectHandler _onDisconnect;
+};
+
+class AsyncWebServer {
+public:
+  AsyncWebServer( uint16_t port );
+  AsyncCallbackWebHandler &on( const char *uri, ArRequestHandlerFunction onRequest );
+  AsyncCallbackWebHandler &on( const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest );
+  AsyncCallbackWebHandler &on( const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload, ArBodyHandlerFunction onBody = nullptr );
+  void onNotFound( ArRequestHandlerFunction fn ) { _notFound = fn; }
+  void begin();
+
+  // emulator: handler of a request or 0
+  const AsyncCallbackWebHandler *_find( const std::string &uri, int method ) const;
+  ArRequestHandlerFunction _notFound;
+
+private:
+  AsyncServer _server;
+  std::vector<AsyncCallbackWebHandler *> _handlers;
+};
@@ -0,0 +1,48 @@
+/*
+LittleFS of the Linux emulator: files in the directory given with -f
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+#include <vector>
+
+class File : public Stream {
+public:
+  File( FILE *file = 0 ) : _file(file, [](FILE *f) { if( f ) fclose(f); }) {}
+  explicit operator bool() const { return _file != nullptr; }
+  size_t size();
+  bool seek( uint32_t pos );
+  void close() { _file.reset(); }
+  int available() override;
+  int read() override;
+  size_t read( uint8_t *buf, size_t len );
+  size_t write( uint8_t c ) override { return write(&c, 1); }
+  size_t write( const uint8_t *buf, size_t len ) override;
+  using Print::write;
+
+private:
+  std::shared_ptr<FILE> _file;
+};
+
+class Dir {
+public:
+  Dir( const std::vector<std::string> &names = {} ) : _names(names) {}
+  bool next() { return ++_index <= _names.size(); }
+  String fileName() { return String(_index && _index <= _names.size() ? _names[_index - 1] : std::string()); }
+
+private:
+  std::vector<std::string> _names;
+  size_t _index = 0;
+};
+
+class FS {
+public:
+  bool begin();
+  File open( const char *path, const char *mode );
+  bool remove( const char *path );
+  bool mkdir( const char *path );
+  Dir openDir( const char *path );
+};
+
+extern FS LittleFS;
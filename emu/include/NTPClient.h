@@ -0,0 +1,11 @@
+#pragma once
+#include <WiFiUdp.h>
+
+// The host clock is NTP synchronized already
+class NTPClient {
+public:
+  NTPClient( WiFiUDP &udp, const char *server ) {}
+  void begin() {}
+  bool update() { return true; }
+  unsigned long getEpochTime() { return time(0); }
+};
@@ -0,0 +1,50 @@
+/*
+MQTT 3.1.1 client of the Linux emulator
+ QoS 0 publish and subscribe with the API and limits of PubSubClient:
+ connect() waits for the CONNACK, packets above MQTT_MAX_PACKET_SIZE fail.
+ */
+#pragma once
+
+#include <WiFiClient.h>
+
+#ifndef MQTT_MAX_PACKET_SIZE
+#define MQTT_MAX_PACKET_SIZE 256
+#endif
+#define MQTT_KEEPALIVE 15
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+
+class PubSubClient {
+public:
+  typedef void (*callback_t)( char *topic, uint8_t *payload, unsigned int length );
+
+  PubSubClient( WiFiClient &client ) : _client(client) {}
+  PubSubClient &setServer( const char *domain, uint16_t port ) { _domain = domain; _port = port; return *this; }
+  PubSubClient &setCallback( callback_t callback ) { _callback = callback; return *this; }
+  bool connect( const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage );
+  void disconnect();
+  bool connected();
+  bool loop();
+  bool publish( const char *topic, const char *payload, bool retained = false );
+  bool subscribe( const char *topic );
+  int state() { return _state; }
+
+private:
+  bool send( uint8_t header, const uint8_t *body, size_t len );
+  bool receive( uint8_t *header, size_t *len, uint32_t timeout_ms );
+
+  WiFiClient &_client;
+  const char *_domain = "";
+  uint16_t _port = 1883;
+  callback_t _callback = 0;
+  int _state = MQTT_DISCONNECTED;
+  uint16_t _packet_id = 0;
+  uint32_t _last_out = 0;
+  uint32_t _last_in = 0;
+  bool _ping_sent = false;
+  uint8_t _buf[MQTT_MAX_PACKET_SIZE];
+};
@@ -0,0 +1,18 @@
+#pragma once
+#include <Arduino.h>
+
+namespace EspSoftwareSerial {
+  enum Config { SWSERIAL_8N1 };
+}
+
+// The IR mirror writes to the file given with -m, if any
+class SoftwareSerial : public Stream {
+public:
+  SoftwareSerial( int rx, int tx, bool invert ) {}
+  void begin( uint32_t baud, EspSoftwareSerial::Config config, int rx, int tx, bool invert ) {}
+  int available() override { return 0; }
+  int read() override { return -1; }
+  size_t write( uint8_t c ) override { return write(&c, 1); }
+  size_t write( const uint8_t *buf, size_t len ) override;
+  using Print::write;
+};
@@ -0,0 +1,43 @@
+/*
+Syslog of the Linux emulator
+ Sends IETF syslog packets to the stand-in host like the Syslog library
+ and also writes the messages to stderr with -l.
+ */
+#pragma once
+
+#include <WiFiUdp.h>
+
+#define SYSLOG_PROTO_IETF 0
+#define SYSLOG_PROTO_BSD 1
+
+#define LOG_EMERG 0
+#define LOG_ALERT 1
+#define LOG_CRIT 2
+#define LOG_ERR 3
+#define LOG_WARNING 4
+#define LOG_NOTICE 5
+#define LOG_INFO 6
+#define LOG_DEBUG 7
+#define LOG_KERN (0 << 3)
+#define LOG_USER (1 << 3)
+#define LOG_PRIMASK 0x07
+#define LOG_PRI(p) ((p) & LOG_PRIMASK)
+
+class Syslog {
+public:
+  Syslog( WiFiUDP &udp, uint8_t protocol ) : _udp(udp) {}
+  void server( const char *server, uint16_t port ) { _server = server; _port = port; }
+  void deviceHostname( const char *hostname ) { _hostname = hostname; }
+  void appName( const char *name ) { _app = name; }
+  void defaultPriority( uint16_t pri ) { _pri = pri; }
+  bool log( uint16_t pri, const char *msg );
+  bool logf( uint16_t pri, const char *fmt, ... ) __attribute__((format(printf, 3, 4)));
+
+private:
+  WiFiUDP &_udp;
+  const char *_server = "";
+  uint16_t _port = 514;
+  const char *_hostname = "-";
+  const char *_app = "-";
+  uint16_t _pri = LOG_KERN;
+};
@@ -0,0 +1,20 @@
+#pragma once
+#include <Arduino.h>
+
+#define U_FLASH 0
+
+// Accepts and discards the image, the restart after it runs the same binary again
+class UpdaterClass {
+public:
+  bool begin( size_t size, int command = U_FLASH ) { _size = 0; return true; }
+  size_t write( uint8_t *data, size_t len ) { _size += len; return len; }
+  bool end( bool even_if_remaining = false ) { return _size > 0; }
+  bool hasError() { return false; }
+  uint8_t getError() { return 0; }
+  void runAsync( bool async ) {}
+
+private:
+  size_t _size = 0;
+};
+
+extern UpdaterClass Update;
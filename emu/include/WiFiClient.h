@@ -0,0 +1,27 @@
+/*
+TCP client of the Linux emulator
+ Connects to the stand-in host (-H) instead of the configured server name,
+ writes block like lwIP with a full send buffer, reads never block.
+ */
+#pragma once
+
+#include <Arduino.h>
+
+class WiFiClient : public Stream {
+public:
+  ~WiFiClient() { stop(); }
+  int connect( const char *host, uint16_t port );
+  uint8_t connected();
+  void stop();
+  int available() override;
+  int read() override;
+  int read( uint8_t *buf, size_t len );
+  size_t write( uint8_t c ) override { return write(&c, 1); }
+  size_t write( const uint8_t *buf, size_t len ) override;
+  using Print::write;
+  void setNoDelay( bool nodelay );
+  explicit operator bool() { return connected(); }
+
+private:
+  int _fd = -1;
+};
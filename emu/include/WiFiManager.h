@@ -0,0 +1,8 @@
+#pragma once
+#include <Arduino.h>
+
+class WiFiManager {
+public:
+  bool autoConnect() { return true; }
+  void resetSettings() {}
+};
@@ -0,0 +1,19 @@
+#pragma once
+#include <Arduino.h>
+#include <string>
+
+// UDP sender of the Linux emulator, packets go to the stand-in host (-H)
+class WiFiUDP : public Print {
+public:
+  ~WiFiUDP();
+  int beginPacket( const char *host, uint16_t port );
+  int endPacket();
+  size_t write( uint8_t c ) override { return write(&c, 1); }
+  size_t write( const uint8_t *buf, size_t len ) override;
+  using Print::write;
+
+private:
+  int _fd = -1;
+  uint16_t _port = 0;
+  std::string _packet;
+};
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32( const void *data, size_t length, uint32_t crc = 0xffffffff );
@@ -0,0 +1,21 @@
+/*
+SDK functions of the Linux emulator: the cpu clock is only remembered
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define SYS_CPU_80MHZ 80
+#define SYS_CPU_160MHZ 160
+
+typedef enum {
+  GPIO_PIN_INTR_DISABLE = 0,
+  GPIO_PIN_INTR_POSEDGE = 1,
+  GPIO_PIN_INTR_NEGEDGE = 2,
+  GPIO_PIN_INTR_ANYEDGE = 3,
+  GPIO_PIN_INTR_LOLEVEL = 4,
+  GPIO_PIN_INTR_HILEVEL = 5
+} GPIO_INT_TYPE;
+
+bool system_update_cpu_freq( uint8_t freq );
+inline void wifi_enable_gpio_wakeup( uint32_t pin, GPIO_INT_TYPE type ) {}
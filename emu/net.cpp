@@ -0,0 +1,546 @@
+/*
+Network of the Linux emulator
+ Every host name maps to the stand-in address (-H) with the configured
+ port, listening ports are moved up by -p. Blocking calls of the real
+ libraries (connect, MQTT connect) block here too, async sockets are
+ serviced by emu_poll().
+ */
+#include "emu.h"
+
+#include <WiFiClient.h>
+#include <WiFiUdp.h>
+#include <Syslog.h>
+#include <PubSubClient.h>
+#include <SoftwareSerial.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+
+#define EMU_CONNECT_TIMEOUT_MS 2000
+#define EMU_SND_BUF 2920  // lwIP TCP_SND_BUF of the ESP8266 core (2 * MSS)
+
+int emu_serial_fd();
+
+bool emu_address( uint16_t port, struct sockaddr_in *addr ) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  return inet_pton(AF_INET, emu.host, &addr->sin_addr) == 1;
+}
+
+/*
+WiFiClient
+ */
+int WiFiClient::connect( const char *host, uint16_t port ) {
+  struct sockaddr_in addr;
+  stop();
+  if( !emu_address(port, &addr) ) {
+    return 0;
+  }
+  _fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if( _fd < 0 ) {
+    return 0;
+  }
+  emu_count.tcp_connects++;
+  if( ::connect(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS ) {
+    stop();
+    return 0;
+  }
+  struct pollfd pfd = { _fd, POLLOUT, 0 };
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if( poll(&pfd, 1, EMU_CONNECT_TIMEOUT_MS) != 1 || getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) || err ) {
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+uint8_t WiFiClient::connected() {
+  if( _fd < 0 ) {
+    return 0;
+  }
+  char c;
+  ssize_t n = recv(_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ) {
+    return 0;  // closed by the peer, nothing left to read
+  }
+  return 1;
+}
+
+void WiFiClient::stop() {
+  if( _fd >= 0 ) {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+int WiFiClient::available() {
+  int n = 0;
+  if( _fd < 0 ) {
+    return 0;
+  }
+  char buf[4096];
+  ssize_t len = recv(_fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+  n = len > 0 ? len : 0;
+  return n;
+}
+
+int WiFiClient::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read( uint8_t *buf, size_t len ) {
+  if( _fd < 0 ) {
+    return -1;
+  }
+  ssize_t n = recv(_fd, buf, len, MSG_DONTWAIT);
+  if( n > 0 ) {
+    emu_count.tcp_in += n;
+  }
+  return n > 0 ? n : -1;
+}
+
+size_t WiFiClient::write( const uint8_t *buf, size_t len ) {
+  size_t done = 0;
+  uint32_t start = millis();
+  while( _fd >= 0 && done < len && millis() - start < EMU_CONNECT_TIMEOUT_MS ) {
+    ssize_t n = send(_fd, &buf[done], len - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if( n > 0 ) {
+      done += n;
+      emu_count.tcp_out += n;
+    }
+    else if( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+      break;
+    }
+    else {
+      yield();  // send buffer full
+    }
+  }
+  return done;
+}
+
+void WiFiClient::setNoDelay( bool nodelay ) {
+  int on = nodelay;
+  if( _fd >= 0 ) {
+    setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+}
+
+/*
+WiFiUDP
+ */
+WiFiUDP::~WiFiUDP() {
+  if( _fd >= 0 ) {
+    ::close(_fd);
+  }
+}
+
+int WiFiUDP::beginPacket( const char *host, uint16_t port ) {
+  if( _fd < 0 ) {
+    _fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  }
+  _port = port;
+  _packet.clear();
+  return _fd >= 0;
+}
+
+size_t WiFiUDP::write( const uint8_t *buf, size_t len ) {
+  _packet.append((const char *)buf, len);
+  return len;
+}
+
+int WiFiUDP::endPacket() {
+  struct sockaddr_in addr;
+  if( _fd < 0 || !emu_address(_port, &addr) ) {
+    return 0;
+  }
+  emu_count.udp_packets++;
+  return sendto(_fd, _packet.data(), _packet.size(), 0, (struct sockaddr *)&addr, sizeof(addr)) == (ssize_t)_packet.size();
+}
+
+/*
+Syslog
+ */
+bool Syslog::log( uint16_t pri, const char *msg ) {
+  if( emu.log ) {
+    fprintf(stderr, "%u.%03u <%u> %s\n", millis() / 1000, millis() % 1000, LOG_PRI(pri), msg);
+  }
+  if( !_udp.beginPacket(_server, _port) ) {
+    return false;
+  }
+  _udp.printf("<%u>1 - %s %s - - - ", (pri & LOG_PRIMASK) | (_pri & ~LOG_PRIMASK), _hostname, _app);
+  _udp.write(msg);
+  return _udp.endPacket();
+}
+
+bool Syslog::logf( uint16_t pri, const char *fmt, ... ) {
+  char msg[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, args);
+  va_end(args);
+  return log(pri, msg);
+}
+
+/*
+IR mirror
+ */
+size_t SoftwareSerial::write( const uint8_t *buf, size_t len ) {
+  static FILE *mirror = 0;
+  if( emu.mirror && !mirror ) {
+    mirror = fopen(emu.mirror, "ab");
+  }
+  if( mirror ) {
+    fwrite(buf, 1, len, mirror);
+  }
+  return len;
+}
+
+/*
+PubSubClient
+ */
+static size_t mqtt_string( uint8_t *buf, const char *str ) {
+  size_t len = strlen(str);
+  buf[0] = len >> 8;
+  buf[1] = len & 0xff;
+  memcpy(&buf[2], str, len);
+  return len + 2;
+}
+
+bool PubSubClient::send( uint8_t header, const uint8_t *body, size_t len ) {
+  uint8_t head[5] = { header };
+  size_t head_len = 1;
+  size_t rest = len;
+  do {
+    uint8_t digit = rest % 128;
+    rest /= 128;
+    head[head_len++] = digit | (rest ? 0x80 : 0);
+  } while( rest );
+  if( head_len + len > MQTT_MAX_PACKET_SIZE ) {
+    return false;  // PubSubClient rejects packets above its buffer
+  }
+  _last_out = millis();
+  return _client.write(head, head_len) == head_len && _client.write(body, len) == len;
+}
+
+// Read one packet into _buf, false if none complete within timeout_ms
+bool PubSubClient::receive( uint8_t *header, size_t *len, uint32_t timeout_ms ) {
+  uint32_t start = millis();
+  if( !_client.available() && !timeout_ms ) {
+    return false;
+  }
+  _client.setTimeout(timeout_ms ? timeout_ms : 100);
+  uint8_t c;
+  if( _client.readBytes(&c, 1) != 1 ) {
+    return false;
+  }
+  *header = c;
+  size_t value = 0;
+  for( int shift = 0; shift < 28; shift += 7 ) {
+    if( _client.readBytes(&c, 1) != 1 ) {
+      return false;
+    }
+    value |= (size_t)(c & 0x7f) << shift;
+    if( !(c & 0x80) ) {
+      break;
+    }
+  }
+  size_t got = 0;
+  while( got < value && millis() - start < 1000 ) {
+    uint8_t skip[64];
+    uint8_t *dst = got < sizeof(_buf) ? &_buf[got] : skip;
+    size_t part = got < sizeof(_buf) ? std::min(value - got, sizeof(_buf) - got) : std::min(value - got, sizeof(skip));
+    got += _client.readBytes(dst, part);
+  }
+  *len = std::min(value, sizeof(_buf));
+  _last_in = millis();
+  return got == value && value <= sizeof(_buf);
+}
+
+bool PubSubClient::connect( const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage ) {
+  uint8_t body[MQTT_MAX_PACKET_SIZE];
+  size_t len = 0;
+  if( !_client.connect(_domain, _port) ) {
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  static const uint8_t proto[] = { 0, 4, 'M', 'Q', 'T', 'T', 4 };
+  memcpy(body, proto, sizeof(proto));
+  len = sizeof(proto);
+  body[len++] = 0x02 | (willTopic ? 0x04 | (willQos << 3) | (willRetain ? 0x20 : 0) : 0);  // clean session, will
+  body[len++] = 0;
+  body[len++] = MQTT_KEEPALIVE;
+  if( strlen(id) + (willTopic ? strlen(willTopic) + strlen(willMessage) + 4 : 0) + len + 2 > sizeof(body) ) {
+    _client.stop();
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  len += mqtt_string(&body[len], id);
+  if( willTopic ) {
+    len += mqtt_string(&body[len], willTopic);
+    len += mqtt_string(&body[len], willMessage);
+  }
+  uint8_t header;
+  size_t ack_len;
+  if( !send(0x10, body, len) || !receive(&header, &ack_len, 15000) || (header & 0xf0) != 0x20 || ack_len < 2 ) {
+    _client.stop();
+    _state = MQTT_CONNECTION_TIMEOUT;
+    return false;
+  }
+  if( _buf[1] ) {
+    _client.stop();
+    _state = _buf[1];  // refused by the broker
+    return false;
+  }
+  _state = MQTT_CONNECTED;
+  _ping_sent = false;
+  _last_in = millis();
+  return true;
+}
+
+void PubSubClient::disconnect() {
+  uint8_t none = 0;
+  send(0xe0, &none, 0);
+  _client.stop();
+  _state = MQTT_DISCONNECTED;
+}
+
+bool PubSubClient::connected() {
+  if( _state == MQTT_CONNECTED && !_client.connected() ) {
+    _client.stop();
+    _state = MQTT_CONNECTION_LOST;
+  }
+  return _state == MQTT_CONNECTED;
+}
+
+bool PubSubClient::loop() {
+  if( !connected() ) {
+    return false;
+  }
+  uint32_t now = millis();
+  if( now - _last_in > MQTT_KEEPALIVE * 1000 || now - _last_out > MQTT_KEEPALIVE * 1000 ) {
+    if( _ping_sent ) {
+      _client.stop();
+      _state = MQTT_CONNECTION_TIMEOUT;
+      return false;
+    }
+    uint8_t none = 0;
+    send(0xc0, &none, 0);
+    _last_in = now;
+    _ping_sent = true;
+  }
+  uint8_t header;
+  size_t len;
+  while( receive(&header, &len, 0) ) {
+    _ping_sent = false;
+    if( (header & 0xf0) == 0x30 && len >= 2 && _callback ) {
+      size_t topic_len = (_buf[0] << 8) | _buf[1];
+      size_t pos = 2 + topic_len + ((header & 0x06) ? 2 : 0);  // packet id with QoS > 0
+      if( pos <= len ) {
+        char topic[MQTT_MAX_PACKET_SIZE];
+        memcpy(topic, &_buf[2], topic_len);
+        topic[topic_len] = 0;
+        _callback(topic, &_buf[pos], len - pos);
+      }
+    }
+  }
+  return true;
+}
+
+bool PubSubClient::publish( const char *topic, const char *payload, bool retained ) {
+  uint8_t body[MQTT_MAX_PACKET_SIZE];
+  size_t topic_len = strlen(topic);
+  size_t payload_len = strlen(payload);
+  if( !connected() || topic_len + payload_len + 2 > sizeof(body) ) {
+    return false;
+  }
+  size_t len = mqtt_string(body, topic);
+  memcpy(&body[len], payload, payload_len);
+  return send(0x30 | (retained ? 1 : 0), body, len + payload_len);
+}
+
+bool PubSubClient::subscribe( const char *topic ) {
+  uint8_t body[MQTT_MAX_PACKET_SIZE];
+  if( !connected() || strlen(topic) + 5 > sizeof(body) ) {
+    return false;
+  }
+  _packet_id++;
+  body[0] = _packet_id >> 8;
+  body[1] = _packet_id & 0xff;
+  size_t len = 2 + mqtt_string(&body[2], topic);
+  body[len++] = 0;  // QoS 0
+  return send(0x82, body, len);
+}
+
+/*
+Async TCP
+ */
+static std::vector<AsyncServer *> servers;
+static std::vector<AsyncClient *> clients;
+
+void emu_add_server( AsyncServer *server ) {
+  servers.push_back(server);
+}
+
+void emu_add_client( AsyncClient *client ) {
+  clients.push_back(client);
+}
+
+void emu_remove_client( AsyncClient *client ) {
+  clients.erase(std::remove(clients.begin(), clients.end(), client), clients.end());
+}
+
+AsyncClient::AsyncClient( int fd ) : _fd(fd), _rx_ms(millis()) {
+  if( _fd >= 0 ) {
+    emu_add_client(this);
+  }
+}
+
+AsyncClient::~AsyncClient() {
+  emu_remove_client(this);
+  if( _fd >= 0 ) {
+    ::close(_fd);
+  }
+}
+
+size_t AsyncClient::space() {
+  return connected() && _out.size() < EMU_SND_BUF ? EMU_SND_BUF - _out.size() : 0;
+}
+
+size_t AsyncClient::add( const char *data, size_t len, uint8_t flags ) {
+  len = std::min(len, space());
+  _out.append(data, len);
+  return len;
+}
+
+bool AsyncClient::send() {
+  if( _fd < 0 || _out.empty() ) {
+    return false;
+  }
+  ssize_t n = ::send(_fd, _out.data(), _out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+  if( n > 0 ) {
+    _out.erase(0, n);
+    emu_count.tcp_out += n;
+    if( _ack ) {
+      _ack(_ack_arg, this, n, 0);
+    }
+  }
+  return n > 0;
+}
+
+void AsyncClient::setNoDelay( bool nodelay ) {
+  int on = nodelay;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+bool AsyncClient::_poll( short revents ) {
+  if( !_closing && (revents & POLLIN) ) {
+    char buf[1460];  // one segment like lwIP delivers
+    ssize_t n = recv(_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if( n > 0 ) {
+      emu_count.tcp_in += n;
+      _rx_ms = millis();
+      if( _data ) {
+        _data(_data_arg, this, buf, n);
+      }
+    }
+    else if( n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ) {
+      _closing = true;
+    }
+  }
+  if( !_closing && (revents & (POLLERR | POLLHUP)) ) {
+    _closing = true;
+  }
+  if( !_closing && (revents & POLLOUT) ) {
+    send();
+  }
+  if( !_closing && _rx_timeout_s && millis() - _rx_ms > _rx_timeout_s * 1000 ) {
+    if( _timeout ) {
+      _timeout(_timeout_arg, this, millis() - _rx_ms);
+      _rx_ms = millis();
+    }
+    else {
+      _closing = true;
+    }
+  }
+  if( _closing && !_gone ) {
+    _gone = true;
+    emu_remove_client(this);
+    ::close(_fd);
+    _fd = -1;
+    if( _disconnect ) {
+      _disconnect(_disconnect_arg, this);  // usually deletes this client
+    }
+    return false;
+  }
+  return true;
+}
+
+void AsyncServer::begin() {
+  struct sockaddr_in addr;
+  uint16_t port = _port + emu.port_offset;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  _fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  int on = 1;
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if( _fd < 0 || bind(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(_fd, 8) < 0 ) {
+    fprintf(stderr, "emu: cannot listen on port %u: %s\n", port, strerror(errno));
+    exit(1);
+  }
+  fprintf(stderr, "emu: port %u listens on %u\n", _port, port);
+  emu_add_server(this);
+}
+
+void AsyncServer::_accept() {
+  int fd;
+  while( (fd = accept4(_fd, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0 ) {
+    emu_count.tcp_accepts++;
+    AsyncClient *client = new AsyncClient(fd);
+    client->setNoDelay(_nodelay);
+    if( _client ) {
+      _client(_client_arg, client);
+    }
+  }
+}
+
+void emu_poll( uint32_t timeout_ms ) {
+  std::vector<struct pollfd> fds;
+  std::vector<AsyncClient *> polled = clients;
+  for( AsyncServer *server : servers ) {
+    fds.push_back({ server->_fd, POLLIN, 0 });
+  }
+  for( AsyncClient *client : polled ) {
+    fds.push_back({ client->_fd, POLLIN, 0 });  // sending is retried on each poll, POLLOUT would never wait
+  }
+  int serial = emu_serial_fd();
+  if( serial >= 0 ) {
+    fds.push_back({ serial, POLLIN, 0 });
+  }
+  if( poll(fds.data(), fds.size(), timeout_ms) < 0 ) {
+    return;
+  }
+  for( size_t i = 0; i < servers.size(); i++ ) {
+    if( fds[i].revents & POLLIN ) {
+      servers[i]->_accept();
+    }
+  }
+  for( size_t i = 0; i < polled.size(); i++ ) {
+    AsyncClient *client = polled[i];
+    if( std::find(clients.begin(), clients.end(), client) != clients.end() ) {
+      client->_poll(fds[servers.size() + i].revents | POLLOUT);
+    }
+  }
+}
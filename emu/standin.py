@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""Stand-ins for the emulator (see Readme, Emulator)
+
+meter:  write a raw sml stream of the Readme example record, one record per
+        meter second with a varying load, to a file for -s or to a fifo
+        (with --realtime)
+influx: answer InfluxDB writes with 204 (or 503 with --fail) and count the
+        lines, to soak the post and spool paths
+
+MQTT needs a real broker (e.g. mosquitto), web and Modbus load can come
+from curl, ab or mbpoll.
+"""
+import argparse
+import http.server
+import math
+import random
+import socketserver
+import struct
+import sys
+import threading
+import time
+
+# Record body between start and end escape sequences (Readme example, xx=0x52)
+RECORD = bytes.fromhex(
+    "7609ae0100000010b688620062007265000001017601010900000000000593db"
+    "0b0a01495452525252525272620165000593dc0163f544007609ae0100000010"
+    "b6896200620072650000070177010b0a014954525252525252070100620affff"
+    "72620165000593dc747707010060320101010101010449545201770701006001"
+    "00ff010101010b0a0149545252525252520177070100010800ff65001c010401"
+    "621e520369000000000000005a0177070100020800ff0101621e520369000000"
+    "0000000000010101633cdc007609ae0100000010b68a62006200726500000201"
+    "71016367a9000000")
+START = b"\x1b\x1b\x1b\x1b\x01\x01\x01\x01"
+UPTIME = b"\x72\x62\x01\x65"                     # secIndex before the 4 byte uptime
+APLUS = b"\x01\x00\x01\x08\x00\xff"              # OBIS 1.8.0
+AMINUS = b"\x01\x00\x02\x08\x00\xff"             # OBIS 2.8.0
+VALUE = b"\x62\x1e\x52"                          # unit Wh, then scaler and int64 value
+
+
+def record(uptime, aplus, aminus):
+    rec = bytearray(RECORD)
+    pos = rec.find(UPTIME)
+    while pos >= 0:
+        struct.pack_into(">I", rec, pos + len(UPTIME), uptime)
+        pos = rec.find(UPTIME, pos + 1)
+    for obis, value in ((APLUS, aplus), (AMINUS, aminus)):
+        pos = rec.find(VALUE, rec.find(obis)) + len(VALUE)
+        rec[pos] = 0xff                          # scaler -1: value in 0.1 Wh
+        struct.pack_into(">q", rec, pos + 2, value)
+    pad = (4 - len(rec) % 4) % 4
+    return START + bytes(rec) + b"\x00" * pad + b"\x1b\x1b\x1b\x1b\x1a" + bytes([pad]) + b"\x00\x00"
+
+
+def meter(args):
+    out = open(args.output, "wb") if args.output != "-" else sys.stdout.buffer
+    rng = random.Random(args.seed)
+    aplus = aminus = 0.0
+    uptime = args.uptime
+    for n in range(args.records):
+        # house load with a daily swing and noise, pv production around noon
+        load = 400 + 300 * math.sin(n / 3600 * math.pi) + rng.uniform(0, 150)
+        pv = max(0.0, 900 * math.sin(n / 7200 * math.pi)) if args.pv else 0.0
+        aplus += max(load - pv, 0) / 360
+        aminus += max(pv - load, 0) / 360
+        out.write(record(uptime, int(aplus), int(aminus)))
+        uptime += 1
+        if args.realtime:
+            out.flush()
+            time.sleep(1)
+    out.flush()
+
+
+class InfluxHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    stats = {"posts": 0, "lines": 0, "failed": 0}
+    fail = 0.0
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        if random.random() < self.fail:
+            self.stats["failed"] += 1
+            self.send_response(503)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        self.stats["posts"] += 1
+        self.stats["lines"] += body.count(b"\n")
+        self.send_response(204)  # like InfluxDB: no Content-Length on 204
+        self.end_headers()
+
+    def log_message(self, fmt, *args):
+        pass
+
+
+def influx(args):
+    InfluxHandler.fail = args.fail
+
+    class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+        daemon_threads = True
+        allow_reuse_address = True
+
+    server = Server(("", args.port), InfluxHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    while True:
+        time.sleep(args.report)
+        print("influx %s" % InfluxHandler.stats, flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    m = sub.add_parser("meter", help="write sml records")
+    m.add_argument("output", help="file or fifo, - for stdout")
+    m.add_argument("--records", type=int, default=3600, help="meter seconds (default 3600)")
+    m.add_argument("--uptime", type=int, default=365000, help="meter uptime of the first record")
+    m.add_argument("--pv", action="store_true", help="add production, so there is backfeed")
+    m.add_argument("--realtime", action="store_true", help="one record per second (for a fifo)")
+    m.add_argument("--seed", type=int, default=1)
+    i = sub.add_parser("influx", help="InfluxDB write stand-in")
+    i.add_argument("--port", type=int, default=8086)
+    i.add_argument("--fail", type=float, default=0.0, help="fraction of posts answered with 503")
+    i.add_argument("--report", type=float, default=10.0, help="seconds between statistics")
+    args = parser.parse_args()
+    meter(args) if args.cmd == "meter" else influx(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,379 @@
+/*
+Async web server of the Linux emulator
+ */
+#include "emu.h"
+
+#include <ESPAsyncWebServer.h>
+
+#include <strings.h>
+
+#define WEB_MAX_REQUEST (2 * 1024 * 1024)  // firmware images are posted in one piece
+
+static const char *status_text( int code ) {
+  switch( code ) {
+    case 200: return "OK";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "";
+  }
+}
+
+std::string AsyncWebServerResponse::_head() {
+  char line[128];
+  snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\nConnection: close\r\n", _code, status_text(_code));
+  std::string head = line;
+  if( _contentType.length() ) {
+    head += std::string("Content-Type: ") + _contentType.c_str() + "\r\n";
+  }
+  if( _sendContentLength ) {
+    snprintf(line, sizeof(line), "Content-Length: %zu\r\n", _contentLength);
+    head += line;
+  }
+  if( _chunked ) {
+    head += "Transfer-Encoding: chunked\r\n";
+  }
+  return head + _headers + "\r\n";
+}
+
+AsyncBasicResponse::AsyncBasicResponse( int code, const char *contentType, const uint8_t *data, size_t len )
+  : AsyncWebServerResponse(code, contentType), _content((const char *)data, len) {
+  _contentLength = len;
+}
+
+size_t AsyncBasicResponse::_fill( uint8_t *buf, size_t maxLen ) {
+  size_t len = std::min(maxLen, _content.size() - _pos);
+  memcpy(buf, &_content[_pos], len);
+  _pos += len;
+  return len;
+}
+
+AsyncCallbackResponse::AsyncCallbackResponse( const char *contentType, size_t len, AwsResponseFiller callback, bool chunked )
+  : _callback(callback) {
+  _code = 200;
+  _contentType = contentType;
+  _contentLength = len;
+  _sendContentLength = !chunked;
+  _chunked = chunked;
+}
+
+size_t AsyncCallbackResponse::_fillBuffer( uint8_t *buf, size_t maxLen ) {
+  if( _sendContentLength ) {
+    maxLen = std::min(maxLen, _contentLength - _index);
+  }
+  size_t len = maxLen ? _callback(buf, maxLen, _index) : 0;
+  _index += len;
+  return len;
+}
+
+// Chunked like ESPAsyncWebServer: hex size, data, CRLF, and a last chunk of size 0
+size_t AsyncAbstractResponse::_fill( uint8_t *buf, size_t maxLen ) {
+  if( !_sourceValid() ) {
+    return 0;
+  }
+  if( !_chunked ) {
+    return _fillBuffer(buf, maxLen);
+  }
+  if( _last_sent ) {
+    return 0;
+  }
+  size_t len = _fillBuffer(&buf[6], maxLen - 8);
+  if( !len ) {
+    _last_sent = true;
+    memcpy(buf, "0\r\n\r\n", 5);
+    return 5;
+  }
+  char head[8];
+  snprintf(head, sizeof(head), "%04zx\r\n", len);
+  memcpy(buf, head, 6);
+  memcpy(&buf[6 + len], "\r\n", 2);
+  return len + 8;
+}
+
+AsyncResponseStream::AsyncResponseStream( const char *contentType, size_t bufferSize )
+  : AsyncWebServerResponse(200, contentType) {
+  _content.reserve(bufferSize);
+}
+
+size_t AsyncResponseStream::write( const uint8_t *data, size_t len ) {
+  _content.append((const char *)data, len);
+  _contentLength = _content.size();
+  return len;
+}
+
+size_t AsyncResponseStream::_fill( uint8_t *buf, size_t maxLen ) {
+  size_t len = std::min(maxLen, _content.size() - _pos);
+  memcpy(buf, &_content[_pos], len);
+  _pos += len;
+  return len;
+}
+
+/*
+Request
+ The client owns the request: it is deleted with the client when the
+ connection closes, after the response was sent or the peer went away.
+ */
+AsyncWebServerRequest::AsyncWebServerRequest( AsyncWebServer *server, AsyncClient *client )
+  : _server(server), _client(client) {
+  client->onData([](void *arg, AsyncClient *client, void *data, size_t len) {
+    ((AsyncWebServerRequest *)arg)->onData((const uint8_t *)data, len);
+  }, this);
+  client->onAck([](void *arg, AsyncClient *client, size_t len, uint32_t time) {
+    ((AsyncWebServerRequest *)arg)->sendMore();
+  }, this);
+  client->onDisconnect([](void *arg, AsyncClient *client) {
+    delete (AsyncWebServerRequest *)arg;
+    delete client;
+  }, this);
+  client->setRxTimeout(3);
+}
+
+AsyncWebServerRequest::~AsyncWebServerRequest() {
+  if( _onDisconnect ) {
+    _onDisconnect();
+  }
+  delete _response;
+}
+
+static std::string url_decode( const std::string &str ) {
+  std::string out;
+  for( size_t i = 0; i < str.size(); i++ ) {
+    if( str[i] == '%' && i + 2 < str.size() ) {
+      out += (char)strtol(str.substr(i + 1, 2).c_str(), 0, 16);
+      i += 2;
+    }
+    else {
+      out += str[i] == '+' ? ' ' : str[i];
+    }
+  }
+  return out;
+}
+
+void AsyncWebServerRequest::parseHead() {
+  std::string head = _in.substr(0, _head_len);
+  size_t eol = head.find("\r\n");
+  std::string line = head.substr(0, eol);
+  size_t sp1 = line.find(' ');
+  size_t sp2 = line.find(' ', sp1 + 1);
+  std::string method = line.substr(0, sp1);
+  std::string target = sp1 == std::string::npos ? "/" : line.substr(sp1 + 1, sp2 - sp1 - 1);
+  _method = method == "GET" ? HTTP_GET : method == "POST" ? HTTP_POST : method == "HEAD" ? HTTP_HEAD
+          : method == "PUT" ? HTTP_PUT : method == "DELETE" ? HTTP_DELETE : HTTP_OPTIONS;
+  size_t query = target.find('?');
+  _url = String(target.substr(0, query));
+  while( query != std::string::npos ) {
+    size_t next = target.find('&', query + 1);
+    std::string param = target.substr(query + 1, next == std::string::npos ? std::string::npos : next - query - 1);
+    size_t eq = param.find('=');
+    _params.emplace(url_decode(param.substr(0, eq)), AsyncWebParameter(eq == std::string::npos ? "" : url_decode(param.substr(eq + 1))));
+    query = next;
+  }
+  while( eol != std::string::npos && eol + 2 < head.size() ) {
+    size_t next = head.find("\r\n", eol + 2);
+    line = head.substr(eol + 2, next - eol - 2);
+    size_t colon = line.find(':');
+    if( colon != std::string::npos ) {
+      std::string name = line.substr(0, colon);
+      std::string value = line.substr(colon + 1);
+      value.erase(0, value.find_first_not_of(' '));
+      for( char &c : name ) {
+        c = tolower(c);
+      }
+      _headers.emplace(name, AsyncWebHeader(value));
+    }
+    eol = next;
+  }
+  const AsyncWebHeader *length = getHeader("Content-Length");
+  _body_len = length ? strtoul(length->value().c_str(), 0, 10) : 0;
+}
+
+void AsyncWebServerRequest::onData( const uint8_t *data, size_t len ) {
+  if( _dispatched ) {
+    return;
+  }
+  _in.append((const char *)data, len);
+  if( !_head_len ) {
+    size_t end = _in.find("\r\n\r\n");
+    if( end == std::string::npos ) {
+      if( _in.size() > 8192 ) {
+        _client->close();
+      }
+      return;
+    }
+    _head_len = end + 4;
+    parseHead();
+  }
+  if( _body_len > WEB_MAX_REQUEST ) {
+    _dispatched = true;
+    send(400, "text/plain", "Too large\n");
+    return;
+  }
+  if( _in.size() >= _head_len + _body_len ) {
+    _dispatched = true;
+    dispatch();
+  }
+}
+
+void AsyncWebServerRequest::dispatch() {
+  const AsyncCallbackWebHandler *handler = _server->_find(_url.c_str(), _method);
+  if( !handler ) {
+    if( _server->_notFound ) {
+      _server->_notFound(this);
+    }
+    else {
+      send(404);
+    }
+    return;
+  }
+  if( _body_len && handler->_onUpload ) {
+    // multipart/form-data with one file: data between the part headers and the closing boundary
+    std::string body = _in.substr(_head_len, _body_len);
+    size_t boundary_end = body.find("\r\n");
+    size_t data_start = body.find("\r\n\r\n");
+    if( boundary_end != std::string::npos && data_start != std::string::npos ) {
+      std::string boundary = "\r\n" + body.substr(0, boundary_end);
+      std::string part_head = body.substr(0, data_start);
+      size_t name = part_head.find("filename=\"");
+      std::string filename = name == std::string::npos ? "" : part_head.substr(name + 10, part_head.find('"', name + 10) - name - 10);
+      data_start += 4;
+      size_t data_end = body.find(boundary, data_start);
+      if( data_end == std::string::npos ) {
+        data_end = body.size();
+      }
+      handler->_onUpload(this, String(filename), 0, (uint8_t *)&body[data_start], data_end - data_start, true);
+    }
+  }
+  else if( _body_len && handler->_onBody ) {
+    handler->_onBody(this, (uint8_t *)&_in[_head_len], _body_len, 0, _body_len);
+  }
+  if( handler->_onRequest ) {
+    handler->_onRequest(this);
+  }
+}
+
+void AsyncWebServerRequest::send( AsyncWebServerResponse *response ) {
+  if( _response ) {
+    delete response;  // only the first response counts
+    return;
+  }
+  _response = response;
+  std::string head = response->_head();
+  _client->add(head.data(), head.size());  // fits the empty send buffer
+  _head_sent = true;
+  sendMore();
+}
+
+void AsyncWebServerRequest::sendMore() {
+  if( !_response || !_head_sent ) {
+    return;
+  }
+  uint8_t buf[1460];
+  while( !_body_done && _client->space() >= 16 ) {  // room for a chunk frame
+    size_t len = (_method == HTTP_HEAD) ? 0 : _response->_fill(buf, std::min(sizeof(buf), _client->space()));
+    if( !len ) {
+      _body_done = true;
+      break;
+    }
+    _client->add((const char *)buf, len);
+  }
+  _client->send();
+  if( _body_done && _client->_sent() ) {
+    _client->close();
+  }
+}
+
+void AsyncWebServerRequest::send( int code, const char *contentType, const char *content ) {
+  send(beginResponse(code, contentType, content));
+}
+
+void AsyncWebServerRequest::redirect( const char *url ) {
+  AsyncWebServerResponse *response = beginResponse(302);
+  response->addHeader("Location", url);
+  send(response);
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse( int code, const char *contentType, const char *content ) {
+  return new AsyncBasicResponse(code, contentType, (const uint8_t *)content, strlen(content));
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse_P( int code, const char *contentType, const uint8_t *content, size_t len ) {
+  return new AsyncBasicResponse(code, contentType, content, len);
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse( const char *contentType, size_t len, AwsResponseFiller callback ) {
+  return new AsyncCallbackResponse(contentType, len, callback, false);
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginChunkedResponse( const char *contentType, AwsResponseFiller callback ) {
+  return new AsyncCallbackResponse(contentType, 0, callback, true);
+}
+
+AsyncResponseStream *AsyncWebServerRequest::beginResponseStream( const char *contentType, size_t bufferSize ) {
+  return new AsyncResponseStream(contentType, bufferSize);
+}
+
+bool AsyncWebServerRequest::hasParam( const char *name, bool post ) const {
+  return _params.count(name) > 0;
+}
+
+const AsyncWebParameter *AsyncWebServerRequest::getParam( const char *name, bool post ) const {
+  auto it = _params.find(name);
+  return it == _params.end() ? 0 : &it->second;
+}
+
+bool AsyncWebServerRequest::hasHeader( const char *name ) const {
+  return getHeader(name) != 0;
+}
+
+const AsyncWebHeader *AsyncWebServerRequest::getHeader( const char *name ) const {
+  std::string key = name;
+  for( char &c : key ) {
+    c = tolower(c);
+  }
+  auto it = _headers.find(key);
+  return it == _headers.end() ? 0 : &it->second;
+}
+
+/*
+Server
+ */
+AsyncWebServer::AsyncWebServer( uint16_t port ) : _server(port) {
+  _server.onClient([](void *arg, AsyncClient *client) {
+    new AsyncWebServerRequest((AsyncWebServer *)arg, client);
+  }, this);
+}
+
+AsyncCallbackWebHandler &AsyncWebServer::on( const char *uri, ArRequestHandlerFunction onRequest ) {
+  return on(uri, HTTP_ANY, onRequest, nullptr, nullptr);
+}
+
+AsyncCallbackWebHandler &AsyncWebServer::on( const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest ) {
+  return on(uri, method, onRequest, nullptr, nullptr);
+}
+
+AsyncCallbackWebHandler &AsyncWebServer::on( const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload, ArBodyHandlerFunction onBody ) {
+  AsyncCallbackWebHandler *handler = new AsyncCallbackWebHandler();
+  handler->_uri = uri;
+  handler->_method = method;
+  handler->_onRequest = onRequest;
+  handler->_onUpload = onUpload;
+  handler->_onBody = onBody;
+  _handlers.push_back(handler);
+  return *handler;
+}
+
+void AsyncWebServer::begin() {
+  _server.begin();
+}
+
+const AsyncCallbackWebHandler *AsyncWebServer::_find( const std::string &uri, int method ) const {
+  for( const AsyncCallbackWebHandler *handler : _handlers ) {
+    if( handler->_uri == uri && (handler->_method & method) ) {
+      return handler;
+    }
+  }
+  return 0;
+}
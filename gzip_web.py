@@ -0,0 +1,52 @@
+# Compress web/index.html into include/dashboard.h before each build
+# The dashboard is served from flash as precompressed gzip asset
+import gzip
+import hashlib
+import os
+
+try:
+    Import("env")
+    project_dir = env.subst("$PROJECT_DIR")
+    config = env.GetProjectConfig()
+    version = config.get("program", "version")
+    progname = config.get("program", "name")
+except NameError:  # run standalone
+    project_dir = os.path.dirname(os.path.abspath(__file__))
+    version = "8.2"
+    progname = "power"
+
+source = os.path.join(project_dir, "web", "index.html")
+target = os.path.join(project_dir, "include", "dashboard.h")
+
+with open(source, "rb") as f:
+    html = f.read().replace(b"@VERSION@", version.encode()).replace(b"@PROGNAME@", progname.encode())
+
+data = gzip.compress(html, compresslevel=9, mtime=0)
+etag = hashlib.md5(data).hexdigest()[:16]
+
+lines = []
+for pos in range(0, len(data), 16):
+    lines.append("  " + ",".join("0x%02x" % b for b in data[pos:pos + 16]) + ",")
+
+header = """/* Generated by gzip_web.py from web/index.html - do not edit */
+
+#ifndef ELECTRICITYMETER_DASHBOARD_H
+#define ELECTRICITYMETER_DASHBOARD_H
+
+#define DASHBOARD_ETAG "\\"%s\\""
+
+const uint8_t dashboard_gz[] PROGMEM = {
+%s
+};
+
+#endif // ELECTRICITYMETER_DASHBOARD_H
+""" % (etag, "\n".join(lines))
+
+old = None
+if os.path.exists(target):
+    with open(target) as f:
+        old = f.read()
+if old != header:
+    with open(target, "w") as f:
+        f.write(header)
+print("Dashboard: %d bytes html, %d bytes gzip" % (len(html), len(data)))
@@ -67,6 +67,14 @@
 #define WLED_BACKFEED_GOOD 200
 #endif
 
+#ifndef WLED_MODE
+#define WLED_MODE 0
+#endif
+
+#ifndef WLED_BAR_W
+#define WLED_BAR_W 100
+#endif
+
 #ifndef MQTT_BROKER
 #define MQTT_BROKER "job4"
 #endif
@@ -0,0 +1,529 @@
+#include "sml.h"
+
+#include <stdio.h>
+#include <string.h>
+
+sml_put_t sml_frame_put( sml_framer_t *framer, uint8_t ch ) {
+  switch( framer->mode ) {
+    case SML_FRAME_NONE:
+      if( ch == 0x1b ) {
+        framer->mode = SML_FRAME_START;
+        framer->count = 1;
+      }
+      break;
+    case SML_FRAME_START:
+      if( ch == 0x1b ) {
+        if( ++framer->count == 4 ) {
+          framer->mode = SML_FRAME_VER;
+          framer->count = 0;
+        }
+      }
+      else {
+        framer->mode = SML_FRAME_NONE;
+      }
+      break;
+    case SML_FRAME_VER:
+      if( ch == 0x01 ) {
+        if( ++framer->count == 4 ) {
+          framer->mode = SML_FRAME_DATA;
+          framer->count = 0;
+          return SML_PUT_BEGIN;
+        }
+      }
+      else {
+        framer->mode = SML_FRAME_NONE;
+      }
+      break;
+    case SML_FRAME_DATA:
+      if( framer->count == framer->size ) {
+        framer->mode = SML_FRAME_NONE;  // record too long, wait for next start sequence
+        return SML_PUT_OVERFLOW;
+      }
+      framer->buf[framer->count++] = ch;
+      if( framer->count % 4 == 1 && ch == 0x1b ) {
+        framer->mode = SML_FRAME_END;
+      }
+      break;
+    case SML_FRAME_END:
+      if( framer->count == framer->size ) {
+        framer->mode = SML_FRAME_NONE;
+        return SML_PUT_OVERFLOW;
+      }
+      framer->buf[framer->count++] = ch;
+      if( framer->count % 4 != 0 && ch != 0x1b ) {
+        framer->mode = SML_FRAME_DATA;
+      }
+      else if( framer->count % 4 == 0 ) {
+        framer->mode = SML_FRAME_FINISH;
+        framer->count -= 4;
+      }
+      break;
+    case SML_FRAME_FINISH:
+      framer->mode = SML_FRAME_NONE;
+      if( ch == 0x1a ) {
+        return SML_PUT_DONE;
+      }
+      break;
+  }
+  return SML_PUT_BUSY;
+}
+
+#define SML_ESC_WORD 0x1b1b1b1bu
+
+// Offset of the first escape byte 0x1b in data or len, word at a time
+static size_t find_escape_byte( const uint8_t *data, size_t len ) {
+  size_t pos = 0;
+  while( pos < len && ((uintptr_t)&data[pos] & 3) ) {
+    if( data[pos] == 0x1b ) {
+      return pos;
+    }
+    pos++;
+  }
+  while( pos + 4 <= len ) {
+    uint32_t word;
+    memcpy(&word, __builtin_assume_aligned(&data[pos], 4), sizeof(word));
+    word ^= SML_ESC_WORD;  // escape bytes become 0
+    if( (word - 0x01010101u) & ~word & 0x80808080u ) {
+      break;  // one of the 4 bytes is an escape byte
+    }
+    pos += 4;
+  }
+  while( pos < len && data[pos] != 0x1b ) {
+    pos++;
+  }
+  return pos;
+}
+
+size_t sml_frame_write( sml_framer_t *framer, const uint8_t *data, size_t len, sml_put_t *event ) {
+  size_t pos = 0;
+  *event = SML_PUT_BUSY;
+  while( pos < len ) {
+    if( framer->mode == SML_FRAME_NONE ) {
+      pos += find_escape_byte(&data[pos], len - pos);  // bytes before a start sequence are ignored
+      if( pos == len ) {
+        break;
+      }
+    }
+    else if( framer->mode == SML_FRAME_DATA && framer->count % 4 == 0 ) {
+      // escape sequences are aligned groups of 4 escape bytes: copy the groups before the next one
+      size_t groups = (len - pos) & ~(size_t)3;
+      size_t space = (framer->size - framer->count) & ~(size_t)3;
+      size_t n = 0;
+      if( groups > space ) {
+        groups = space;
+      }
+      while( n < groups ) {
+        uint32_t word;
+        if( data[pos + n] == 0x1b && (memcpy(&word, &data[pos + n], sizeof(word)), word == SML_ESC_WORD) ) {
+          break;
+        }
+        n += 4;
+      }
+      if( n ) {
+        memcpy(&framer->buf[framer->count], &data[pos], n);
+        framer->count += n;
+        pos += n;
+        continue;
+      }
+    }
+    sml_put_t result = sml_frame_put(framer, data[pos++]);
+    if( result != SML_PUT_BUSY ) {
+      *event = result;
+      break;
+    }
+  }
+  return pos;
+}
+
+uint64_t sml_power_w( uint64_t current_1_10Wh, uint64_t previous_1_10Wh, uint32_t delta_time_s ) {
+  // (reading1 - reading0) * (1/10 Wh) / time_h * 3600 = power_W
+  // = (reading1 - reading0) * 360 / time_s
+  return (current_1_10Wh - previous_1_10Wh) * 360 / delta_time_s;
+}
+
+uint64_t pow10( uint64_t val, int8_t exp ) {
+  if( exp < 0 ) {
+    while( exp++ ) {
+      val /= 10;
+    }
+  }
+  else {
+    while( exp-- ) {
+      val *= 10;
+    }
+  }
+  return val;
+}
+
+/*
+Parse relevant data from Itron 3.Hz meter
+ itron: pointer to structure with relevant values
+ level: list level
+ pos:   in current sml value structure
+ type:  data type (0, 4, 5, 6 from SML)
+ data:  data of given type or 0 for end marker
+ */
+void parse_itron_3hz( itron_3hz_t *itron, size_t level, size_t pos, size_t type, const void *data ) {
+  bool &fileOpen = itron->parser.fileOpen;
+  sml_message_t &messageType = itron->parser.messageType;
+  bool &isMeterId = itron->parser.isMeterId;
+  bool &isMeterSerial = itron->parser.isMeterSerial;
+  bool &isMeterAplus = itron->parser.isMeterAplus;
+  bool &isMeterAminus = itron->parser.isMeterAminus;
+  uint8_t &unit = itron->parser.unit;
+  int8_t &scale = itron->parser.scale;
+  uint8_t &power = itron->parser.power;
+  
+  if( level == 2 && pos == 0 && type == 6 ) {  // SML message type
+    messageType = (sml_message_t)*(uint64_t *)data;
+    if( messageType == SML_OPEN ) {
+      fileOpen = true;
+    }
+    else if( messageType == SML_CLOSE ) {
+      fileOpen = false;
+    }
+  }
+  else if( messageType == SML_OPEN && level == 3 && pos == 2 && type == 0 ) {  // file id
+    size_t len = sizeof(uint64_t);
+    uint8_t *record = (uint8_t *)data;
+    while( len-- ) {
+      itron->file = (itron->file << 8) | *(record++);
+    }
+    itron->valid |= 4;
+  }
+  else if( fileOpen && messageType == SML_LIST ) {
+    if( level == 4 && pos == 1 && type == 6 ) {  // uptime
+      itron->uptime = *(uint64_t *)data;
+      itron->valid |= 8;
+    }
+    else if( level == 5 ) {  // SML value structure
+      if( pos == 0 && type == 0 ) {  // obis id
+        char *obis = (char *)data;
+        power = 0;
+        if( obis[0] == 0x01 && obis[1] == 0 ) {
+          if( obis[2] == 0x60 && obis[3] == 0x32 && obis[4] == 0x01) {
+            isMeterId = true;
+          }
+          else if( obis[2] == 0x60 && obis[3] == 0x01 && obis[4] == 0x00) {
+            isMeterSerial = true;
+          }
+          else if( obis[2] == 0x01 && obis[3] == 0x08 && obis[4] == 0x00) {
+            isMeterAplus = true;
+          }
+          else if( obis[2] == 0x02 && obis[3] == 0x08 && obis[4] == 0x00) {
+            isMeterAminus = true;
+          }
+          else if( obis[3] == 0x07 && obis[4] == 0x00 ) {  // instantaneous power total, L1, L2, L3
+            switch( obis[2] ) {
+              case 0x10: power = SML_POWER_TOTAL; break;
+              case 0x24: power = SML_POWER_L1; break;
+              case 0x38: power = SML_POWER_L1 << 1; break;
+              case 0x4c: power = SML_POWER_L1 << 2; break;
+            }
+          }
+        }
+      }
+      else if( (isMeterAplus || isMeterAminus || power) && pos == 3 && type == 6 ) {  // unit
+        unit = *(uint64_t *)data;
+      }
+      else if( (isMeterAplus || isMeterAminus || power) && pos == 4 && type == 5 ) {  // scale
+        scale = *(int64_t *)data;
+        if( !power ) {
+          // scale ==  3: coarse kWh readings after power failure
+          // scale == -1: fine 1/10Wh readings (needs itr pin and menu setting)
+          itron->detailed = (scale == 3) ? false : true;
+        }
+      }
+      else if( pos == 5 ) {  // SML value
+        if( isMeterId && type == 0 ) {  // meter id
+          memcpy(itron->id, data, sizeof(itron->id));
+          itron->valid |= 1;
+          isMeterId = false;
+        }
+        else if( isMeterSerial && type == 0 ) {  // meter serial
+          memcpy(itron->serial, data, sizeof(itron->serial));
+          itron->valid |= 2;
+          isMeterSerial = false;
+        }
+        else if( isMeterAplus && type == 6 ) {  // A+ value
+          if( unit == 30 ) {  // expecting [Wh]
+            itron->aPlus = pow10(*(uint64_t *)data, scale+1);
+            itron->valid |= 16;
+          }
+          unit = 0;
+          scale = 0;
+          isMeterAplus = false;
+        }
+        else if( isMeterAminus && type == 6 ) {  // A- value
+          if( unit == 30 ) {  // expecting [Wh]
+            itron->aMinus = pow10(*(uint64_t *)data, scale+1);
+            itron->valid |= 32;
+          }
+          unit = 0;
+          scale = 0;
+          isMeterAminus = false;
+        }
+        else if( power && (type == 5 || type == 6) ) {  // power value, signed or unsigned
+          if( unit == 27 ) {  // expecting [W]
+            int64_t value = (type == 5) ? *(int64_t *)data : (int64_t)*(uint64_t *)data;
+            int32_t watt = (value < 0) ? -(int64_t)pow10(-value, scale) : pow10(value, scale);
+            if( power == SML_POWER_TOTAL ) {
+              itron->power = watt;
+            }
+            else {
+              itron->phase[power == SML_POWER_L1 ? 0 : (power == SML_POWER_L1 << 1 ? 1 : 2)] = watt;
+            }
+            itron->power_valid |= power;
+          }
+          unit = 0;
+          scale = 0;
+          power = 0;
+        }
+      }
+    }
+  }
+}
+
+// Collect entries of the value lists into itron->obis (see sml.h, Generic OBIS table)
+static void obis_add( itron_3hz_t *itron, size_t level, size_t pos, size_t type, const void *data, size_t len ) {
+  sml_obis_table_t *table = itron->obis;
+  if( !table || level != 5 || !itron->parser.fileOpen || itron->parser.messageType != SML_LIST ) {
+    return;
+  }
+  if( pos == 0 ) {  // obis id starts an entry
+    table->open = false;
+    if( type != 0 || len != sizeof(table->entry[0].obis) ) {
+      return;
+    }
+    if( table->count >= SML_OBIS_MAX ) {
+      if( table->dropped < 0xff ) {
+        table->dropped++;
+      }
+      return;
+    }
+    sml_obis_entry_t *entry = &table->entry[table->count];
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->obis, data, sizeof(entry->obis));
+    table->open = true;
+    return;
+  }
+  if( !table->open ) {
+    return;
+  }
+  sml_obis_entry_t *entry = &table->entry[table->count];
+  if( pos == 3 && type == 6 ) {
+    entry->unit = *(const uint64_t *)data;
+  }
+  else if( pos == 4 && type == 5 ) {
+    entry->scaler = *(const int64_t *)data;
+  }
+  else if( pos == 5 ) {  // value completes the entry
+    switch( type ) {
+      case 0:
+        entry->len = len > 0xff ? 0xff : len;
+        memcpy(entry->value.octets, data, len < SML_OBIS_OCTETS ? len : SML_OBIS_OCTETS);
+        break;
+      case 4:
+        entry->value.u = *(const char *)data ? 1 : 0;
+        break;
+      case 5:
+        entry->value.i = *(const int64_t *)data;
+        break;
+      case 6:
+        entry->value.u = *(const uint64_t *)data;
+        break;
+      default:
+        return;  // lists are not collected
+    }
+    entry->type = type;
+    table->open = false;
+    table->count++;
+  }
+}
+
+/*
+SML parser (assuming valid SML 1.x)
+ itron: pointer to structure to store relevant values
+ data:  sml data of unknown length (whole record or list)
+ items: list items (or high number if unknown)
+ level: of nested lists
+ */
+char *read_sml( itron_3hz_t *itron, char *data, size_t items, size_t level ) {
+  size_t pos = 0;
+
+  if( level == 0 && itron->obis ) {
+    itron->obis->count = 0;
+    itron->obis->dropped = 0;
+    itron->obis->open = false;
+  }
+
+  while( items-- ) {
+    size_t type = (*data >> 4) & 0x7;
+    
+    size_t len = *data & 0xf;
+    while( *(data++) & 0x80 ) {
+      len = (len << 4) + (*data & 0xf);
+    }
+
+    uint64_t u = 0;
+    int64_t i = 0;
+
+    switch( type ) {
+      case 0:  // octet
+        if( len == 0 ) {
+          parse_itron_3hz(itron, level, pos, type, 0);
+          sml_debug(level, pos, type, len, "end");
+          return data;
+        }
+        else {
+          parse_itron_3hz(itron, level, pos, type, data);
+          obis_add(itron, level, pos, type, data, len - 1);
+          if( --len == 0 ) {
+            sml_debug(level, pos, type, len, "default");
+          } 
+          else {
+            #ifdef SML_DEBUG
+            char hex[3 * 32];
+            sml_debug(level, pos, type, len, "%s", hex_str(hex, sizeof(hex), data, len, ' '));
+            #endif
+            data += len;
+          }
+        }
+        break;
+      case 4:  // bool
+        parse_itron_3hz(itron, level, pos, type, data);
+        obis_add(itron, level, pos, type, data, 1);
+        sml_debug(level, pos, type, len, *data ? "true" : "false");
+        data++;
+        break;
+      case 5:  // int
+        {
+          size_t bytes = 0;
+          while( len-- >= 2 ) {
+            i = (i << 8) | (uint8_t)*(data++);
+            bytes++;
+          }
+          if( bytes && bytes < 8 && (i >> (8 * bytes - 1)) & 1 ) {
+            i -= (int64_t)1 << (8 * bytes);  // sign extend
+          }
+        }
+        parse_itron_3hz(itron, level, pos, type, &i);
+        obis_add(itron, level, pos, type, &i, sizeof(i));
+        sml_debug(level, pos, type, len, "%lld", i);
+        break;
+      case 6:  // unsigned int
+        while (len-- >= 2) {
+          u = (u << 8) | (uint8_t)*(data++);
+        }
+        parse_itron_3hz(itron, level, pos, type, &u);
+        obis_add(itron, level, pos, type, &u, sizeof(u));
+        sml_debug(level, pos, type, len, "%llu", u);
+        break;
+      case 7:  // list
+        sml_debug(level, pos, type, len, "list[%u]", len);
+        data = read_sml(itron, data, len, level + 1);
+        break;
+    }
+    pos++;
+  }
+  return data;
+}
+
+char *hex_str( char *out, size_t size, const void *buf, size_t len, char sep ) {
+  static const char digits[] = "0123456789abcdef";
+  const uint8_t *in = (const uint8_t *)buf;
+  char *pos = out;
+  while( len-- && size >= 3 ) {
+    *(pos++) = digits[*in >> 4];
+    *(pos++) = digits[*(in++) & 0xf];
+    *(pos++) = sep;
+    size -= 3;
+  }
+  if( pos != out ) {
+    pos--;  // cut last separator
+  }
+  *pos = '\0';
+  return out;
+}
+
+int itron_line( char *out, size_t size, const itron_3hz_t *itron, uint64_t time_ms ) {
+  char serial[SERIAL_HEX_SIZE];
+  hex_str(serial, sizeof(serial), itron->serial, sizeof(itron->serial), '-');
+  return snprintf(out, size, "energy,meter=%s watt=%llu,watt_out=%llu %llu\n",
+    serial, (unsigned long long)(itron->aPlus+5)/10, (unsigned long long)(itron->aMinus+5)/10, (unsigned long long)time_ms);
+}
+
+int itron_json( char *out, size_t size, const itron_3hz_t *itron, bool detailed ) {
+  char serial[SERIAL_HEX_SIZE];
+  hex_str(serial, sizeof(serial), itron->serial, sizeof(itron->serial), '-');
+  return snprintf(out, size, " \"energy\": {\n  \"id\": \"%3.3s\",\n  \"serial\": \"%s\",\n"
+    "  \"detailed\": \"%s\",\n  \"uptime\": %u,\n  \"aplus\": %.1f,\n  \"aminus\": %.1f\n },\n",
+    itron->id, serial, detailed ? "yes" : "no", itron->uptime, itron->aPlus/10.0, itron->aMinus/10.0);
+}
+
+char *sml_obis_str( char *out, size_t size, const uint8_t *obis ) {
+  int len = snprintf(out, size, "%u-%u:%u.%u.%u", obis[0], obis[1], obis[2], obis[3], obis[4]);
+  if( obis[5] != 0xff && len >= 0 && (size_t)len < size ) {
+    snprintf(&out[len], size - len, "*%u", obis[5]);
+  }
+  return out;
+}
+
+const char *sml_unit_name( uint8_t unit ) {
+  switch( unit ) {
+    case 8: return "deg";
+    case 9: return "degC";
+    case 27: return "W";
+    case 28: return "VA";
+    case 29: return "var";
+    case 30: return "Wh";
+    case 31: return "VAh";
+    case 32: return "varh";
+    case 33: return "A";
+    case 35: return "V";
+    case 44: return "Hz";
+    default: return "";
+  }
+}
+
+bool sml_obis_value( const sml_obis_entry_t *entry, double *value ) {
+  double v;
+  switch( entry->type ) {
+    case 4:
+    case 6:
+      v = (double)entry->value.u;
+      break;
+    case 5:
+      v = (double)entry->value.i;
+      break;
+    default:
+      return false;
+  }
+  for( int8_t s = entry->scaler; s > 0; s-- ) {
+    v *= 10;
+  }
+  for( int8_t s = entry->scaler; s < 0; s++ ) {
+    v /= 10;
+  }
+  *value = v;
+  return true;
+}
+
+int sml_obis_line( char *out, size_t size, const sml_obis_table_t *table, const char *meter, uint64_t time_ms ) {
+  int len = snprintf(out, size, "obis,meter=%s", meter);
+  char sep = ' ';
+  for( size_t i = 0; i < table->count && len >= 0 && (size_t)len < size; i++ ) {
+    const sml_obis_entry_t *entry = &table->entry[i];
+    double value;
+    if( sml_obis_value(entry, &value) ) {
+      char obis[24];
+      int decimals = entry->scaler < 0 ? -entry->scaler : 0;
+      len += snprintf(&out[len], size - len, "%c%s=%.*f", sep, sml_obis_str(obis, sizeof(obis), entry->obis), decimals, value);
+      sep = ',';
+    }
+  }
+  if( sep == ' ' || len < 0 || (size_t)len >= size ) {
+    return 0;  // no numeric entries or no space
+  }
+  return len + snprintf(&out[len], size - len, " %llu\n", (unsigned long long)time_ms);
+}
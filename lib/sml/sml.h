@@ -0,0 +1,143 @@
+/*
+SML decoder for the Itron 3.HZ meter
+
+ Framing, parsing and formatting of SML records without Arduino
+ dependencies, so the same code runs in the firmware, in host tools
+ and in benchmarks.
+ */
+
+#ifndef SML_H
+#define SML_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum { SML_NONE=0, SML_OPEN=0x0101, SML_LIST=0x0701, SML_CLOSE=0x0201 } sml_message_t;
+
+// Decoder state of the current record (per reading, so records can be decoded in parallel)
+typedef struct sml_parser {
+  bool fileOpen;
+  sml_message_t messageType;
+  bool isMeterId;
+  bool isMeterSerial;
+  bool isMeterAplus;
+  bool isMeterAminus;
+  uint8_t unit;
+  int8_t scale;
+  uint8_t power;  // 0 or SML_POWER_* of the current value
+} sml_parser_t;
+
+// Instantaneous power registers (bits in power_valid)
+#define SML_POWER_TOTAL 1  // 1-0:16.7.0
+#define SML_POWER_L1 2     // 1-0:36.7.0, L2 and L3 (56.7.0, 76.7.0) are the next bits
+
+/*
+Generic OBIS table
+ With obis set in itron_3hz_t, read_sml() also collects every entry of the
+ value lists of any SML meter: obis id, unit, scaler and value (numbers,
+ booleans or the first SML_OBIS_OCTETS bytes of octet strings). Entries
+ beyond SML_OBIS_MAX are counted as dropped. Nothing is allocated.
+ */
+#ifndef SML_OBIS_MAX
+#define SML_OBIS_MAX 16
+#endif
+#define SML_OBIS_OCTETS 16
+
+typedef struct sml_obis_entry {
+  uint8_t obis[6];
+  uint8_t unit;    // DLMS unit code, 0 if not given
+  int8_t scaler;   // value * 10^scaler
+  uint8_t type;    // SML type of the value: 0 octets, 4 bool, 5 int, 6 unsigned
+  uint8_t len;     // length of an octet string value, can exceed SML_OBIS_OCTETS
+  union {
+    int64_t i;
+    uint64_t u;
+    uint8_t octets[SML_OBIS_OCTETS];
+  } value;
+} sml_obis_entry_t;
+
+typedef struct sml_obis_table {
+  uint8_t count;    // complete entries
+  uint8_t dropped;  // entries that did not fit
+  bool open;        // entry[count] is being filled
+  sml_obis_entry_t entry[SML_OBIS_MAX];
+} sml_obis_table_t;
+
+typedef struct itron_3hz {
+  uint8_t valid;  // valid if 63 (one bit for each field)
+  char id[3];
+  char serial[10];
+  uint64_t file;
+  uint32_t uptime;
+  uint64_t aPlus;  // now 1/10 Wh
+  uint64_t aMinus; // now 1/10 Wh
+  bool detailed;
+  uint8_t power_valid;  // SML_POWER_* bits of the registers present, optional
+  int32_t power;        // [W] import positive, export negative
+  int32_t phase[3];     // [W] per phase, same sign
+  sml_parser_t parser;
+  sml_obis_table_t *obis;  // optional, cleared and filled by read_sml()
+} itron_3hz_t;
+
+#define SERIAL_HEX_SIZE (sizeof(((itron_3hz_t *)0)->serial) * 3)
+
+/*
+Record framer
+ Feed received bytes one by one. A record starts after the escape
+ sequence 1b1b1b1b 01010101, on SML_PUT_BEGIN the caller sets buf and
+ size (size 0 drops the record). On SML_PUT_DONE the record without
+ start and end sequences is in buf with length count, buf needs 4 bytes
+ more than the longest record for the end sequence.
+ */
+typedef enum { SML_FRAME_NONE, SML_FRAME_START, SML_FRAME_VER, SML_FRAME_DATA, SML_FRAME_END, SML_FRAME_FINISH } sml_frame_mode_t;
+typedef enum { SML_PUT_BUSY, SML_PUT_BEGIN, SML_PUT_DONE, SML_PUT_OVERFLOW } sml_put_t;
+
+typedef struct sml_framer {
+  uint8_t mode;   // sml_frame_mode_t
+  size_t count;   // bytes of escape sequence or record
+  char *buf;      // record buffer
+  size_t size;    // size of buf
+} sml_framer_t;
+
+sml_put_t sml_frame_put( sml_framer_t *framer, uint8_t ch );
+
+// Feed a block of received bytes, stops after the first byte that is not SML_PUT_BUSY
+// (returned in event) and returns the bytes used. Same results as sml_frame_put() per byte.
+size_t sml_frame_write( sml_framer_t *framer, const uint8_t *data, size_t len, sml_put_t *event );
+
+// Power [W] from two energy readings [1/10 Wh] delta_time_s apart
+uint64_t sml_power_w( uint64_t current_1_10Wh, uint64_t previous_1_10Wh, uint32_t delta_time_s );
+
+uint64_t pow10( uint64_t val, int8_t exp );
+void parse_itron_3hz( itron_3hz_t *itron, size_t level, size_t pos, size_t type, const void *data );
+char *read_sml( itron_3hz_t *itron, char *data, size_t items, size_t level );
+
+// OBIS id as A-B:C.D.E (with *F if F is not 255)
+char *sml_obis_str( char *out, size_t size, const uint8_t *obis );
+
+// Unit symbol of common DLMS unit codes or ""
+const char *sml_unit_name( uint8_t unit );
+
+// Numeric value of an entry with scaler applied, false for octet strings
+bool sml_obis_value( const sml_obis_entry_t *entry, double *value );
+
+// InfluxDB line protocol of the numeric entries (one field per OBIS id), length like snprintf, 0 if none
+int sml_obis_line( char *out, size_t size, const sml_obis_table_t *table, const char *meter, uint64_t time_ms );
+
+// Hex dump of buf with separator, truncated to fit into out
+char *hex_str( char *out, size_t size, const void *buf, size_t len, char sep );
+
+// InfluxDB line protocol of a valid reading, returns length like snprintf
+int itron_line( char *out, size_t size, const itron_3hz_t *itron, uint64_t time_ms );
+
+// "energy" section of the /json status, returns length like snprintf
+int itron_json( char *out, size_t size, const itron_3hz_t *itron, bool detailed );
+
+#ifdef SML_DEBUG
+// Log one decoded sml item, implemented by the application
+void sml_debug( size_t level, size_t pos, size_t type, size_t len, const char *fmt, ... );
+#else
+#define sml_debug(...)
+#endif
+
+#endif
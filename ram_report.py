@@ -0,0 +1,109 @@
+Import("env")
+
+# Report the static RAM of the firmware after each build: the DRAM sections
+# (.data, .rodata and .bss, all in RAM on the ESP8266) and the largest RAM
+# symbols, compared to a baseline build. The build fails if the static RAM
+# exceeds the baseline by more than custom_ram_growth bytes.
+# The baseline is the firmware of the git revision custom_ram_baseline
+# (platformio.ini, version 8.2 by default). If ram_baseline.txt next to
+# platformio.ini does not hold it yet, it is built once in a worktree under
+# .pio/ram_baseline with the same environment and its sizes are kept there.
+# RAM_BASELINE=<firmware.elf> records the baseline from an existing ELF instead.
+import os
+import shutil
+import subprocess
+
+SECTIONS = (".data", ".rodata", ".bss")
+TOP_SYMBOLS = 12
+
+def tool(env, name):
+    return env.subst("$CC").replace("gcc", name)
+
+def option(env, name, default):
+    return env.GetProjectOption(name, default)
+
+def section_sizes(env, elf):
+    out = subprocess.check_output([tool(env, "size"), "-A", elf], universal_newlines=True)
+    sizes = dict((name, 0) for name in SECTIONS)
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] in sizes:
+            sizes[fields[0]] = int(fields[1])
+    return sizes
+
+def ram_symbols(env, elf):
+    out = subprocess.check_output([tool(env, "nm"), "-S", "-C", "--size-sort", "-r", elf], universal_newlines=True)
+    symbols = []
+    for line in out.splitlines():
+        fields = line.split(None, 3)
+        if len(fields) == 4 and fields[2] in "bBdD":
+            symbols.append((int(fields[1], 16), fields[3]))
+    return symbols[:TOP_SYMBOLS]
+
+def read_baseline(path, source):
+    sizes = {}
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if line.startswith("#") and line.strip() != "# static RAM of %s" % source:
+                return None  # of another revision or ELF
+            if len(fields) == 2 and fields[0] in SECTIONS:
+                sizes[fields[0]] = int(fields[1])
+    return sizes if len(sizes) == len(SECTIONS) else None
+
+def write_baseline(path, sizes, source):
+    with open(path, "w") as f:
+        f.write("# static RAM of %s\n" % source)
+        for name in SECTIONS:
+            f.write("%s %d\n" % (name, sizes[name]))
+
+# Build the revision in a worktree, returns the path of its ELF
+def build_baseline(env, revision):
+    project = env.subst("$PROJECT_DIR")
+    tree = os.path.join(project, ".pio", "ram_baseline")
+    if os.path.isdir(tree):
+        subprocess.check_call(["git", "-C", tree, "checkout", "-q", "--detach", revision])
+    else:
+        subprocess.check_call(["git", "-C", project, "worktree", "add", "-q", "--detach", tree, revision])
+    if os.path.exists(os.path.join(project, "inverter.ini")):
+        shutil.copy(os.path.join(project, "inverter.ini"), tree)
+    print("RAM report: building baseline %s in %s" % (revision, tree))
+    nested = dict(os.environ, RAM_REPORT_OFF="1")  # a baseline with this script does not report itself
+    subprocess.check_call([env.subst("$PYTHONEXE"), "-m", "platformio", "run", "-d", tree, "-e", env.subst("$PIOENV")], env=nested)
+    return os.path.join(tree, ".pio", "build", env.subst("$PIOENV"), "firmware.elf")
+
+def ram_report(source, target, env):
+    if os.environ.get("RAM_REPORT_OFF"):
+        return
+    elf = str(target[0])
+    baseline_file = os.path.join(env.subst("$PROJECT_DIR"), "ram_baseline.txt")
+    baseline_elf = os.environ.get("RAM_BASELINE")
+    baseline_source = baseline_elf or "revision %s" % option(env, "custom_ram_baseline", "9f8fb14")
+    growth = int(option(env, "custom_ram_growth", "0"))
+    try:
+        sizes = section_sizes(env, elf)
+        symbols = ram_symbols(env, elf)
+        baseline = read_baseline(baseline_file, baseline_source) if os.path.exists(baseline_file) else None
+        if not baseline:
+            if not baseline_elf:
+                baseline_elf = build_baseline(env, option(env, "custom_ram_baseline", "9f8fb14"))
+            baseline = section_sizes(env, baseline_elf)
+            write_baseline(baseline_file, baseline, baseline_source)
+    except (OSError, subprocess.CalledProcessError) as err:
+        print("RAM report: %s, set RAM_BASELINE to the firmware.elf of the baseline" % err)
+        env.Exit(1)
+    total = sum(sizes.values())
+    base_total = sum(baseline.values())
+    print("RAM report: %d bytes static RAM (%s)"
+          % (total, ", ".join("%s %d" % (name, sizes[name]) for name in SECTIONS)))
+    print("RAM report: baseline (%s) %d bytes, %+d bytes (%s), %d allowed"
+          % (baseline_source, base_total, total - base_total,
+             ", ".join("%s %+d" % (name, sizes[name] - baseline[name]) for name in SECTIONS), growth))
+    for size, name in symbols:
+        print("RAM report: %6d %s" % (size, name))
+    if total - base_total > growth:
+        print("RAM report: static RAM grew by %d bytes, more than custom_ram_growth = %d"
+              % (total - base_total, growth))
+        env.Exit(1)
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", ram_report)
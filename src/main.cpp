@@ -3,15 +3,19 @@
 // defaults, can be overridden by platformio.ini build_flags
 #include "build_config.h"
 
-// Web Updater
-#include <ESP8266HTTPUpdateServer.h>
-#include <ESP8266WebServer.h>
+// gzip compressed web/index.html, generated by gzip_web.py
+#include "dashboard.h"
+
+// Async web server and updater
+#include <ESPAsyncTCP.h>
+#include <ESPAsyncWebServer.h>
+#include <Updater.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266mDNS.h>
 #include <WiFiClient.h>
 
-// Post to InfluxDB
-#include <ESP8266HTTPClient.h>
+// SML framing and decoding (lib/sml)
+#include <sml.h>
 
 // Infrastructure
 #include <NTPClient.h>
@@ -19,6 +23,9 @@
 #include <WiFiManager.h>
 #include <WiFiUdp.h>
 #include <SoftwareSerial.h>
+#include <coredecls.h>  // crc32()
+#include <user_interface.h>  // system_update_cpu_freq()
+#include <LittleFS.h>
 
 #ifndef PWMRANGE
 #define PWMRANGE 1023
@@ -34,16 +41,210 @@
 
 #define WEBSERVER_PORT 80
 
+#ifndef WEB_MAX_CLIENTS
+#define WEB_MAX_CLIENTS 4  // concurrent web requests, more get 503
+#endif
+
+#ifndef SERIAL_RX_BUFFER
+#define SERIAL_RX_BUFFER 1024  // ~1 s of meter data, bridges flash writes during a firmware update
+#endif
+
 SoftwareSerial mirror(NOT_A_PIN, IR_LED_PIN, true);  // TX only
 
-ESP8266WebServer web_server(WEBSERVER_PORT);
+// Requests are handled in the network stack callbacks, loop() never waits for a web client
+AsyncWebServer web_server(WEBSERVER_PORT);
+uint8_t web_clients = 0;       // requests currently in progress
+uint32_t web_rejected = 0;     // requests answered with 503
+uint32_t restart_ms = 0;       // millis() of requested restart or 0
+bool state_restored = false;   // started after a planned restart
+uint64_t restored_time_ms = 0; // last record before the planned restart, 0 after the first record
+int64_t restart_gap_ms = -1;   // time between the records around the planned restart
 
-ESP8266HTTPUpdateServer esp_updater;
+/*
+Cooperative task scheduler
+ loop() runs at most one due task per call, the first due one in the
+ table, so the table order is the priority. Serial capture comes first
+ and is due every SERIAL_SERVICE_MS, every other task returns to it
+ before the next one starts. Idle tasks wait while meter data is pending.
+ A task started later than its deadline after it was due counts as a
+ miss, one running longer than its slice as an overrun. With nothing
+ due loop() sleeps until the next task is due. The tasks are defined
+ before loop().
+ */
+#ifndef SERIAL_SERVICE_MS
+#define SERIAL_SERVICE_MS 2  // guaranteed interval for reading the serial buffer
+#endif
+
+#define TASK_IDLE 0x01  // only run while no meter data is waiting
+#define TASK_NET 0x02   // in power modes only run in the window after a frame
+
+typedef struct task {
+  const char *name;
+  void (*run)();
+  uint32_t period_ms;    // next run this long after the last start
+  uint32_t deadline_ms;  // start this late after due is a miss
+  uint32_t slice_us;     // run longer is an overrun
+  uint8_t flags;
+  uint32_t due_ms;       // millis() of next run
+  uint32_t runs;
+  uint32_t misses;
+  uint32_t overruns;
+  uint32_t max_us;
+  uint64_t total_us;
+} task_t;
+
+enum {
+  TASK_SERIAL,
+#ifdef SML_INJECT
+  TASK_INJECT,
+#endif
+  TASK_RESTART,
+  TASK_PUBLISH,
+#ifdef DTU_TOPIC
+  TASK_MQTT,
+  TASK_MQTT_CONNECT,
+#endif
+#ifdef WLED_LEDS
+  TASK_WLED,
+#endif
+  TASK_NTP,
+  TASK_BREATHE,
+  TASK_LOG,
+  TASK_SPOOL,
+  TASK_COUNT
+};
+
+extern task_t tasks[TASK_COUNT];
+uint64_t sched_idle_ms = 0;  // time slept in loop() with no task due
+
+// Run a task as soon as possible, e.g. when its data changed
+void task_wake( size_t id ) {
+  tasks[id].due_ms = millis();
+}
+
+/*
+Power modes
+ POWER_MODE 0 keeps WiFi and CPU awake and the LED breathing.
+ 1: WiFi modem sleep, the radio only wakes for every POWER_LISTEN_INTERVAL
+ beacon and to send. Serial is polled every POWER_SERIAL_MS between
+ frames (the rx buffer keeps ~1 s), network tasks only run in a window of
+ POWER_BATCH_MS after each frame and the LED stays off.
+ 2: also auto light sleep until POWER_WAKE_EARLY_MS before the next frame
+ is expected, a low RX pin (start bit) wakes early.
+ While sleeping the CPU is clocked down to 80 MHz (if built for 160 MHz).
+ Average current is estimated from the time busy, awake and in light
+ sleep with typical ESP8266 values, it is no measurement.
+ */
+#ifndef POWER_MODE
+#define POWER_MODE 0
+#endif
+
+#ifndef POWER_LISTEN_INTERVAL
+#define POWER_LISTEN_INTERVAL 3  // beacons slept through, web and modbus answers wait up to ~300 ms
+#endif
+
+#define POWER_FRAME_MS 1000     // meter record interval
+#define POWER_BATCH_MS 300      // network work window after each frame
+#define POWER_SERIAL_MS 20      // serial poll interval between frames
+#define POWER_WAKE_EARLY_MS 100 // end light sleep this long before the next expected frame
+#define POWER_LIGHT_MIN_MS 10   // shorter sleeps are not counted as light sleep
+
+#define POWER_MA_ON 70     // CPU running, WiFi receiving
+#define POWER_MA_MODEM 15  // CPU running, WiFi modem sleep
+#define POWER_MA_LIGHT 1   // light sleep
+
+uint32_t power_frame_begin_ms = 0;  // millis() of the start escape of the last frame
+uint32_t power_frame_end_ms = 0;    // millis() of the end escape of the last frame
+uint32_t power_frame_ms = 0;        // duration of the last frame
+uint32_t power_frames = 0;
+uint32_t power_wakeups = 0;         // sleeps of loop() with nothing to do
+uint64_t power_light_ms = 0;        // time in sleeps long enough for light sleep
+
+// Milliseconds until network tasks may run, 0 within the window after a frame (or each POWER_FRAME_MS without frames)
+uint32_t power_hold_ms( uint32_t now ) {
+  #if POWER_MODE
+  uint32_t since = (now - power_frame_end_ms) % POWER_FRAME_MS;
+  return since < POWER_BATCH_MS ? 0 : POWER_FRAME_MS - since;
+  #else
+  return 0;
+  #endif
+}
+
+// Milliseconds until the serial buffer needs to be read again, fast only shortly before the frame end is expected
+uint32_t power_serial_ms( uint32_t now ) {
+  uint32_t elapsed = now - power_frame_begin_ms;
+  bool receiving = (int32_t)(power_frame_begin_ms - power_frame_end_ms) > 0 && elapsed < POWER_FRAME_MS;
+  if( POWER_MODE == 0 || (receiving && elapsed + 2 * POWER_SERIAL_MS >= power_frame_ms) ) {
+    return SERIAL_SERVICE_MS;
+  }
+  if( receiving || Serial.available() ) {
+    return POWER_SERIAL_MS;
+  }
+  uint32_t next = POWER_FRAME_MS - POWER_WAKE_EARLY_MS - elapsed % POWER_FRAME_MS;
+  return (POWER_MODE == 2 && next > POWER_SERIAL_MS && next < POWER_FRAME_MS) ? next : POWER_SERIAL_MS;
+}
+
+void setup_power() {
+  #if POWER_MODE == 1
+  WiFi.setSleepMode(WIFI_MODEM_SLEEP, POWER_LISTEN_INTERVAL);
+  #elif POWER_MODE == 2
+  WiFi.setSleepMode(WIFI_LIGHT_SLEEP, POWER_LISTEN_INTERVAL);
+  wifi_enable_gpio_wakeup(3, GPIO_PIN_INTR_LOLEVEL);  // RX
+  #endif
+  #if POWER_MODE
+  digitalWrite(DB_LED_PIN, DB_LED_OFF);
+  #endif
+}
+
+// Sleep with nothing due, clocked down if the CPU runs faster
+void power_sleep( uint32_t ms ) {
+  power_wakeups++;
+  if( POWER_MODE == 2 && ms >= POWER_LIGHT_MIN_MS ) {
+    power_light_ms += ms;
+  }
+  uint8_t mhz = ESP.getCpuFreqMHz();
+  if( POWER_MODE && mhz != 80 ) {
+    system_update_cpu_freq(SYS_CPU_80MHZ);
+  }
+  delay(ms);
+  if( POWER_MODE && mhz != 80 ) {
+    system_update_cpu_freq(mhz);
+  }
+}
+
+// Estimated average current since boot
+double power_current_ma( uint64_t idle_ms ) {
+  uint64_t total_ms = micros64() / 1000;
+  if( !total_ms ) {
+    return 0;
+  }
+  idle_ms = min(idle_ms, total_ms);
+  uint64_t light_ms = min(power_light_ms, idle_ms);
+  uint64_t busy_ms = total_ms - idle_ms;
+  double idle_ma = POWER_MODE ? POWER_MA_MODEM : POWER_MA_ON;
+  return (busy_ms * (double)POWER_MA_ON + (idle_ms - light_ms) * idle_ma + light_ms * (double)POWER_MA_LIGHT) / total_ms;
+}
 
 // Post to InfluxDB
+/*
+Influx writer
+ Line protocol and request header are formatted into static buffers and
+ sent on a kept alive connection, the response status line, headers and
+ (error) body are read into fixed buffers. Nothing is allocated in steady
+ state, the heap only changes when the connection has to be reopened.
+ */
+#ifndef INFLUX_TIMEOUT_MS
+#define INFLUX_TIMEOUT_MS 2000
+#endif
+#define INFLUX_ERR_CONNECT -1   // no connection to the server
+#define INFLUX_ERR_SEND -2      // request not completely written
+#define INFLUX_ERR_RESPONSE -3  // no or malformed response within INFLUX_TIMEOUT_MS
+
 WiFiClient client;
-HTTPClient http;
 int influx_status = 0;
+uint32_t influx_posts = 0;
+uint32_t influx_errors = 0;
+uint32_t influx_connects = 0;
 time_t post_time = 0;
 
 const uint32_t ok_interval = 5000;
@@ -51,248 +252,1805 @@ const uint32_t err_interval = 1000;
 
 uint32_t breathe_interval = ok_interval; // ms for one led breathe cycle
 
+#ifndef TZ_INFO
+#define TZ_INFO "CET-1CEST,M3.5.0,M10.5.0/3"  // POSIX TZ of local time (days, tariffs, printed times)
+#endif
+
 WiFiUDP ntpUDP;
 NTPClient ntp(ntpUDP, NTP_SERVER);
 static char start_time[30] = "";
 
-WiFiUDP logUDP;
-Syslog syslog(logUDP, SYSLOG_PROTO_IETF);
+WiFiUDP logUDP;
+Syslog syslog(logUDP, SYSLOG_PROTO_IETF);
+
+/*
+Syslog queue
+ slog() only formats the message into a queue entry, log_drain() sends one
+ entry per call from loop() while no meter data is waiting. Identical
+ messages within LOG_REPEAT_MS are merged and sent once more as "(xN)"
+ summary. Each severity has a budget of messages per minute, messages
+ above it or without a free entry are counted and reported.
+ */
+#ifndef LOG_QUEUE_SIZE
+#define LOG_QUEUE_SIZE 8
+#endif
+#define LOG_MSG_SIZE 200
+#define LOG_REPEAT_MS 60000
+
+typedef enum { LOG_FREE, LOG_QUEUED, LOG_SENT } log_state_t;
+
+typedef struct log_entry {
+  uint8_t state;    // log_state_t
+  uint16_t pri;
+  uint16_t repeat;  // identical messages merged into the entry
+  uint32_t hash;    // of pri and msg
+  uint32_t time;    // millis() of queueing or last send
+  char msg[LOG_MSG_SIZE];
+} log_entry_t;
+
+log_entry_t log_queue[LOG_QUEUE_SIZE];
+const uint8_t log_rate[8] = { 60, 60, 60, 60, 30, 20, 10, 10 };  // messages per minute by severity
+uint8_t log_sent[8] = { 0 };  // messages per severity in current minute
+uint32_t log_dropped = 0;     // no free queue entry
+uint32_t log_limited = 0;     // above rate of severity
+
+uint32_t log_hash( uint16_t pri, const char *msg ) {
+  uint32_t hash = 2166136261u ^ pri;  // FNV-1a
+  while( *msg ) {
+    hash = (hash ^ (uint8_t)*(msg++)) * 16777619u;
+  }
+  return hash;
+}
+
+void slog( uint16_t pri, const char *fmt, ... ) __attribute__((format(printf, 2, 3)));
+
+void slog( uint16_t pri, const char *fmt, ... ) {
+  char msg[LOG_MSG_SIZE];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, args);
+  va_end(args);
+
+  uint32_t hash = log_hash(pri, msg);
+  log_entry_t *entry = 0;
+  for( size_t i = 0; i < ARRAY_SIZE(log_queue); i++ ) {
+    log_entry_t *e = &log_queue[i];
+    if( e->state != LOG_FREE && e->hash == hash && e->pri == pri && strcmp(e->msg, msg) == 0 ) {
+      e->repeat++;  // merge
+      return;
+    }
+    if( !entry && e->state == LOG_FREE ) {
+      entry = e;
+    }
+  }
+
+  if( log_sent[LOG_PRI(pri)] >= log_rate[LOG_PRI(pri)] ) {
+    log_limited++;
+    return;
+  }
+
+  if( !entry ) {  // reuse oldest sent entry without pending repeats
+    for( size_t i = 0; i < ARRAY_SIZE(log_queue); i++ ) {
+      log_entry_t *e = &log_queue[i];
+      if( e->state == LOG_SENT && e->repeat == 0 && (!entry || (int32_t)(e->time - entry->time) < 0) ) {
+        entry = e;
+      }
+    }
+    if( !entry ) {
+      log_dropped++;
+      return;
+    }
+  }
+
+  log_sent[LOG_PRI(pri)]++;
+  entry->state = LOG_QUEUED;
+  entry->pri = pri;
+  entry->repeat = 0;
+  entry->hash = hash;
+  entry->time = millis();
+  strcpy(entry->msg, msg);
+  task_wake(TASK_LOG);
+}
+
+// Send the oldest due message, call when idle, false if there was none
+bool log_drain() {
+  static uint32_t minute = 0;
+  static uint32_t reported_dropped = 0;
+  static uint32_t reported_limited = 0;
+
+  uint32_t now = millis();
+  if( now - minute >= 60000 ) {
+    minute = now;
+    memset(log_sent, 0, sizeof(log_sent));
+    if( log_dropped != reported_dropped || log_limited != reported_limited ) {
+      syslog.logf(LOG_WARNING, "Log queue dropped %u, rate limited %u messages", log_dropped, log_limited);
+      reported_dropped = log_dropped;
+      reported_limited = log_limited;
+      return true;
+    }
+  }
+
+  log_entry_t *due = 0;
+  for( size_t i = 0; i < ARRAY_SIZE(log_queue); i++ ) {
+    log_entry_t *e = &log_queue[i];
+    if( e->state == LOG_SENT && now - e->time >= LOG_REPEAT_MS ) {
+      if( e->repeat == 0 ) {
+        e->state = LOG_FREE;  // merge window over
+        continue;
+      }
+    }
+    else if( e->state != LOG_QUEUED ) {
+      continue;
+    }
+    if( !due || (int32_t)(e->time - due->time) < 0 ) {
+      due = e;
+    }
+  }
+
+  if( due ) {
+    if( due->repeat == 0 ) {
+      syslog.log(due->pri, due->msg);
+    }
+    else {
+      syslog.logf(due->pri, "%s (x%u)", due->msg, due->state == LOG_QUEUED ? due->repeat + 1 : due->repeat);
+      due->repeat = 0;
+    }
+    due->state = LOG_SENT;
+    due->time = now;
+  }
+  return due != 0;
+}
+
+uint32_t last_counter_reset = 0;      // millis() of last counter reset
+volatile uint32_t counter_events = 0; // events of current interval so far
+
+itron_3hz_t itron = {0};
+itron_3hz_t last_valid = {0};  // last reading that passed the plausibility checks
+sml_obis_table_t obis_table;   // all entries of the last record, any meter (/obis)
+uint64_t obis_time_ms = 0;     // arrival of that record
+uint64_t recv_time_ms = 0;  // unix time [ms] of the end escape of the last valid record
+bool recv_detailed = true;
+
+// Current unix time [ms]
+uint64_t epoch_ms() {
+  struct timeval now;
+  gettimeofday(&now, 0);
+  return now.tv_sec * 1000ULL + now.tv_usec / 1000;
+}
+
+/*
+Mapping of meter uptime to local time
+ offset = arrival - uptime. Transmission only adds delay, so the smallest
+ offset seen is the best estimate of the mapping and offset - base is the
+ arrival jitter of a record. The base restarts if the offset jumps by more
+ than 10s (meter restart or NTP time step).
+ */
+int64_t clock_offset_ms = 0;       // arrival - meter uptime of last record
+int64_t clock_base_ms = 0;         // smallest offset since last restart
+uint32_t clock_jitter_ms = 0;      // offset - base of last record
+uint32_t clock_jitter_max_ms = 0;  // largest jitter since last restart
+
+/*
+Clock drift and arrival jitter
+ Once per CLOCK_SAMPLE_S meter seconds the least delayed record of that
+ period is kept as sample (uptime, arrival, millis()). A least squares line
+ through the last CLOCK_SAMPLES samples gives the length of a meter second
+ in NTP ms and of a millis() ms, reported as drift in ppm (positive: the
+ meter or ESP clock is slow). The residual of each record to the line is
+ its arrival jitter. Records repeating or skipping meter seconds and
+ records arriving more than CLOCK_SLIP_MS off their meter second are
+ counted. With CLOCK_CORRECTION power from counter differences is scaled
+ to NTP seconds.
+ */
+#ifndef CLOCK_SAMPLE_S
+#define CLOCK_SAMPLE_S 60
+#endif
+#ifndef CLOCK_SAMPLES
+#define CLOCK_SAMPLES 60  // one hour, resolves drift of ~10 ppm with 50 ms jitter
+#endif
+#ifndef CLOCK_SLIP_MS
+#define CLOCK_SLIP_MS 500
+#endif
+
+typedef struct clock_sample {
+  uint32_t uptime;  // meter [s]
+  uint32_t millis;  // ESP [ms]
+  uint64_t time_ms; // arrival, unix time [ms]
+} clock_sample_t;
+
+clock_sample_t clock_samples[CLOCK_SAMPLES];
+clock_sample_t clock_candidate = {0};  // least delayed record of the current sample period
+uint8_t clock_sample_count = 0;
+uint8_t clock_sample_next = 0;
+double clock_ms_per_s = 1000;   // NTP ms per meter second
+double clock_intercept_ms = 0;  // arrival of clock_samples[0] uptime on the line, relative to its time_ms
+double clock_esp_ms_per_ms = 1; // NTP ms per millis() ms
+int32_t clock_residual_ms = 0;  // arrival of last record - line
+uint32_t clock_residual_max_ms = 0;
+float clock_residual_rms_ms = 0;  // exponentially averaged over ~64 records
+uint32_t clock_duplicates = 0;  // records with the meter second of the one before
+uint32_t clock_skipped = 0;     // meter seconds without record
+uint32_t clock_slips = 0;       // records arriving more than CLOCK_SLIP_MS off
+uint32_t clock_resets = 0;      // meter restarts or NTP time steps
+
+void clock_reset() {
+  clock_sample_count = 0;
+  clock_sample_next = 0;
+  clock_candidate.uptime = 0;
+  clock_ms_per_s = 1000;
+  clock_esp_ms_per_ms = 1;
+  clock_residual_max_ms = 0;
+}
+
+// Fit the line through the samples, relative to the oldest to keep the sums small
+void clock_fit() {
+  uint8_t oldest = clock_sample_count < CLOCK_SAMPLES ? 0 : clock_sample_next;
+  const clock_sample_t *first = &clock_samples[oldest];
+  double n = clock_sample_count, sx = 0, sy = 0, sxx = 0, sxy = 0, sm = 0, smm = 0, smy = 0;
+  for( uint8_t i = 0; i < clock_sample_count; i++ ) {
+    const clock_sample_t *s = &clock_samples[(oldest + i) % CLOCK_SAMPLES];
+    double x = s->uptime - first->uptime;
+    double y = (int64_t)(s->time_ms - first->time_ms);
+    double m = s->millis - first->millis;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    sm += m;
+    smm += m * m;
+    smy += m * y;
+  }
+  if( n < 3 || n * sxx - sx * sx <= 0 || n * smm - sm * sm <= 0 ) {
+    return;
+  }
+  clock_ms_per_s = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+  clock_esp_ms_per_ms = (n * smy - sm * sy) / (n * smm - sm * sm);
+  clock_intercept_ms = (sy - clock_ms_per_s * sx) / n;
+}
+
+void clock_track( uint64_t time_ms, uint32_t uptime ) {
+  static uint32_t last_uptime = 0;
+  static uint64_t last_time_ms = 0;
+  if( last_uptime && uptime >= last_uptime ) {
+    uint32_t seconds = uptime - last_uptime;
+    if( seconds == 0 ) {
+      clock_duplicates++;
+    }
+    else {
+      clock_skipped += seconds - 1;
+    }
+    int64_t slip = (int64_t)(time_ms - last_time_ms) - seconds * 1000LL;
+    if( slip > CLOCK_SLIP_MS || slip < -CLOCK_SLIP_MS ) {
+      clock_slips++;
+    }
+  }
+  last_uptime = uptime;
+  last_time_ms = time_ms;
+
+  if( clock_sample_count >= 3 ) {
+    const clock_sample_t *first = &clock_samples[clock_sample_count < CLOCK_SAMPLES ? 0 : clock_sample_next];
+    double line = clock_intercept_ms + clock_ms_per_s * (uptime - first->uptime);
+    clock_residual_ms = (int64_t)(time_ms - first->time_ms) - (int64_t)line;
+    uint32_t residual = abs(clock_residual_ms);
+    if( residual > clock_residual_max_ms ) {
+      clock_residual_max_ms = residual;
+    }
+    clock_residual_rms_ms = sqrtf((clock_residual_rms_ms * clock_residual_rms_ms * 63 + (float)residual * residual) / 64);
+  }
+
+  int64_t offset = (int64_t)time_ms - uptime * 1000LL;
+  if( clock_candidate.uptime && uptime / CLOCK_SAMPLE_S != clock_candidate.uptime / CLOCK_SAMPLE_S ) {
+    clock_samples[clock_sample_next] = clock_candidate;
+    clock_sample_next = (clock_sample_next + 1) % CLOCK_SAMPLES;
+    if( clock_sample_count < CLOCK_SAMPLES ) {
+      clock_sample_count++;
+    }
+    clock_fit();
+    clock_candidate.uptime = 0;
+  }
+  if( !clock_candidate.uptime || offset < (int64_t)clock_candidate.time_ms - clock_candidate.uptime * 1000LL ) {
+    clock_candidate.uptime = uptime;
+    clock_candidate.millis = millis();
+    clock_candidate.time_ms = time_ms;
+  }
+}
+
+// Power from counter differences over meter seconds, optionally scaled to NTP seconds
+uint64_t meter_power_w( uint64_t current_1_10Wh, uint64_t previous_1_10Wh, uint32_t delta_time_s ) {
+  uint64_t power = sml_power_w(current_1_10Wh, previous_1_10Wh, delta_time_s);
+  #ifdef CLOCK_CORRECTION
+  if( clock_sample_count >= CLOCK_SAMPLES / 2 ) {
+    power = power * 1000 / clock_ms_per_s;
+  }
+  #endif
+  return power;
+}
+
+void update_clock( uint64_t time_ms, uint32_t uptime ) {
+  clock_offset_ms = (int64_t)time_ms - uptime * 1000LL;
+  int64_t jitter = clock_offset_ms - clock_base_ms;
+  if( clock_base_ms == 0 || jitter < -10000 || jitter > 10000 ) {
+    clock_resets += clock_base_ms ? 1 : 0;
+    clock_base_ms = clock_offset_ms;
+    clock_jitter_max_ms = 0;
+    jitter = 0;
+    clock_reset();
+  }
+  else if( jitter < 0 ) {
+    clock_base_ms = clock_offset_ms;
+    jitter = 0;
+  }
+  clock_jitter_ms = jitter;
+  if( clock_jitter_ms > clock_jitter_max_ms ) {
+    clock_jitter_max_ms = clock_jitter_ms;
+  }
+  clock_track(time_ms, uptime);
+}
+
+/*
+Frame buffer pool
+ Capture, decoding and the /sml endpoint share the frame slots by pointer.
+ A slot is free if nobody holds a reference, the capture owns one slot while
+ filling it and frame_last keeps the last complete record for /sml.
+ */
+#ifndef FRAME_SLOTS
+#define FRAME_SLOTS 2  // one capturing, one last complete record (a slow /sml client can cost a frame)
+#endif
+#define FRAME_SIZE 2560  // enough for 2s at 9600 baud
+
+typedef struct frame_slot {
+  uint8_t refs;  // 0: free
+  size_t len;    // bytes used in data
+  uint64_t time_ms;  // unix time [ms] of the end escape
+  char data[FRAME_SIZE];
+} frame_slot_t;
+
+frame_slot_t frame_pool[FRAME_SLOTS];
+frame_slot_t *frame_last = 0;  // last sml record
+uint32_t frame_drops = 0;      // frames lost because all slots were busy
+
+frame_slot_t *frame_acquire() {
+  for( size_t i = 0; i < ARRAY_SIZE(frame_pool); i++ ) {
+    if( frame_pool[i].refs == 0 ) {
+      frame_pool[i].refs = 1;
+      frame_pool[i].len = 0;
+      return &frame_pool[i];
+    }
+  }
+  return 0;
+}
+
+frame_slot_t *frame_ref( frame_slot_t *slot ) {
+  if( slot ) {
+    slot->refs++;
+  }
+  return slot;
+}
+
+void frame_release( frame_slot_t *slot ) {
+  if( slot && slot->refs ) {
+    slot->refs--;
+  }
+}
+
+// Print len bytes of buf as hex with separator without intermediate buffer
+void print_hex( Print &out, const void *buf, size_t len, char sep ) {
+  static const char digits[] = "0123456789abcdef";
+  const uint8_t *in = (const uint8_t *)buf;
+  while( len-- ) {
+    out.write(digits[*in >> 4]);
+    out.write(digits[*(in++) & 0xf]);
+    if( len ) {
+      out.write(sep);
+    }
+  }
+}
+
+/*
+Capture rings for raw sml records
+ The recent ring keeps the last records, the reject ring keeps records that
+ were invalid, rejected or coarse until other rejects overwrite them.
+ Both store records back to back in capture format (see /sml?n=):
+  file:   "SMLCAP\x01\x00" then records
+  record: capture_header_t, then len bytes sml data (between start and end escape)
+ All values little endian. The rings take 5 kB of RAM, so they are only
+ kept if SML_CAPTURE is defined (SML_INJECT needs them for its captures).
+ */
+#if defined(SML_INJECT) && !defined(SML_CAPTURE)
+#define SML_CAPTURE
+#endif
+#ifndef CAPTURE_BYTES
+#define CAPTURE_BYTES 3072
+#endif
+#ifndef CAPTURE_REJECT_BYTES
+#define CAPTURE_REJECT_BYTES 2048
+#endif
+
+#define CAPTURE_MAGIC "SMLCAP\x01"  // 8 bytes with terminating 0
+
+typedef enum {
+  CAPTURE_OK = 0,
+  CAPTURE_INVALID = 1,        // record incomplete, not all itron values found
+  CAPTURE_REJECT_APLUS = 2,   // A+ power above USAGE_KW_MAX
+  CAPTURE_REJECT_AMINUS = 4,  // A- power above PROD_KW_MAX
+  CAPTURE_COARSE = 8          // kWh readings instead of 1/10 Wh
+} capture_reason_t;
+
+typedef struct capture_header {
+  uint32_t len;     // bytes of sml data following
+  uint32_t sec;     // arrival unix time [s]
+  uint16_t ms;      // arrival [ms]
+  uint8_t reason;   // capture_reason_t bits
+  uint8_t reserved;
+} capture_header_t;
+
+#ifdef SML_CAPTURE
+typedef struct capture_ring {
+  uint8_t *buf;
+  size_t size;
+  uint32_t head;     // bytes ever written
+  uint32_t tail;     // start of oldest record
+  uint32_t records;  // records between tail and head
+} capture_ring_t;
+
+uint8_t capture_recent_buf[CAPTURE_BYTES];
+uint8_t capture_reject_buf[CAPTURE_REJECT_BYTES];
+capture_ring_t capture_recent = { capture_recent_buf, sizeof(capture_recent_buf), 0, 0, 0 };
+capture_ring_t capture_reject = { capture_reject_buf, sizeof(capture_reject_buf), 0, 0, 0 };
+
+void ring_read( const capture_ring_t *ring, uint32_t pos, void *dst, size_t len ) {
+  size_t off = pos % ring->size;
+  size_t part = min(len, ring->size - off);
+  memcpy(dst, &ring->buf[off], part);
+  memcpy((uint8_t *)dst + part, ring->buf, len - part);
+}
+
+void ring_write( capture_ring_t *ring, const void *src, size_t len ) {
+  size_t off = ring->head % ring->size;
+  size_t part = min(len, ring->size - off);
+  memcpy(&ring->buf[off], src, part);
+  memcpy(ring->buf, (const uint8_t *)src + part, len - part);
+  ring->head += len;
+}
+
+void capture_add( capture_ring_t *ring, const capture_header_t *header, const char *data ) {
+  size_t len = sizeof(*header) + header->len;
+  if( len > ring->size ) {
+    return;
+  }
+  while( ring->size - (ring->head - ring->tail) < len ) {  // drop oldest records
+    capture_header_t oldest;
+    ring_read(ring, ring->tail, &oldest, sizeof(oldest));
+    ring->tail += sizeof(oldest) + oldest.len;
+    ring->records--;
+  }
+  ring_write(ring, header, sizeof(*header));
+  ring_write(ring, data, header->len);
+  ring->records++;
+}
+
+void capture_frame( const char *data, size_t len, uint8_t reason, uint64_t time_ms ) {
+  capture_header_t header = { (uint32_t)len, (uint32_t)(time_ms / 1000), (uint16_t)(time_ms % 1000), reason, 0 };
+  capture_add(&capture_recent, &header, data);
+  if( reason != CAPTURE_OK ) {
+    capture_add(&capture_reject, &header, data);
+  }
+}
+
+// Ring position of the record after skipping the oldest skip records
+uint32_t capture_skip( const capture_ring_t *ring, uint32_t skip ) {
+  uint32_t pos = ring->tail;
+  while( skip-- && pos != ring->head ) {
+    capture_header_t header;
+    ring_read(ring, pos, &header, sizeof(header));
+    pos += sizeof(header) + header.len;
+  }
+  return pos;
+}
+
+/*
+Async response for /sml?n=
+ Sends capture file header, rejected records older than the first of the
+ last n recent records and then these recent records, so the output is
+ ordered by arrival and has no duplicates. Records are streamed from the
+ rings. If a slow client lets the capture overwrite unsent data, the
+ output ends early.
+ */
+class CaptureResponse : public AsyncAbstractResponse {
+public:
+  CaptureResponse( uint32_t n ) : _phase(0), _pos(0) {
+    _code = 200;
+    _contentType = "application/octet-stream";
+    _sendContentLength = false;
+    _chunked = true;
+
+    n = min(n, capture_recent.records);
+    _recent = capture_skip(&capture_recent, capture_recent.records - n);
+    _recent_end = capture_recent.head;
+
+    // rejects older than the first recent record
+    uint64_t first_ms = UINT64_MAX;
+    if( _recent != _recent_end ) {
+      capture_header_t header;
+      ring_read(&capture_recent, _recent, &header, sizeof(header));
+      first_ms = header.sec * 1000ULL + header.ms;
+    }
+    _reject = capture_reject.tail;
+    _reject_end = capture_reject.tail;
+    while( _reject_end != capture_reject.head ) {
+      capture_header_t header;
+      ring_read(&capture_reject, _reject_end, &header, sizeof(header));
+      if( header.sec * 1000ULL + header.ms >= first_ms ) {
+        break;
+      }
+      _reject_end += sizeof(header) + header.len;
+    }
+  }
+
+  bool _sourceValid() const override {
+    return true;
+  }
+
+  size_t _fillBuffer( uint8_t *buf, size_t maxLen ) override {
+    size_t done = 0;
+    while( done < maxLen && _phase < 3 ) {
+      size_t part;
+      if( _phase == 0 ) {
+        part = min(maxLen - done, sizeof(CAPTURE_MAGIC) - _pos);
+        memcpy(&buf[done], &CAPTURE_MAGIC[_pos], part);
+        if( (_pos += part) == sizeof(CAPTURE_MAGIC) ) {
+          _phase++;
+        }
+      }
+      else {
+        capture_ring_t *ring = (_phase == 1) ? &capture_reject : &capture_recent;
+        uint32_t &pos = (_phase == 1) ? _reject : _recent;
+        uint32_t end = (_phase == 1) ? _reject_end : _recent_end;
+        if( pos - ring->tail > ring->head - ring->tail ) {
+          _phase = 3;  // overwritten meanwhile
+          break;
+        }
+        part = min(maxLen - done, (size_t)(end - pos));
+        ring_read(ring, pos, &buf[done], part);
+        pos += part;
+        if( pos == end ) {
+          _phase++;
+        }
+      }
+      done += part;
+    }
+    return done;
+  }
+
+private:
+  uint8_t _phase;  // 0: file header, 1: rejects, 2: recent, 3: done
+  size_t _pos;
+  uint32_t _reject;
+  uint32_t _reject_end;
+  uint32_t _recent;
+  uint32_t _recent_end;
+};
+#endif
+
+/*
+Power readings for the dashboard charts
+ Live keeps the power of each valid record, history keeps averages over
+ HISTORY_INTERVAL_S. Both are rings served as compact binary by /readings.
+ */
+#ifndef LIVE_READINGS
+#define LIVE_READINGS 120  // ~2 min of records
+#endif
+#ifndef HISTORY_READINGS
+#define HISTORY_READINGS 144  // 24h in 10 min steps
+#endif
+#ifndef HISTORY_INTERVAL_S
+#define HISTORY_INTERVAL_S 600
+#endif
+
+typedef struct reading {
+  uint32_t time;   // unix time [s]
+  uint16_t in_w;   // A+ power [W]
+  uint16_t out_w;  // A- power [W]
+} reading_t;
+
+typedef struct readings {
+  reading_t *entry;
+  size_t size;
+  uint32_t count;  // readings ever added, entry[count % size] is the next one
+} readings_t;
+
+reading_t live_entries[LIVE_READINGS];
+reading_t history_entries[HISTORY_READINGS];
+readings_t live_readings = { live_entries, ARRAY_SIZE(live_entries), 0 };
+readings_t history_readings = { history_entries, ARRAY_SIZE(history_entries), 0 };
+
+uint32_t power_in_w = 0;   // A+ power [W], from the meter or counter differences
+uint32_t power_out_w = 0;  // A- power [W], from the meter or counter differences
+
+void add_reading( readings_t *readings, uint32_t time, uint32_t in_w, uint32_t out_w ) {
+  reading_t *entry = &readings->entry[readings->count++ % readings->size];
+  entry->time = time;
+  entry->in_w = min(in_w, (uint32_t)UINT16_MAX);
+  entry->out_w = min(out_w, (uint32_t)UINT16_MAX);
+}
+
+// Update power and readings from a validated itron record
+void update_power( time_t now ) {
+  static uint32_t uptime = 0;
+  static uint64_t aPlus = 0;
+  static uint64_t aMinus = 0;
+  static uint32_t hist_uptime = 0;
+  static uint64_t hist_aPlus = 0;
+  static uint64_t hist_aMinus = 0;
+
+  bool instant = itron.power_valid & SML_POWER_TOTAL;
+  if( instant ) {
+    // the meter reports current power with each record, counters are only needed as fallback
+    power_in_w = max(itron.power, (int32_t)0);
+    power_out_w = max(-itron.power, (int32_t)0);
+  }
+  if( uptime != itron.uptime && (itron.aPlus != aPlus || itron.aMinus != aMinus) ) {
+    if( uptime && !instant ) {
+      power_in_w = meter_power_w(itron.aPlus, aPlus, itron.uptime - uptime);
+      power_out_w = meter_power_w(itron.aMinus, aMinus, itron.uptime - uptime);
+    }
+    uptime = itron.uptime;
+    aPlus = itron.aPlus;
+    aMinus = itron.aMinus;
+  }
+  add_reading(&live_readings, now, power_in_w, power_out_w);
+
+  uint32_t delta_t = itron.uptime - hist_uptime;
+  if( !hist_uptime || delta_t >= HISTORY_INTERVAL_S ) {
+    if( hist_uptime ) {
+      add_reading(&history_readings, now, meter_power_w(itron.aPlus, hist_aPlus, delta_t), meter_power_w(itron.aMinus, hist_aMinus, delta_t));
+    }
+    hist_uptime = itron.uptime;
+    hist_aPlus = itron.aPlus;
+    hist_aMinus = itron.aMinus;
+  }
+}
+
+// Post data to InfluxDB
+// Read one header line without line end into buf, false on timeout or overflow
+bool influx_line( char *buf, size_t size ) {
+  size_t len = client.readBytesUntil('\n', buf, size - 1);
+  if( len == 0 || len == size - 1 ) {
+    return false;
+  }
+  if( buf[len - 1] == '\r' ) {
+    len--;
+  }
+  buf[len] = '\0';
+  return true;
+}
+
+// Post body and return http status or INFLUX_ERR_*, response body (if any) goes to resp
+int influx_post( const char *body, size_t body_len, char *resp, size_t resp_size ) {
+  static char header[200];
+  char line[80];
+
+  resp[0] = '\0';
+  if( !client.connected() ) {
+    client.stop();
+    influx_connects++;
+    if( !client.connect(INFLUX_SERVER, INFLUX_PORT) ) {
+      return INFLUX_ERR_CONNECT;
+    }
+    client.setNoDelay(true);
+    client.setTimeout(INFLUX_TIMEOUT_MS);
+  }
+
+  int header_len = snprintf(header, sizeof(header),
+    "POST /write?db=" INFLUX_DB "&precision=ms HTTP/1.1\r\n"
+    "Host: " INFLUX_SERVER "\r\nUser-Agent: " PROGNAME "\r\n"
+    "Content-Length: %u\r\nConnection: keep-alive\r\n\r\n", body_len);
+  if( client.write((const uint8_t *)header, header_len) != (size_t)header_len
+   || client.write((const uint8_t *)body, body_len) != body_len ) {
+    client.stop();
+    return INFLUX_ERR_SEND;
+  }
+
+  // Status line "HTTP/1.1 204 No Content"
+  int status;
+  if( !influx_line(line, sizeof(line)) || sscanf(line, "HTTP/%*u.%*u %d", &status) != 1 ) {
+    client.stop();
+    return INFLUX_ERR_RESPONSE;
+  }
+
+  // Headers: only length of body and end of keep alive are of interest
+  long content_len = -1;
+  bool keep = true;
+  bool chunked = false;
+  while( true ) {
+    if( !influx_line(line, sizeof(line)) ) {
+      client.stop();
+      return status;
+    }
+    if( !line[0] ) {
+      break;
+    }
+    if( strncasecmp(line, "Content-Length:", 15) == 0 ) {
+      content_len = atol(line + 15);
+    }
+    else if( strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line + 11, "close") ) {
+      keep = false;
+    }
+    else if( strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line + 18, "chunked") ) {
+      chunked = true;
+    }
+  }
+
+  // Body: keep the start for the log, skip the rest
+  size_t len = 0;
+  if( (status >= 100 && status < 200) || status == 204 || status == 304 ) {
+    content_len = 0;  // never has a body (InfluxDB answers writes with 204 without length)
+  }
+  else if( chunked || (content_len < 0 && !keep) ) {
+    // body ends with the connection: log what is there, do not wait for the close
+    keep = false;
+    content_len = 0;
+    while( len < resp_size - 1 && client.available() ) {
+      char c = client.read();
+      if( c != '\n' ) {
+        resp[len++] = c;
+      }
+    }
+  }
+  else if( content_len < 0 ) {
+    content_len = 0;  // kept alive without length: no body
+  }
+  while( content_len > 0 ) {
+    char c;
+    if( client.readBytes(&c, 1) != 1 ) {
+      keep = false;
+      break;
+    }
+    if( len < resp_size - 1 && c != '\n' ) {
+      resp[len++] = c;
+    }
+    content_len--;
+  }
+  resp[len] = '\0';
+
+  if( !keep ) {
+    client.stop();
+  }
+  return status;
+}
+
+/*
+Spool of readings that could not be posted
+ Segment files /spool/<sequence> on LittleFS (which spreads the writes
+ over the flash) start with the meter serial and are only appended to.
+ Once InfluxDB accepts posts again, batches of the oldest readings are
+ posted from loop() while no meter data is waiting, at most one batch
+ each SPOOL_REPLAY_MS, and fully sent segments are deleted. The replay
+ position in the oldest segment is kept in RTC user memory after each
+ batch, so a reset during replay continues where it stopped. Only after a
+ power loss the segment is sent again, InfluxDB overwrites the duplicates.
+ If the spool is full, the oldest segment is dropped.
+ */
+#define SPOOL_DIR "/spool"
+#define SPOOL_MAGIC 0x4c505331  // "SPL1"
+#ifndef SPOOL_SEGMENT_RECORDS
+#define SPOOL_SEGMENT_RECORDS 256  // ~4 h of readings at one post per minute
+#endif
+#ifndef SPOOL_MAX_SEGMENTS
+#define SPOOL_MAX_SEGMENTS 64      // ~10 days, 400 kB
+#endif
+#ifndef SPOOL_BATCH
+#define SPOOL_BATCH 8              // readings per replay post, sizes the static post buffer
+#endif
+#ifndef SPOOL_REPLAY_MS
+#define SPOOL_REPLAY_MS 1000
+#endif
+#define SPOOL_MARK_MAGIC 0x4b4d5331  // "SMK1"
+#define SPOOL_RTC_OFFSET 112         // [4 byte blocks], behind the saved state
+
+typedef struct spool_header {
+  uint32_t magic;
+  char serial[10];
+  uint16_t reserved;
+} spool_header_t;
+
+typedef struct spool_record {
+  uint64_t time_ms;
+  uint64_t aPlus;   // 1/10 Wh
+  uint64_t aMinus;  // 1/10 Wh
+} spool_record_t;
+
+// Replay position, survives a reset but not a power loss
+typedef struct spool_mark {
+  uint32_t magic;
+  uint32_t first;  // segment sequence
+  uint32_t sent;   // records of that segment already replayed
+  uint32_t crc;    // crc32 of the fields before
+} spool_mark_t;
+
+bool spool_ok = false;         // file system mounted
+uint32_t spool_first = 1;      // sequence of oldest segment
+uint32_t spool_last = 0;       // sequence of newest segment, spool_first - 1 if there is none
+uint32_t spool_last_count = 0; // records in newest segment, 0 if the next reading starts a new one
+uint32_t spool_records = 0;    // records waiting
+uint32_t spool_sent = 0;       // records of first segment already replayed
+uint32_t spool_replayed = 0;   // records replayed since boot
+uint32_t spool_run = 0;        // records replayed since the spool was last empty
+uint32_t spool_dropped = 0;    // records lost because the spool was full
+
+char *spool_name( char *name, size_t size, uint32_t seq ) {
+  snprintf(name, size, SPOOL_DIR "/%08x", seq);
+  return name;
+}
+
+uint32_t spool_segment_records( uint32_t seq ) {
+  char name[32];
+  File f = LittleFS.open(spool_name(name, sizeof(name), seq), "r");
+  uint32_t records = (f && f.size() > sizeof(spool_header_t)) ? (f.size() - sizeof(spool_header_t)) / sizeof(spool_record_t) : 0;
+  f.close();
+  return records;
+}
+
+void spool_remove_first() {
+  char name[32];
+  LittleFS.remove(spool_name(name, sizeof(name), spool_first));
+  if( spool_first == spool_last ) {
+    spool_last_count = 0;  // append to a new segment next time
+  }
+  spool_first++;  // spool_last + 1 if this was the last segment
+  spool_sent = 0;
+}
+
+void spool_mark() {
+  spool_mark_t mark = { SPOOL_MARK_MAGIC, spool_first, spool_sent, 0 };
+  mark.crc = crc32(&mark, offsetof(spool_mark_t, crc));
+  ESP.rtcUserMemoryWrite(SPOOL_RTC_OFFSET, (uint32_t *)&mark, sizeof(mark));
+}
+
+// Records of the first segment replayed before the reset, 0 if unknown
+uint32_t spool_marked_sent( uint32_t first_records ) {
+  spool_mark_t mark;
+  if( !ESP.rtcUserMemoryRead(SPOOL_RTC_OFFSET, (uint32_t *)&mark, sizeof(mark))
+   || mark.magic != SPOOL_MARK_MAGIC || mark.crc != crc32(&mark, offsetof(spool_mark_t, crc))
+   || mark.first != spool_first || mark.sent > first_records ) {
+    return 0;
+  }
+  return mark.sent;
+}
+
+// Mount and find the segments left from before the restart
+void setup_spool() {
+  spool_ok = LittleFS.begin();
+  if( !spool_ok ) {
+    slog(LOG_ERR, "Mount of spool file system failed");
+    return;
+  }
+  LittleFS.mkdir(SPOOL_DIR);
+  bool any = false;
+  uint32_t first = 0;
+  uint32_t last = 0;
+  Dir dir = LittleFS.openDir(SPOOL_DIR);
+  while( dir.next() ) {
+    uint32_t seq = strtoul(dir.fileName().c_str(), 0, 16);
+    if( !any || seq < first ) {
+      first = seq;
+    }
+    if( !any || seq > last ) {
+      last = seq;
+    }
+    any = true;
+  }
+  if( any ) {
+    spool_first = first;
+    spool_last = last;
+    for( uint32_t seq = spool_first; seq <= spool_last; seq++ ) {
+      spool_records += spool_segment_records(seq);
+    }
+    spool_last_count = SPOOL_SEGMENT_RECORDS;  // do not append to segments of an older firmware run
+    spool_sent = spool_marked_sent(spool_segment_records(spool_first));
+    spool_records -= min(spool_sent, spool_records);
+    slog(LOG_NOTICE, "Spool has %u readings in %u segments, %u already replayed", spool_records, spool_last + 1 - spool_first, spool_sent);
+  }
+}
+
+// Keep a reading that could not be posted
+void spool_add( const itron_3hz_t *reading, uint64_t time_ms ) {
+  char name[32];
+  if( !spool_ok ) {
+    return;
+  }
+  if( spool_last_count == 0 || spool_last_count >= SPOOL_SEGMENT_RECORDS ) {
+    spool_last++;  // new segment, also the first one if the spool was empty
+    spool_last_count = 0;
+    while( spool_last - spool_first >= SPOOL_MAX_SEGMENTS ) {
+      uint32_t lost = spool_segment_records(spool_first) - spool_sent;
+      spool_dropped += lost;
+      spool_records -= min(lost, spool_records);
+      spool_remove_first();
+    }
+  }
+  File f = LittleFS.open(spool_name(name, sizeof(name), spool_last), "a");
+  if( !f ) {
+    spool_dropped++;
+    return;
+  }
+  if( spool_last_count == 0 ) {
+    spool_header_t header = { SPOOL_MAGIC, {0}, 0 };
+    memcpy(header.serial, reading->serial, sizeof(header.serial));
+    f.write((const uint8_t *)&header, sizeof(header));
+  }
+  spool_record_t record = { time_ms, reading->aPlus, reading->aMinus };
+  if( f.write((const uint8_t *)&record, sizeof(record)) == sizeof(record) ) {
+    spool_records++;
+    spool_last_count++;
+  }
+  else {
+    spool_dropped++;
+  }
+  f.close();
+}
+
+// Post the next batch of spooled readings while InfluxDB accepts posts
+void spool_replay() {
+  static char body[SPOOL_BATCH * (sizeof("energy,meter= watt=,watt_out= \n") + SERIAL_HEX_SIZE + 3 * 20)];
+  static char response[64];
+  char name[32];
+
+  if( !spool_records || influx_status < 200 || influx_status > 299 ) {
+    return;
+  }
+
+  File f = LittleFS.open(spool_name(name, sizeof(name), spool_first), "r");
+  spool_header_t header;
+  if( !f || f.read((uint8_t *)&header, sizeof(header)) != sizeof(header) || header.magic != SPOOL_MAGIC ) {
+    f.close();
+    slog(LOG_ERR, "Spool segment %s unreadable, dropped", name);
+    uint32_t lost = spool_segment_records(spool_first) - spool_sent;
+    spool_dropped += lost;
+    spool_records -= min(lost, spool_records);
+    spool_remove_first();
+    return;
+  }
+  f.seek(sizeof(header) + spool_sent * sizeof(spool_record_t));
+
+  itron_3hz_t reading;
+  memset(&reading, 0, sizeof(reading));
+  memcpy(reading.serial, header.serial, sizeof(reading.serial));
+  size_t len = 0;
+  uint32_t n = 0;
+  spool_record_t record;
+  while( n < SPOOL_BATCH && f.read((uint8_t *)&record, sizeof(record)) == sizeof(record) ) {
+    reading.aPlus = record.aPlus;
+    reading.aMinus = record.aMinus;
+    len += itron_line(&body[len], sizeof(body) - len, &reading, record.time_ms);
+    n++;
+  }
+  bool at_end = !f.available();
+  f.close();
+
+  if( n ) {
+    influx_posts++;
+    influx_status = influx_post(body, len, response, sizeof(response));
+    if( influx_status < 200 || influx_status > 299 ) {
+      influx_errors++;
+      slog(LOG_ERR, "Spool replay status=%d response='%s'", influx_status, response);
+      return;
+    }
+    spool_sent += n;
+    spool_records -= n;
+    spool_replayed += n;
+    spool_run += n;
+    spool_mark();
+  }
+  if( at_end ) {
+    spool_remove_first();  // all sent, the next reading to spool starts a new segment
+  }
+  if( !spool_records ) {
+    slog(LOG_NOTICE, "Spool replay of %u readings finished", spool_run);
+    spool_run = 0;
+  }
+}
+
+/*
+Energy totals
+ Import and export of the current and previous local day and month are
+ added up from the counter differences of each validated record, split by
+ tariff: TARIFF_WINDOWS lists local times of day "hh:mm-hh:mm,..." for
+ tariffs 1, 2, ..., energy outside all windows is tariff 0. The highest
+ import averaged over a PEAK_INTERVAL_S interval is kept per day and month.
+ Totals remember the counters they were updated to and are saved to
+ LittleFS every ENERGY_SAVE_S, on a new day and before a planned restart.
+ Energy of a gap longer than ENERGY_GAP_S between records (device off,
+ meter not read) is not known to belong to a day or tariff, it is added
+ to separate unattributed totals on the first record after.
+ */
+#define ENERGY_FILE "/energy"
+#define ENERGY_MAGIC 0x4e454732  // "ENG2"
+#define MAX_TARIFFS 4
+#define ENERGY_MIN_TIME 1600000000  // earlier unix time [s] means no NTP time yet
+#ifndef TARIFF_WINDOWS
+#define TARIFF_WINDOWS ""  // e.g. "22:00-06:00" for a night tariff 1
+#endif
+#ifndef PEAK_INTERVAL_S
+#define PEAK_INTERVAL_S 900  // demand interval of the peak [s]
+#endif
+#ifndef ENERGY_SAVE_S
+#define ENERGY_SAVE_S 900
+#endif
+#ifndef ENERGY_GAP_S
+#define ENERGY_GAP_S 60  // energy of a longer gap between records is unattributed
+#endif
+
+typedef struct energy_bucket {
+  uint32_t period;           // local yyyymmdd of a day, yyyymm of a month, 0 if unused
+  uint32_t in[MAX_TARIFFS];  // import by tariff [0.1 Wh]
+  uint32_t out[MAX_TARIFFS]; // export by tariff [0.1 Wh]
+  uint32_t peak_w;           // highest average import of an interval [W]
+  uint32_t peak_time;        // unix time [s] that interval started
+} energy_bucket_t;
+
+typedef struct energy_totals {
+  uint32_t magic;
+  uint32_t crc;          // crc32 of the rest
+  char serial[10];       // meter the counters belong to
+  uint64_t aPlus;        // counters the totals are updated to [0.1 Wh]
+  uint64_t aMinus;
+  uint32_t time;         // unix time [s] of that update
+  uint32_t interval;     // unix time [s] the current peak interval started
+  uint32_t interval_in;  // import in the current peak interval [0.1 Wh]
+  energy_bucket_t day;
+  energy_bucket_t prev_day;
+  energy_bucket_t month;
+  energy_bucket_t prev_month;
+  uint64_t gap_in;       // unattributed import of gaps [0.1 Wh]
+  uint64_t gap_out;      // unattributed export of gaps [0.1 Wh]
+  uint32_t gaps;         // gaps longer than ENERGY_GAP_S
+  uint32_t gap_time;     // unix time [s] of the record ending the last gap
+} energy_totals_t;
+
+typedef struct tariff_window {
+  uint16_t start;  // local minute of day
+  uint16_t end;    // exclusive, before start if the window spans midnight
+} tariff_window_t;
+
+energy_totals_t energy;
+tariff_window_t tariff_windows[MAX_TARIFFS - 1];
+uint8_t tariff_count = 1;   // tariff 0 and one per window
+uint32_t energy_saved_ms = 0;
+
+uint32_t energy_crc( const energy_totals_t *totals ) {
+  return crc32((const uint8_t *)totals + offsetof(energy_totals_t, serial), sizeof(*totals) - offsetof(energy_totals_t, serial));
+}
+
+void energy_save() {
+  energy_saved_ms = millis();
+  if( !spool_ok || !energy.time ) {
+    return;
+  }
+  energy.magic = ENERGY_MAGIC;
+  energy.crc = energy_crc(&energy);
+  File f = LittleFS.open(ENERGY_FILE, "w");
+  if( !f || f.write((const uint8_t *)&energy, sizeof(energy)) != sizeof(energy) ) {
+    slog(LOG_ERR, "Save of energy totals failed");
+  }
+  f.close();
+}
+
+// Parse the tariff windows and load the totals saved before the restart
+void setup_energy() {
+  const char *windows = TARIFF_WINDOWS;
+  unsigned h1, m1, h2, m2;
+  int len;
+  while( tariff_count < MAX_TARIFFS && sscanf(windows, " %u:%u-%u:%u%n", &h1, &m1, &h2, &m2, &len) == 4 ) {
+    tariff_windows[tariff_count - 1].start = (h1 * 60 + m1) % 1440;
+    tariff_windows[tariff_count - 1].end = (h2 * 60 + m2) % 1440;
+    tariff_count++;
+    windows += len;
+    if( *windows == ',' ) {
+      windows++;
+    }
+  }
+
+  memset(&energy, 0, sizeof(energy));
+  File f = spool_ok ? LittleFS.open(ENERGY_FILE, "r") : File();
+  if( f && f.read((uint8_t *)&energy, sizeof(energy)) == sizeof(energy)
+   && energy.magic == ENERGY_MAGIC && energy.crc == energy_crc(&energy) ) {
+    slog(LOG_NOTICE, "Energy totals restored from %u", energy.time);
+  }
+  else {
+    memset(&energy, 0, sizeof(energy));
+  }
+  f.close();
+}
+
+uint8_t tariff_at( uint16_t minute ) {
+  for( uint8_t i = 0; i < tariff_count - 1; i++ ) {
+    const tariff_window_t *w = &tariff_windows[i];
+    if( w->start <= w->end ? (minute >= w->start && minute < w->end) : (minute >= w->start || minute < w->end) ) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Start a new bucket if the period changed, returns true if it did
+bool energy_roll( energy_bucket_t *curr, energy_bucket_t *prev, uint32_t period ) {
+  if( curr->period == period ) {
+    return false;
+  }
+  *prev = *curr;
+  memset(curr, 0, sizeof(*curr));
+  curr->period = period;
+  return true;
+}
+
+void energy_peak( energy_bucket_t *bucket, uint32_t w, uint32_t interval ) {
+  if( w > bucket->peak_w ) {
+    bucket->peak_w = w;
+    bucket->peak_time = interval;
+  }
+}
+
+// Add the energy since the last validated record
+void energy_add( const itron_3hz_t *reading, uint64_t time_ms ) {
+  time_t now = time_ms / 1000;
+  if( now < ENERGY_MIN_TIME ) {
+    return;
+  }
+  if( !energy.time || memcmp(energy.serial, reading->serial, sizeof(energy.serial))
+   || reading->aPlus < energy.aPlus || reading->aMinus < energy.aMinus ) {
+    // first reading or another meter: count from here
+    memcpy(energy.serial, reading->serial, sizeof(energy.serial));
+    energy.aPlus = reading->aPlus;
+    energy.aMinus = reading->aMinus;
+    energy.time = now;
+    return;
+  }
+
+  struct tm local;
+  localtime_r(&now, &local);
+  uint32_t day = (local.tm_year + 1900) * 10000 + (local.tm_mon + 1) * 100 + local.tm_mday;
+  bool new_day = energy_roll(&energy.day, &energy.prev_day, day);
+  energy_roll(&energy.month, &energy.prev_month, day / 100);
+
+  uint8_t tariff = tariff_at(local.tm_hour * 60 + local.tm_min);
+  uint32_t in = reading->aPlus - energy.aPlus;
+  uint32_t out = reading->aMinus - energy.aMinus;
+  if( now - energy.time > ENERGY_GAP_S ) {
+    energy.gap_in += in;
+    energy.gap_out += out;
+    energy.gaps++;
+    energy.gap_time = now;
+    slog(LOG_NOTICE, "Energy of a %u s gap unattributed: in %.1f Wh, out %.1f Wh", (uint32_t)(now - energy.time), in / 10.0, out / 10.0);
+    in = 0;
+    out = 0;
+  }
+  energy.day.in[tariff] += in;
+  energy.day.out[tariff] += out;
+  energy.month.in[tariff] += in;
+  energy.month.out[tariff] += out;
+
+  uint32_t interval = now - now % PEAK_INTERVAL_S;
+  if( interval != energy.interval ) {
+    energy.interval = interval;
+    energy.interval_in = 0;
+  }
+  if( now - energy.time <= 10 ) {  // energy of a longer gap is not known to belong to this interval
+    energy.interval_in += in;
+    // the average over the whole interval only grows until it ends
+    uint32_t peak_w = sml_power_w(energy.interval_in, 0, PEAK_INTERVAL_S);
+    energy_peak(&energy.day, peak_w, interval);
+    energy_peak(&energy.month, peak_w, interval);
+  }
+
+  energy.aPlus = reading->aPlus;
+  energy.aMinus = reading->aMinus;
+  energy.time = now;
+  if( new_day || millis() - energy_saved_ms > ENERGY_SAVE_S * 1000 ) {
+    energy_save();
+  }
+}
+
+uint32_t energy_sum( const uint32_t *tariffs ) {
+  uint32_t sum = 0;
+  for( uint8_t i = 0; i < tariff_count; i++ ) {
+    sum += tariffs[i];
+  }
+  return sum;
+}
+
+void post_data() {
+  static char msg[sizeof("energy,meter= watt=,watt_out= \n") + SERIAL_HEX_SIZE + 3 * 20];
+  static char response[128];
+
+  int len = itron_line(msg, sizeof(msg), &itron, recv_time_ms);
+
+  influx_posts++;
+  influx_status = influx_post(msg, len, response, sizeof(response));
+
+  if (influx_status < 200 || influx_status > 299) {
+    influx_errors++;
+    spool_add(&itron, recv_time_ms);
+    breathe_interval = err_interval;
+    slog(LOG_ERR, "Post %s:%d status=%d msg='%.*s' response='%s'", INFLUX_SERVER,
+                INFLUX_PORT, influx_status, len - 1, msg, response);
+  } else {
+    breathe_interval = ok_interval;
+    post_time = time(NULL);
+  };
+}
+
+#ifdef SML_OBIS_INFLUX
+// Post the numeric entries of the OBIS table as fields of measurement obis (not spooled)
+void post_obis( uint64_t time_ms ) {
+  static char msg[sizeof("obis,meter= \n") + SERIAL_HEX_SIZE + 20 + SML_OBIS_MAX * 48];
+  static char response[128];
+  char serial[SERIAL_HEX_SIZE];
+  hex_str(serial, sizeof(serial), itron.serial, sizeof(itron.serial), '-');
+
+  int len = sml_obis_line(msg, sizeof(msg), &obis_table, serial, time_ms);
+  if( !len ) {
+    return;
+  }
+  influx_posts++;
+  influx_status = influx_post(msg, len, response, sizeof(response));
+  if( influx_status < 200 || influx_status > 299 ) {
+    influx_errors++;
+    slog(LOG_ERR, "Post obis %s:%d status=%d response='%s'", INFLUX_SERVER, INFLUX_PORT, influx_status, response);
+  }
+}
+#endif
+
+#ifdef WLED_LEDS
+/*
+WLED realtime UDP output
+ Packets are only sent if color or bar level change, plus a small
+ keepalive shortly before the wled_secs realtime timeout ends.
+ Changes use the range protocol DNRGB, keepalives WARLS with one LED.
+ If nothing is to be shown, sending stops and WLED returns to its own
+ effect after the timeout.
+ */
+#ifndef WLED_MODE
+#define WLED_MODE 0  // 0: whole strip in status color, 1: bar graph of current power
+#endif
+#ifndef WLED_BAR_W
+#define WLED_BAR_W 100  // W per LED in bar graph mode
+#endif
+
+WiFiUDP wledUDP;
+const uint8_t wled_secs = 5;
+const uint16_t wled_keepalive_ms = 1500;  // resend this long before the timeout ends
+// Consider enabling wled setting "Force max brightness" to be independent from wled master brightness
+const uint8_t wled_brightness = WLED_BRIGHTNESS;  // 0..255
+// only for display on web page
+uint8_t wled_r = 0;
+uint8_t wled_g = 0;
+uint8_t wled_b = 0;
+uint16_t wled_level = 0;   // lit LEDs
+uint32_t wled_update = 0;  // ms of last udp packet
+uint32_t wled_change = 0;  // ms of last color change
+uint32_t wled_packets = 0; // udp packets sent
+
+// Set count LEDs from first on to one color (WLED protocol DNRGB)
+bool wled_range( uint16_t first, uint16_t count, uint8_t r, uint8_t g, uint8_t b ) {
+  if( !wledUDP.beginPacket(WLED_HOST, WLED_PORT) ) {
+    return false;
+  }
+  wledUDP.write(4);  // WLED proto DNRGB
+  wledUDP.write(wled_secs);  // hold color for some seconds
+  wledUDP.write(first >> 8);
+  wledUDP.write(first & 0xff);
+  while( count-- ) {
+    wledUDP.write(r);
+    wledUDP.write(g);
+    wledUDP.write(b);
+  }
+  return wledUDP.endPacket();
+}
+
+// Extend the realtime timeout by resending the first LED (WLED protocol WARLS)
+bool wled_keepalive( uint8_t r, uint8_t g, uint8_t b ) {
+  if( !wledUDP.beginPacket(WLED_HOST, WLED_PORT) ) {
+    return false;
+  }
+  uint8_t packet[] = { 1, wled_secs, 0, r, g, b };  // WLED proto WARLS, LED index 0
+  wledUDP.write(packet, sizeof(packet));
+  return wledUDP.endPacket();
+}
+
+void send_wled() {
+  static bool isOn = false;  // for on/off hysteresis
+  static bool active = false;  // realtime mode expected active on WLED
+  
+  if( itron.valid != 0x3f ) {
+    return;
+  }
+
+  uint32_t aPlusW = power_in_w;
+  uint32_t aMinusW = power_out_w;
+
+  uint8_t r = 0, g = 0, b = 0;
+  if( aPlusW > WLED_CONSUMPTION_HIGH ) {
+    r = 0xff, b = 0x22;  // red warning on high load
+    isOn = false;
+  }
+  else if( aMinusW > WLED_BACKFEED_TOO_HIGH ) {
+    b = 0xff;  // too high back feed: blue
+    isOn = true;
+  }
+  else if( aMinusW > WLED_BACKFEED_VERY_HIGH ) {
+    g = 0xff; b = 0xff;  // very high back feed: cyan
+    isOn = true;
+  }
+  else if( (isOn and (aPlusW == 0 || aMinusW > 0)) || aMinusW > WLED_BACKFEED_GOOD ) {
+    g = 0xff; // good back feed: green
+    isOn = true;
+  }
+  else {
+    isOn = false;
+  }
+  
+  if( isOn ) {
+    r = (uint16_t)wled_brightness * r / 255;
+    g = (uint16_t)wled_brightness * g / 255;
+    b = (uint16_t)wled_brightness * b / 255;
+  }
+
+  uint16_t level = (r || g || b) ? WLED_LEDS : 0;
+  #if WLED_MODE == 1
+  // bar graph: length by power, status color or red for import and green for export
+  uint32_t power = max(aPlusW, aMinusW);
+  level = min((power + WLED_BAR_W / 2) / WLED_BAR_W, (uint32_t)WLED_LEDS);
+  if( !(r || g || b) ) {
+    if( aPlusW >= aMinusW ) {
+      r = wled_brightness;
+    }
+    else {
+      g = wled_brightness;
+    }
+  }
+  #endif
+
+  // slog(LOG_NOTICE, "wled: A+ %u W, A- %u W -> rgb %u,%u,%u level %u", aPlusW, aMinusW, r, g, b, level);
+
+  uint32_t now = millis();
+  bool sent = false;
+  if( !active ) {
+    wled_level = 0;  // WLED shows its own effect
+  }
+  if( level && (!active || r != wled_r || g != wled_g || b != wled_b) ) {
+    // color changed: whole strip, lit part and dark rest
+    sent = wled_range(0, level, r, g, b);
+    if( sent && level < WLED_LEDS ) {
+      sent = wled_range(level, WLED_LEDS - level, 0, 0, 0);
+    }
+  }
+  else if( level > wled_level ) {
+    sent = wled_range(wled_level, level - wled_level, r, g, b);
+  }
+  else if( level < wled_level ) {
+    sent = wled_range(level, wled_level - level, 0, 0, 0);
+  }
+  else if( level && now - wled_update >= wled_secs * 1000 - wled_keepalive_ms ) {
+    sent = wled_keepalive(r, g, b);
+  }
+
+  if( sent ) {
+    wled_packets++;
+    wled_update = now;
+    active = level > 0;
+    wled_level = level;
+    if( level && (wled_r != r || wled_g != g || wled_b != b) ) {
+      wled_change = wled_update;
+      wled_r = r;
+      wled_g = g;
+      wled_b = b;
+    }
+  }
+  else if( !level && wled_level ) {
+    // blank frame is sent once even if it failed, WLED times out to its own effect anyway
+    active = false;
+    wled_level = 0;
+  }
+  else if( now - wled_update >= wled_secs * 1000 ) {
+    active = false;  // timed out on WLED
+  }
+}
+#endif
+
+#define LATENCY_SAMPLES 32
+
+// Latency samples for percentiles, in ms (limit control) or us (injection)
+typedef struct latency {
+  uint32_t sample[LATENCY_SAMPLES];
+  uint32_t count;                    // samples ever added
+} latency_t;
+
+void latency_add( latency_t *latency, uint64_t from, uint64_t to ) {
+  latency->sample[latency->count++ % LATENCY_SAMPLES] = (to > from) ? to - from : 0;
+}
+
+int compare_u32( const void *a, const void *b ) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
 
-uint32_t last_counter_reset = 0;      // millis() of last counter reset
-volatile uint32_t counter_events = 0; // events of current interval so far
+// Percentile of the last LATENCY_SAMPLES samples
+uint32_t latency_percentile( const latency_t *latency, uint8_t percent ) {
+  uint32_t sorted[LATENCY_SAMPLES];
+  size_t n = min(latency->count, (uint32_t)LATENCY_SAMPLES);
+  if( n == 0 ) {
+    return 0;
+  }
+  memcpy(sorted, latency->sample, n * sizeof(*sorted));
+  qsort(sorted, n, sizeof(*sorted), compare_u32);
+  return sorted[(n - 1) * percent / 100];
+}
 
-typedef struct itron_3hz {
-  uint8_t valid;  // valid if 63 (one bit for each field)
-  char id[3];
-  char serial[10];
-  uint64_t file;
-  uint32_t uptime;
-  uint64_t aPlus;  // now 1/10 Wh
-  uint64_t aMinus; // now 1/10 Wh
-  bool detailed;
-} itron_3hz_t;
+#ifdef DTU_TOPIC
+#include <PubSubClient.h>
 
-itron_3hz_t itron = {0};
-time_t recv_time = 0;
-bool recv_detailed = true;
+/*
+Inverters controlled via OpenDTU
+ INVERTER_SERIAL is a list of serial[:max_limit[:priority]] separated by
+ commas or spaces. The max limit defaults to INVERTER_LIMIT, the priority
+ to 1. A backfeed correction is taken from the inverters with the lowest
+ priority first and given to the ones with the highest priority first.
+ Inverters of the same priority share it by their max limit.
+ */
+#ifndef MAX_INVERTERS
+#define MAX_INVERTERS 4
+#endif
+#ifndef LIMIT_ACK_TIMEOUT_MS
+#define LIMIT_ACK_TIMEOUT_MS 3000  // first retry if OpenDTU did not report the new limit, doubles each retry
+#endif
+#ifndef LIMIT_MAX_RETRIES
+#define LIMIT_MAX_RETRIES 4
+#endif
+#define LIMIT_EFFECT_TIMEOUT_MS 60000  // stop waiting for reduced or increased backfeed
 
-uint8_t sml_raw[2560];  // last sml record, enough for 2s at 9600 baud
-size_t sml_len = 0;  // length of last sml record
+/*
+Limit command tracking
+ Each command is followed from the record that triggered it to the publish,
+ the acknowledge (limit_absolute reports the new limit) and the first record
+ with backfeed changed in the expected direction. Unacknowledged commands
+ are published again with exponential backoff. Latencies of the steps are
+ kept for percentiles in /json.
+ */
+typedef enum { CMD_IDLE, CMD_SENT, CMD_ACKED } cmd_state_t;
+
+typedef struct limit_command {
+  uint8_t state;        // cmd_state_t
+  uint8_t retries;
+  uint16_t limit;       // requested limit [W]
+  int8_t direction;     // expected change of backfeed: -1 less, 1 more
+  uint32_t out_w;       // backfeed when published [W]
+  uint64_t frame_ms;    // unix time [ms] of the triggering record
+  uint64_t publish_ms;  // unix time [ms] of first publish
+  uint64_t ack_ms;      // unix time [ms] of acknowledge
+  uint64_t retry_ms;    // unix time [ms] of next retry
+} limit_command_t;
+
+latency_t latency_publish = { {0}, 0 };  // record to publish
+latency_t latency_ack = { {0}, 0 };      // publish to acknowledge
+latency_t latency_effect = { {0}, 0 };   // acknowledge to record with changed backfeed
+latency_t latency_total = { {0}, 0 };    // record to record with changed backfeed
+uint32_t cmd_count = 0;    // commands published
+uint32_t cmd_retries = 0;  // publish retries
+uint32_t cmd_failed = 0;   // commands never acknowledged
+uint32_t cmd_no_effect = 0;  // acknowledged commands without visible effect
+
+typedef struct inverter {
+  char serial[16];
+  char name[40];
+  uint16_t max_limit;   // unthrottled inverter limit [W]
+  uint8_t priority;     // higher: throttled later, opened earlier
+  uint16_t curr_limit;  // as reported by OpenDTU, UINT16_MAX if unknown
+  uint16_t new_limit;   // planned in the current control cycle
+  bool reachable;
+  bool dynamic;
+  limit_command_t cmd;  // last limit command
+} inverter_t;
 
-char *to_hex( char *buf, size_t len, char sep ) {
-  static char hex[1024*3+1];
-  char *out = hex;
-  while( len-- ) {
-    snprintf(out, 4, "%02x%c", *(buf++), sep);
-    out += 3;
+WiFiClient wifiMqtt;
+PubSubClient mqtt(wifiMqtt);
+inverter_t inverters[MAX_INVERTERS];
+size_t inverter_count = 0;
+
+const char *inverter_suffixes[] = { "name", "status/limit_absolute", "status/reachable", "status/limit_dynamic" };
+
+void setup_inverters() {
+  char list[] = INVERTER_SERIAL;
+  char *save = 0;
+  for( char *item = strtok_r(list, ", ", &save); item && inverter_count < MAX_INVERTERS; item = strtok_r(0, ", ", &save) ) {
+    char *limit = strchr(item, ':');
+    if( limit ) {
+      *(limit++) = '\0';
+    }
+    char *priority = limit ? strchr(limit, ':') : 0;
+    if( priority ) {
+      *(priority++) = '\0';
+    }
+    inverter_t *inv = &inverters[inverter_count++];
+    memset(inv, 0, sizeof(*inv));
+    strncpy(inv->serial, item, sizeof(inv->serial) - 1);
+    strcpy(inv->name, "?");
+    inv->max_limit = (limit && *limit) ? strtoul(limit, 0, 10) : INVERTER_LIMIT;
+    inv->priority = (priority && *priority) ? strtoul(priority, 0, 10) : 1;
+    inv->curr_limit = UINT16_MAX;
   }
-  *(--out) = '\0';
-  return hex;
 }
 
-// Post data to InfluxDB
-void post_data() {
-  static const char uri[] = "/write?db=" INFLUX_DB "&precision=s";
-
-  const char fmt[] = "energy,meter=%s watt=%llu,watt_out=%llu\n";
-  char msg[sizeof(fmt) + 30 + 2 * 10];
-  char *serial = to_hex(itron.serial, sizeof(itron.serial), '-');
-  snprintf(msg, sizeof(msg), fmt, serial, (itron.aPlus+5)/10, (itron.aMinus+5)/10);
-
-  http.begin(client, INFLUX_SERVER, INFLUX_PORT, uri);
-  http.setUserAgent(PROGNAME);
-  influx_status = http.POST(msg);
-  String payload = http.getString();
-  http.end();
-  
-  if (influx_status < 200 || influx_status > 299) {
-    breathe_interval = err_interval;
-    syslog.logf(LOG_ERR, "Post %s:%d%s status=%d msg='%s' response='%s'", INFLUX_SERVER,
-                INFLUX_PORT, uri, influx_status, msg, payload.c_str());
-  } else {
-    breathe_interval = ok_interval;
-    post_time = time(NULL);
-  };
+char *inverter_topic( char *topic, size_t size, const inverter_t *inv, const char *suffix ) {
+  snprintf(topic, size, DTU_TOPIC "/%s/%s", inv->serial, suffix);
+  return topic;
 }
 
-#ifdef WLED_LEDS
-WiFiUDP wledUDP;
-const uint8_t wled_secs = 5;
-// Consider enabling wled setting "Force max brightness" to be independent from wled master brightness
-const uint8_t wled_brightness = WLED_BRIGHTNESS;  // 0..255
-// only for display on web page
-uint8_t wled_r = 0;
-uint8_t wled_g = 0;
-uint8_t wled_b = 0;
-uint32_t wled_update = 0;  // ms of last udp packet
-uint32_t wled_change = 0;  // ms of last color change
-
-void send_wled() {
-  static uint32_t uptime = 0;
-  static uint64_t aPlus = 0;
-  static uint64_t aMinus = 0;
-  static bool isOn = false;  // for on/off hysteresis
-  
-  uint64_t aPlusW = 0;
-  uint64_t aMinusW = 0;
+// Inverter limit can be changed in this control cycle (known, reachable, dynamic and no command pending)
+bool is_controllable( const inverter_t *inv ) {
+  return inv->curr_limit != UINT16_MAX && inv->reachable && inv->dynamic && inv->cmd.state != CMD_SENT;
+}
 
-  if( itron.valid == 0x3f ) {
-    if( uptime != itron.uptime && (itron.aPlus != aPlus || itron.aMinus != aMinus) ) {
-      if( uptime ) {
-        aPlusW = (itron.aPlus - aPlus) * 360 / (itron.uptime - uptime);
-        aMinusW = (itron.aMinus - aMinus) * 360 / (itron.uptime - uptime);
-      }
-      
-      uptime = itron.uptime;
-      aPlus = itron.aPlus;
-      aMinus = itron.aMinus;
+bool publish_limit( inverter_t *inv, uint16_t limit ) {
+  char topic[80];
+  char payload[10];
+  snprintf(payload, sizeof(payload), "%u", limit);
+  inverter_topic(topic, sizeof(topic), inv, "cmd/limit_nonpersistent_absolute");
+  return mqtt.connected() && mqtt.publish(topic, payload);
+}
 
-      uint8_t r = 0, g = 0, b = 0;
-      if( aPlusW > WLED_CONSUMPTION_HIGH ) {
-        r = 0xff, b = 0x22;  // red warning on high load
-        isOn = false;
-      }
-      else if( aMinusW > WLED_BACKFEED_TOO_HIGH ) {
-        b = 0xff;  // too high back feed: blue
-        isOn = true;
-      }
-      else if( aMinusW > WLED_BACKFEED_VERY_HIGH ) {
-        g = 0xff; b = 0xff;  // very high back feed: cyan
-        isOn = true;
-      }
-      else if( (isOn and (aPlusW == 0 || aMinusW > 0)) || aMinusW > WLED_BACKFEED_GOOD ) {
-        g = 0xff; // good back feed: green
-        isOn = true;
+// Publish unacknowledged limit commands again with exponential backoff
+void retry_limits() {
+  uint64_t now = epoch_ms();
+  for( size_t i = 0; i < inverter_count; i++ ) {
+    inverter_t *inv = &inverters[i];
+    limit_command_t *cmd = &inv->cmd;
+    if( cmd->state == CMD_SENT && now >= cmd->retry_ms ) {
+      if( cmd->retries < LIMIT_MAX_RETRIES ) {
+        cmd->retries++;
+        cmd_retries++;
+        cmd->retry_ms = now + ((uint32_t)LIMIT_ACK_TIMEOUT_MS << cmd->retries);
+        bool ok = publish_limit(inv, cmd->limit);
+        slog(LOG_WARNING, "Retry %u of limit %u W for inverter '%s'%s", cmd->retries, cmd->limit, inv->name, ok ? "" : " failed");
       }
       else {
-        isOn = false;
-      }
-      
-      if( isOn ) {
-        r = (uint16_t)wled_brightness * r / 255;
-        g = (uint16_t)wled_brightness * g / 255;
-        b = (uint16_t)wled_brightness * b / 255;
+        cmd_failed++;
+        cmd->state = CMD_IDLE;
+        slog(LOG_ERR, "Limit %u W for inverter '%s' not acknowledged after %u retries", cmd->limit, inv->name, cmd->retries);
       }
+    }
+    else if( cmd->state == CMD_ACKED && now - cmd->ack_ms > LIMIT_EFFECT_TIMEOUT_MS ) {
+      cmd_no_effect++;
+      cmd->state = CMD_IDLE;
+    }
+  }
+}
 
-      // syslog.logf(LOG_NOTICE, "wled: A+ %llu W, A- %llu W -> rgb %u,%u,%u", aPlusW, aMinusW, r, g, b);
+// Limit of inverter reported by OpenDTU
+void ack_limit( inverter_t *inv, uint16_t limit ) {
+  limit_command_t *cmd = &inv->cmd;
+  if( cmd->state == CMD_SENT && cmd->limit == limit ) {
+    cmd->ack_ms = epoch_ms();
+    cmd->state = CMD_ACKED;
+    latency_add(&latency_ack, cmd->publish_ms, cmd->ack_ms);
+  }
+}
 
-      if( (r || g || b) && wledUDP.beginPacket(WLED_HOST, WLED_PORT) ) {
-        wledUDP.write(2);  // WLED proto DRGB
-        wledUDP.write(wled_secs);  // hold color for some seconds
-        int led = WLED_LEDS;
-        while( led-- ) {
-          wledUDP.write(r);
-          wledUDP.write(g);
-          wledUDP.write(b);
-        }
-        wledUDP.endPacket();
-        wled_update = millis();
-        if( wled_r != r || wled_g != g || wled_b != b ) {
-          wled_change = wled_update;
-          wled_r = r;
-          wled_g = g;
-          wled_b = b;
-        }
-      }
+// A limit command was sent and its effect is not yet visible in backfeed.
+// Acknowledged increases do not count: if the sun caps production below
+// the old limit there is no effect to wait for (still tracked for latency)
+bool limits_settling() {
+  for( size_t i = 0; i < inverter_count; i++ ) {
+    const limit_command_t *cmd = &inverters[i].cmd;
+    if( cmd->state == CMD_SENT || (cmd->state == CMD_ACKED && cmd->direction < 0) ) {
+      return true;
     }
   }
+  return false;
 }
-#endif
-
-#ifdef DTU_TOPIC
-#include <PubSubClient.h>
 
-WiFiClient wifiMqtt;
-PubSubClient mqtt(wifiMqtt);
-const char topic_name[] =      DTU_TOPIC "/" INVERTER_SERIAL "/name";
-const char topic_limit[] =     DTU_TOPIC "/" INVERTER_SERIAL "/status/limit_absolute";
-const char topic_reachable[] = DTU_TOPIC "/" INVERTER_SERIAL "/status/reachable";
-const char topic_dynamic[] =   DTU_TOPIC "/" INVERTER_SERIAL "/status/limit_dynamic";
-char inverter[80] = "?";  
-uint16_t curr_limit = UINT16_MAX;
-bool reachable = false;
-bool dynamic = false;
+// Check new record for the backfeed change expected from acknowledged commands
+void track_limit_effect() {
+  for( size_t i = 0; i < inverter_count; i++ ) {
+    limit_command_t *cmd = &inverters[i].cmd;
+    if( cmd->state == CMD_ACKED && recv_time_ms > cmd->ack_ms
+     && ((cmd->direction < 0 && power_out_w < cmd->out_w) || (cmd->direction > 0 && power_out_w > cmd->out_w)) ) {
+      latency_add(&latency_effect, cmd->ack_ms, recv_time_ms);
+      latency_add(&latency_total, cmd->frame_ms, recv_time_ms);
+      cmd->state = CMD_IDLE;
+    }
+  }
+}
 
 /*
-Send MQTT request to change power limit if it changed
-Limit is rounded to full 100W  
+Send MQTT requests to change power limits planned in this control cycle
+Limits are rounded to LIMIT_ROUND_GRANULARITY
 */
-void publish_limit( uint64_t prod, uint16_t limit ) {
-  /// syslog.logf(LOG_INFO, "publish_limit for prod %llu: %u W", prod, limit);
-
-  limit = ((limit + LIMIT_ROUND_GRANULARITY/2) / LIMIT_ROUND_GRANULARITY) * LIMIT_ROUND_GRANULARITY;  // round limit
+void publish_limits( uint64_t prod ) {
+  for( size_t i = 0; i < inverter_count; i++ ) {
+    inverter_t *inv = &inverters[i];
+    if( inv->new_limit == inv->curr_limit ) {
+      continue;
+    }
 
-  if( limit != curr_limit ) {
-    char payload[10];
-    snprintf(payload, sizeof(payload), "%u", limit);
+    uint16_t limit = ((inv->new_limit + LIMIT_ROUND_GRANULARITY/2) / LIMIT_ROUND_GRANULARITY) * LIMIT_ROUND_GRANULARITY;  // round limit
+    /// slog(LOG_INFO, "publish_limit for prod %llu: %u W", prod, limit);
 
-    if( !mqtt.connected() || (dynamic && !mqtt.publish(DTU_TOPIC "/" INVERTER_SERIAL "/cmd/limit_nonpersistent_absolute", payload))) {
-      syslog.logf(LOG_ERR, "Mqtt publish limit %s for inverter '%s' failed", payload, inverter);
-    }
-    else if (dynamic) {
-      syslog.logf(LOG_NOTICE, "Producing %llu W -> change nonpersistent limit of inverter '%s' from %u to %s W", prod, inverter, curr_limit, payload);
+    if( limit != inv->curr_limit ) {
+      if( !mqtt.connected() || (inv->dynamic && !publish_limit(inv, limit))) {
+        slog(LOG_ERR, "Mqtt publish limit %u for inverter '%s' failed", limit, inv->name);
+      }
+      else if (inv->dynamic) {
+        limit_command_t *cmd = &inv->cmd;
+        cmd->state = CMD_SENT;
+        cmd->retries = 0;
+        cmd->limit = limit;
+        cmd->direction = (limit < inv->curr_limit) ? -1 : 1;
+        cmd->out_w = power_out_w;
+        cmd->frame_ms = recv_time_ms;
+        cmd->publish_ms = epoch_ms();
+        cmd->retry_ms = cmd->publish_ms + LIMIT_ACK_TIMEOUT_MS;
+        cmd_count++;
+        latency_add(&latency_publish, cmd->frame_ms, cmd->publish_ms);
+        slog(LOG_NOTICE, "Producing %llu W -> change nonpersistent limit of inverter '%s' from %u to %u W", prod, inv->name, inv->curr_limit, limit);
+      }
+      else {
+        slog(LOG_NOTICE, "Producing %llu W -> no change of limit for inverter '%s' from %u to %u W due to limit_dynamic is not 1", prod, inv->name, inv->curr_limit, limit);
+      }
     }
     else {
-      syslog.logf(LOG_NOTICE, "Producing %llu W -> no change of limit for inverter '%s' from %u to %s W due to topic '%s' is not 1", prod, inverter, curr_limit, payload, topic_dynamic);
+      slog(LOG_NOTICE, "Producing %llu W -> rounded limit for inverter '%s' of %u W still the same", prod, inv->name, inv->curr_limit);
     }
   }
-  else {
-      syslog.logf(LOG_NOTICE, "Producing %llu W -> rounded limit for inverter '%s' of %u W still the same", prod, inverter, curr_limit);
+}
+
+/*
+Share a change of the total limit between the controllable inverters
+ delta > 0 opens, delta < 0 throttles. Returns the part of delta applied.
+ */
+int32_t share_limit( int32_t delta ) {
+  int32_t applied = 0;
+  for( int p = 0; p <= UINT8_MAX && applied != delta; p++ ) {
+    uint8_t priority = (delta < 0) ? p : UINT8_MAX - p;
+    uint32_t room = 0;
+    uint32_t weight = 0;
+    for( size_t i = 0; i < inverter_count; i++ ) {
+      inverter_t *inv = &inverters[i];
+      if( inv->priority == priority && is_controllable(inv) ) {
+        uint32_t r = (delta < 0) ? inv->new_limit : inv->max_limit - min(inv->new_limit, inv->max_limit);
+        if( r ) {
+          room += r;
+          weight += inv->max_limit;
+        }
+      }
+    }
+    if( room == 0 ) {
+      continue;
+    }
+
+    uint32_t take = min((uint32_t)abs(delta - applied), room);
+    uint32_t left = take;
+    for( int pass = 0; pass < 2 && left; pass++ ) {  // second pass distributes rounding rest
+      for( size_t i = 0; i < inverter_count && left; i++ ) {
+        inverter_t *inv = &inverters[i];
+        if( inv->priority != priority || !is_controllable(inv) ) {
+          continue;
+        }
+        uint32_t r = (delta < 0) ? inv->new_limit : inv->max_limit - min(inv->new_limit, inv->max_limit);
+        uint32_t part = pass ? left : (uint64_t)take * inv->max_limit / weight;
+        part = min(min(part, r), left);
+        inv->new_limit = (delta < 0) ? inv->new_limit - part : inv->new_limit + part;
+        left -= part;
+      }
+    }
+    applied += (delta < 0) ? -(int32_t)(take - left) : (int32_t)(take - left);
   }
+  return applied;
 }
 
 /*
-If feed to the grid is outside of a given range, adjust inverter limit to be as close as possible in the center of that range
+If feed to the grid is outside of a given range, adjust inverter limits to be as close as possible in the center of that range
+All inverter limits are planned and published together in one control cycle
 */
 void check_limit() {
-  const uint16_t max_limit = INVERTER_LIMIT;  // unthrottled WR while backfeed is small enough
-  const uint16_t min_aMinus = BACKFEED_MIN;   // if actual backfeed is lower, inverter gets less limited 
-  const uint16_t max_aMinus = BACKFEED_MAX;   // if actual backfeed is higher, inverter gets more limited
+  const uint16_t min_aMinus = BACKFEED_MIN;   // if actual backfeed is lower, inverters get less limited 
+  const uint16_t max_aMinus = BACKFEED_MAX;   // if actual backfeed is higher, inverters get more limited
   const uint16_t min_check_delay_s = LIMIT_CHECK_INTERVAL_S;  // high enough to make power calc from counter reliable
                                                               // low enough to limit time with too high backfeed
   static uint32_t uptime = 0;
   static uint64_t aMinus = 0;
   
   uint64_t aMinusW = 0;
+  bool check = false;
 
   if( itron.valid == 0x3f ) {
     // we have valid backfeed data
     uint32_t delta_t = itron.uptime - uptime;
-    if( uptime && delta_t > min_check_delay_s ) {
+    if( itron.power_valid & SML_POWER_TOTAL ) {
+      // the meter reports current backfeed: check each new record once earlier commands took effect
+      aMinusW = power_out_w;
+      check = uptime != itron.uptime && !limits_settling();
+      if( check ) {
+        uptime = itron.uptime;
+        aMinus = itron.aMinus;
+      }
+    }
+    else if( uptime && delta_t > min_check_delay_s ) {
       // the last check is more than min_check_delay_s ago
       // calculate average backfeed in W from the ever increasing backfeed counter
       // and the elapsed time since last check
-      aMinusW = (itron.aMinus - aMinus) * 360 / delta_t;
-      /// syslog.logf(LOG_INFO, "Check: Curr A-: %llu W, dt = %u s", aMinusW, delta_t);
-    
-      if( curr_limit != UINT16_MAX && reachable ) {
-        // only try to change the limit if the current limit is known 
-        // and the inverter is reachable
-        if( aMinusW > max_aMinus && curr_limit > 0 ) {
-          // current backfeed is too high and inverter is not yet fully limited
-          // change of inverter limit to backfeed right in the middle of the desired range
-          uint16_t delta = aMinusW - (min_aMinus + max_aMinus)/2;
-          publish_limit(aMinusW, (curr_limit > delta) ? curr_limit - delta : 0);
+      aMinusW = meter_power_w(itron.aMinus, aMinus, delta_t);
+      /// slog(LOG_INFO, "Check: Curr A-: %llu W, dt = %u s", aMinusW, delta_t);
+      check = true;
+      uptime = itron.uptime;
+      aMinus = itron.aMinus;
+    }
+    else if( !uptime ) {
+      uptime = itron.uptime;
+      aMinus = itron.aMinus;
+    }
+
+    if( check ) {
+      int32_t delta = 0;
+      if( aMinusW > max_aMinus ) {
+        // current backfeed is too high: throttle inverters to backfeed right in the middle of the desired range
+        delta = -(int32_t)(aMinusW - (min_aMinus + max_aMinus)/2);
+      }
+      else if( aMinusW < min_aMinus ) {
+        // current backfeed is too low: open inverters to backfeed right in the middle of the desired range
+        delta = (min_aMinus + max_aMinus)/2 - aMinusW;
+      }
+
+      if( delta ) {
+        // only inverters with known limit that are reachable take part
+        for( size_t i = 0; i < inverter_count; i++ ) {
+          inverters[i].new_limit = inverters[i].curr_limit;
         }
-        else if( aMinusW < min_aMinus && curr_limit < max_limit ) {
-          // current backfeed is too low and inverter is not yet fully opened
-          // change of inverter limit to backfeed right in the middle of the desired range
-          uint16_t delta = (min_aMinus + max_aMinus)/2 - aMinusW;
-          publish_limit(aMinusW, (curr_limit + delta < max_limit) ? curr_limit + delta : max_limit);
+        if( share_limit(delta) ) {
+          publish_limits(aMinusW);
         }
         else {
-          /// syslog.logf(LOG_INFO, "Check: current limit %u W not changed for prod %llu W", curr_limit, aMinusW);
+          /// slog(LOG_INFO, "Check: limits not changed for prod %llu W", aMinusW);
         }
       }
-      else {
-        /// syslog.logf(LOG_INFO, "Check: current limit %u W not changed, elapsed since update: %u s", curr_limit, (now - update_ms)/1000);
-      }
-      uptime = itron.uptime;
-      aMinus = itron.aMinus;
     }
   }
 }
 
+// Publish changed Wh values of a bucket retained as HOSTNAME/<name>/[T<tariff>/]Wh_In|Wh_Out
+void publish_energy_bucket( const char *name, const energy_bucket_t *b, energy_bucket_t *last ) {
+  char topic[48];
+  char value[20];
+  uint32_t in = energy_sum(b->in);
+  uint32_t out = energy_sum(b->out);
+  const struct { const char *suffix; uint32_t curr; uint32_t prev; } values[] = {
+    { "Wh_In", (in + 5) / 10, (energy_sum(last->in) + 5) / 10 },
+    { "Wh_Out", (out + 5) / 10, (energy_sum(last->out) + 5) / 10 },
+    { "Peak_W", b->peak_w, last->peak_w } };
+  bool force = b->period != last->period;  // new day or month starts at 0
+  for( size_t i = 0; i < ARRAY_SIZE(values); i++ ) {
+    if( force || values[i].curr != values[i].prev ) {
+      snprintf(topic, sizeof(topic), HOSTNAME "/%s/%s", name, values[i].suffix);
+      snprintf(value, sizeof(value), "%u", values[i].curr);
+      mqtt.publish(topic, value, true);
+    }
+  }
+  for( uint8_t t = 0; tariff_count > 1 && t < tariff_count; t++ ) {
+    if( force || (b->in[t] + 5) / 10 != (last->in[t] + 5) / 10 ) {
+      snprintf(topic, sizeof(topic), HOSTNAME "/%s/T%u/Wh_In", name, t);
+      snprintf(value, sizeof(value), "%u", (b->in[t] + 5) / 10);
+      mqtt.publish(topic, value, true);
+    }
+    if( force || (b->out[t] + 5) / 10 != (last->out[t] + 5) / 10 ) {
+      snprintf(topic, sizeof(topic), HOSTNAME "/%s/T%u/Wh_Out", name, t);
+      snprintf(value, sizeof(value), "%u", (b->out[t] + 5) / 10);
+      mqtt.publish(topic, value, true);
+    }
+  }
+  *last = *b;
+}
+
 // send current power consumption or production to mqtt
 void publish_data() {
   static uint64_t lastAPlusW = 0;
@@ -301,6 +2059,12 @@ void publish_data() {
   uint64_t aPlusW = (itron.aPlus + 5) / 10;
   uint64_t aMinusW = (itron.aMinus + 5) / 10;
 
+  if( aPlusW != lastAPlusW || aMinusW != lastAMinusW ) {
+    char ms[20];
+    snprintf(ms, sizeof(ms), "%llu", recv_time_ms);
+    mqtt.publish(HOSTNAME "/Time_ms", ms);  // arrival of the reading below
+  }
+
   if( aPlusW != lastAPlusW ) {
     char wh[20];
     snprintf(wh, sizeof(wh), "%llu", aPlusW);
@@ -314,261 +2078,1079 @@ void publish_data() {
     mqtt.publish(HOSTNAME "/Wh_Out", wh);
     lastAMinusW = aMinusW;
   }
+
+  static energy_bucket_t last_day = {0};
+  static energy_bucket_t last_month = {0};
+  if( mqtt.connected() && energy.day.period ) {
+    publish_energy_bucket("Day", &energy.day, &last_day);
+    publish_energy_bucket("Month", &energy.month, &last_month);
+  }
 }
 
-// Called on incoming mqtt limit_absolute messages
+// Called on incoming mqtt inverter status messages
 void mqtt_callback(char* topic, byte* payload, unsigned int length) {
-  if (strcmp(topic_reachable, topic) == 0) {
+  static const char prefix[] = DTU_TOPIC "/";
+  inverter_t *inv = 0;
+  const char *suffix = "";
+  if( strncmp(topic, prefix, sizeof(prefix) - 1) == 0 ) {
+    const char *serial = &topic[sizeof(prefix) - 1];
+    for( size_t i = 0; i < inverter_count && !inv; i++ ) {
+      size_t len = strlen(inverters[i].serial);
+      if( strncmp(serial, inverters[i].serial, len) == 0 && serial[len] == '/' ) {
+        inv = &inverters[i];
+        suffix = &serial[len + 1];
+      }
+    }
+  }
+
+  if( !inv ) {
+    slog(LOG_ERR, "Unknown topic '%s'", topic);
+  }
+  else if (strcmp(suffix, "status/reachable") == 0) {
     if( length > 0 ) {
       bool flag = payload[0] != '0';
-      if( flag != reachable ) {
-          syslog.logf(LOG_NOTICE, "Inverter '%s' is %s", inverter, flag ? "reachable" : "unreachable");
-          reachable = flag;
+      if( flag != inv->reachable ) {
+          slog(LOG_NOTICE, "Inverter '%s' is %s", inv->name, flag ? "reachable" : "unreachable");
+          inv->reachable = flag;
       }
     }
   }
-  else if (strcmp(topic_limit, topic) == 0) {
+  else if (strcmp(suffix, "status/limit_absolute") == 0) {
     char *endp;
     char *str = (char *)payload;
     if( length > 0 ) {
       unsigned long limit = strtoul(str, &endp, 10);
       if( endp != str && limit < UINT16_MAX ) {
         limit = ((limit + LIMIT_ROUND_GRANULARITY/2) / LIMIT_ROUND_GRANULARITY) * LIMIT_ROUND_GRANULARITY;
-        if( limit != curr_limit ) {
-          syslog.logf(LOG_NOTICE, "Inverter '%s' limit is %lu W", inverter, limit);
-          curr_limit = limit;
+        if( limit != inv->curr_limit ) {
+          slog(LOG_NOTICE, "Inverter '%s' limit is %lu W", inv->name, limit);
+          inv->curr_limit = limit;
         }
+        ack_limit(inv, limit);
       }
     }
   }
-  else if (strcmp(topic_name, topic) == 0) {
+  else if (strcmp(suffix, "name") == 0) {
     if( length > 0 ) {
-      size_t len = min((size_t)sizeof(inverter)-1, length);
-      if( len != strlen(inverter) || strncmp(inverter, (char *)payload, len)) {
-        strncpy(inverter, (char *)payload, len);
-        inverter[len] = '\0';
-        syslog.logf(LOG_NOTICE, "Inverter name is '%s'", inverter);
+      size_t len = min((size_t)sizeof(inv->name)-1, length);
+      if( len != strlen(inv->name) || strncmp(inv->name, (char *)payload, len)) {
+        strncpy(inv->name, (char *)payload, len);
+        inv->name[len] = '\0';
+        slog(LOG_NOTICE, "Inverter %s name is '%s'", inv->serial, inv->name);
       }
     }
   }
-  else if (strcmp(topic_dynamic, topic) == 0) {
+  else if (strcmp(suffix, "status/limit_dynamic") == 0) {
     bool flag = false;
     if( length > 0 ) {
       flag = payload[0] == '1';
     }
-    if( flag != dynamic ) {
-        syslog.logf(LOG_NOTICE, "Inverter '%s' limit is %s", inverter, flag ? "dynamic" : "static");
-        dynamic = flag;
+    if( flag != inv->dynamic ) {
+        slog(LOG_NOTICE, "Inverter '%s' limit is %s", inv->name, flag ? "dynamic" : "static");
+        inv->dynamic = flag;
+    }
+  }
+  else {
+    slog(LOG_ERR, "Unknown topic '%s'", topic);
+  }
+}
+
+void handle_mqtt() {
+  if (mqtt.connected()) {
+    mqtt.loop();
+    retry_limits();
+  }
+}
+
+// If disconnected try to reconnect, runs every MQTT_RECONNECT_MS
+void connect_mqtt() {
+  if (!mqtt.connected()) {
+    bool ok = mqtt.connect(HOSTNAME, HOSTNAME "/LWT", 0, true, "Offline")
+           && mqtt.publish(HOSTNAME "/LWT", "Online", true)
+           && mqtt.publish(HOSTNAME "/Version", VERSION, true);
+    for( size_t i = 0; i < inverter_count && ok; i++ ) {
+      for( size_t j = 0; j < ARRAY_SIZE(inverter_suffixes) && ok; j++ ) {
+        char topic[80];
+        ok = mqtt.subscribe(inverter_topic(topic, sizeof(topic), &inverters[i], inverter_suffixes[j]));
+      }
+    }
+    if (ok) {
+      slog(LOG_NOTICE, "Connected to MQTT broker %s:%d using topic %s for %u inverters", MQTT_BROKER, MQTT_PORT, HOSTNAME, inverter_count);
+    }
+    else {
+      int error = mqtt.state();
+      mqtt.disconnect();
+      slog(LOG_ERR, "Connect to MQTT broker %s:%d failed with code %d", MQTT_BROKER, MQTT_PORT, error);
+    }
+  }
+}
+#endif
+
+/*
+Modbus TCP meter emulation
+ Energy managers poll the last valid reading like an Eastron SDM630 grid
+ meter: function 3 or 4 (holding or input registers, same map), float32
+ values in two big endian registers, any unit id. Registers without
+ data read as 0. Requests are answered in the network callbacks, so
+ answers take well below a ms and do not wait for loop().
+  0x000c 0x000e 0x0010 phase 1-3 power [W] (if the meter reports them)
+  0x0034 total system power [W], import positive
+  0x0048 total import [kWh]
+  0x004a total export [kWh]
+  0x0156 total import + export [kWh]
+ */
+#define MODBUS_PORT 502
+#ifndef MODBUS_MAX_CLIENTS
+#define MODBUS_MAX_CLIENTS 4
+#endif
+#define MODBUS_IDLE_S 120       // close connections of clients that stopped polling
+#define MODBUS_ADU_SIZE 260     // max modbus tcp frame
+#define MODBUS_REGISTERS 0x0180 // size of the register map
+#define MODBUS_MAX_READ 125     // max registers per request
+
+typedef struct modbus_client {
+  AsyncClient *client;  // 0 if slot is free
+  size_t len;           // bytes of an incomplete request in buf
+  bool closing;         // close requested, ignore further data
+  uint8_t buf[MODBUS_ADU_SIZE];
+} modbus_client_t;
+
+AsyncServer modbus_server(MODBUS_PORT);
+modbus_client_t modbus_clients[MODBUS_MAX_CLIENTS];
+uint32_t modbus_requests = 0;
+uint32_t modbus_errors = 0;   // exception responses
+uint32_t modbus_rejected = 0; // connections above MODBUS_MAX_CLIENTS
+uint32_t modbus_latency_max_us = 0;
+
+float modbus_float( uint16_t reg ) {
+  switch( reg ) {
+    case 0x000c: return last_valid.phase[0];
+    case 0x000e: return last_valid.phase[1];
+    case 0x0010: return last_valid.phase[2];
+    case 0x0034: return (float)power_in_w - (float)power_out_w;
+    case 0x0048: return last_valid.aPlus / 10000.0;
+    case 0x004a: return last_valid.aMinus / 10000.0;
+    case 0x0156: return (last_valid.aPlus + last_valid.aMinus) / 10000.0;
+    default: return 0;
+  }
+}
+
+uint16_t modbus_register( uint16_t reg ) {
+  float value = modbus_float(reg & ~1);
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return (reg & 1) ? (bits & 0xffff) : (bits >> 16);
+}
+
+// Build response for one complete request, returns its size or 0 if there is none
+size_t modbus_reply( const uint8_t *req, size_t len, uint8_t *resp ) {
+  if( req[2] || req[3] ) {
+    return 0;  // protocol id is not modbus
+  }
+  memcpy(resp, req, 7);  // transaction id, protocol id, length (set below) and unit id
+
+  uint8_t function = req[7];
+  uint16_t addr = (req[8] << 8) | req[9];
+  uint16_t count = (req[10] << 8) | req[11];
+  uint8_t exception = 0;
+  if( function != 3 && function != 4 ) {
+    exception = 1;  // illegal function
+  }
+  else if( len != 12 || count < 1 || count > MODBUS_MAX_READ ) {
+    exception = 3;  // illegal data value
+  }
+  else if( addr + count > MODBUS_REGISTERS ) {
+    exception = 2;  // illegal data address
+  }
+
+  size_t pdu;
+  if( exception ) {
+    modbus_errors++;
+    resp[7] = function | 0x80;
+    resp[8] = exception;
+    pdu = 2;
+  }
+  else {
+    resp[7] = function;
+    resp[8] = count * 2;
+    for( uint16_t i = 0; i < count; i++ ) {
+      uint16_t value = modbus_register(addr + i);
+      resp[9 + 2 * i] = value >> 8;
+      resp[10 + 2 * i] = value & 0xff;
+    }
+    pdu = 2 + count * 2;
+  }
+  resp[4] = (pdu + 1) >> 8;  // unit id + pdu
+  resp[5] = (pdu + 1) & 0xff;
+  return 7 + pdu;
+}
+
+// Collect request bytes of a client and answer each complete request
+void modbus_data( modbus_client_t *mc, const uint8_t *data, size_t len ) {
+  uint32_t start = micros();
+  while( len && !mc->closing ) {
+    size_t part = min(len, sizeof(mc->buf) - mc->len);
+    memcpy(&mc->buf[mc->len], data, part);
+    mc->len += part;
+    data += part;
+    len -= part;
+
+    while( mc->len >= 8 ) {
+      size_t adu = 6 + ((mc->buf[4] << 8) | mc->buf[5]);
+      if( adu < 8 || adu > sizeof(mc->buf) ) {
+        // not modbus tcp: close deferred, close(true) could delete the client under this callback
+        mc->closing = true;
+        mc->len = 0;
+        mc->client->close();
+        return;
+      }
+      if( mc->len < adu ) {
+        break;
+      }
+      uint8_t resp[MODBUS_ADU_SIZE];
+      size_t resp_len = modbus_reply(mc->buf, adu, resp);
+      if( resp_len ) {
+        modbus_requests++;
+        mc->client->write((const char *)resp, resp_len);
+      }
+      mc->len -= adu;
+      memmove(mc->buf, &mc->buf[adu], mc->len);
+    }
+  }
+  uint32_t latency = micros() - start;
+  if( latency > modbus_latency_max_us ) {
+    modbus_latency_max_us = latency;
+  }
+}
+
+void setup_modbus() {
+  modbus_server.onClient([](void *arg, AsyncClient *client) {
+    modbus_client_t *mc = 0;
+    for( size_t i = 0; i < MODBUS_MAX_CLIENTS && !mc; i++ ) {
+      if( !modbus_clients[i].client ) {
+        mc = &modbus_clients[i];
+      }
+    }
+    if( !mc ) {
+      modbus_rejected++;
+      client->onDisconnect([](void *arg, AsyncClient *client) { delete client; });
+      client->close(true);
+      return;
+    }
+    mc->client = client;
+    mc->len = 0;
+    mc->closing = false;
+    client->setNoDelay(true);
+    client->setRxTimeout(MODBUS_IDLE_S);
+    client->onData([](void *arg, AsyncClient *client, void *data, size_t len) {
+      modbus_data((modbus_client_t *)arg, (const uint8_t *)data, len);
+    }, mc);
+    client->onDisconnect([](void *arg, AsyncClient *client) {
+      ((modbus_client_t *)arg)->client = 0;
+      delete client;
+    }, mc);
+  }, 0);
+  modbus_server.setNoDelay(true);
+  modbus_server.begin();
+}
+
+/*
+Async response for a raw sml record
+ Sends the frame slot in place while the client is slow and keeps a
+ reference so the capture cannot reuse the slot before the client is done.
+ */
+class FrameResponse : public AsyncAbstractResponse {
+public:
+  FrameResponse( frame_slot_t *slot ) : _slot(frame_ref(slot)), _pos(0) {
+    _code = 200;
+    _contentType = "application/octet-stream";
+    _contentLength = _slot ? _slot->len : 0;
+  }
+
+  ~FrameResponse() {
+    frame_release(_slot);
+  }
+
+  bool _sourceValid() const override {
+    return true;
+  }
+
+  size_t _fillBuffer( uint8_t *buf, size_t maxLen ) override {
+    if( !_slot ) {
+      return 0;
+    }
+    size_t len = min(maxLen, _contentLength - _pos);
+    memcpy(buf, &_slot->data[_pos], len);
+    _pos += len;
+    return len;
+  }
+
+private:
+  frame_slot_t *_slot;
+  size_t _pos;
+};
+
+// Count request against WEB_MAX_CLIENTS, answer 503 if there are too many
+bool web_admit( AsyncWebServerRequest *request ) {
+  if( web_clients >= WEB_MAX_CLIENTS ) {
+    web_rejected++;
+    request->send(503, "text/plain", "Busy");
+    return false;
+  }
+  web_clients++;
+  request->onDisconnect([]() {
+    web_clients--;
+  });
+  return true;
+}
+
+/*
+Pages of the print_* formatters
+ A formatter prints one part of its page per call, a section or one row of
+ a list, advances its cursor and returns false after the last part. The
+ chunked response asks for the next part whenever the connection has
+ drained the previous one, so a client holds only WEB_PART_BYTES however
+ long the page is. Values are read when their part is printed.
+ */
+#ifndef WEB_PART_BYTES
+#define WEB_PART_BYTES 256  // largest part of a page
+#endif
+
+typedef struct web_cursor {
+  uint16_t section;  // part of the page
+  uint16_t row;      // row within a list
+} web_cursor_t;
+
+typedef bool (*web_printer_t)( Print &out, web_cursor_t *cursor );
+
+uint16_t web_part_max = 0;     // largest part printed
+uint32_t web_truncated = 0;    // parts cut at WEB_PART_BYTES
+
+// Next section, returns true for the printer to continue
+bool web_next( web_cursor_t *cursor ) {
+  cursor->section++;
+  cursor->row = 0;
+  return true;
+}
+
+// The part buffer of one response, copied into the chunks as they are sent
+class WebPart : public Print {
+public:
+  WebPart( web_printer_t print ) : _print(print), _len(0), _pos(0), _more(true), _buf() {
+    _cursor.section = 0;
+    _cursor.row = 0;
+  }
+
+  size_t write( uint8_t c ) override {
+    return write(&c, 1);
+  }
+
+  size_t write( const uint8_t *data, size_t len ) override {
+    size_t n = min(len, sizeof(_buf) - _len);
+    memcpy(&_buf[_len], data, n);
+    _len += n;
+    if( n < len ) {
+      web_truncated++;
+    }
+    return n;
+  }
+
+  // Fill buf with the next bytes of the page, 0 after the end
+  size_t fill( uint8_t *buf, size_t maxLen ) {
+    size_t done = 0;
+    while( done < maxLen ) {
+      if( _pos == _len ) {
+        if( !_more ) {
+          break;
+        }
+        _len = 0;
+        _pos = 0;
+        _more = _print(*this, &_cursor);
+        web_part_max = max(web_part_max, _len);
+        continue;
+      }
+      size_t n = min(maxLen - done, (size_t)(_len - _pos));
+      memcpy(&buf[done], &_buf[_pos], n);
+      _pos += n;
+      done += n;
+    }
+    return done;
+  }
+
+  using Print::write;
+
+private:
+  web_printer_t _print;
+  web_cursor_t _cursor;
+  uint16_t _len;
+  uint16_t _pos;
+  bool _more;
+  uint8_t _buf[WEB_PART_BYTES];
+};
+
+// Send the page of a formatter as chunked response
+void web_send( AsyncWebServerRequest *request, int code, const char *type, web_printer_t print ) {
+  if( web_admit(request) ) {
+    WebPart part(print);
+    AsyncWebServerResponse *response = request->beginChunkedResponse(type,
+      [part](uint8_t *buf, size_t maxLen, size_t index) mutable -> size_t {
+        return part.fill(buf, maxLen);
+      });
+    response->setCode(code);
+    request->send(response);
+  }
+}
+
+void print_time( Print &out, time_t t ) {
+  char str[30];
+  strftime(str, sizeof(str), "%FT%T%Z", localtime(&t));
+  out.print(str);
+}
+
+void print_time_ms( Print &out, uint64_t ms ) {
+  char str[30];
+  time_t t = ms / 1000;
+  size_t len = strftime(str, sizeof(str), "%FT%T", localtime(&t));
+  len += snprintf(&str[len], sizeof(str) - len, ".%03u", (unsigned)(ms % 1000));
+  strftime(&str[len], sizeof(str) - len, "%Z", localtime(&t));
+  out.print(str);
+}
+
+// Energy totals of one day or month in Wh in three parts, tariffs only if there are windows
+void print_energy_bucket( Print &out, const char *name, const energy_bucket_t *b, uint8_t part, const char *end ) {
+  if( part == 0 ) {
+    if( b->period > 999999 ) {
+      out.printf("  \"%s\": {\n   \"period\": \"%04u-%02u-%02u\",\n", name, b->period / 10000, b->period / 100 % 100, b->period % 100);
+    }
+    else {
+      out.printf("  \"%s\": {\n   \"period\": \"%04u-%02u\",\n", name, b->period / 100, b->period % 100);
+    }
+    out.printf("   \"in\": %.1f,\n", energy_sum(b->in) / 10.0);
+    out.printf("   \"out\": %.1f,\n", energy_sum(b->out) / 10.0);
+  }
+  else if( part == 1 ) {
+    if( tariff_count > 1 ) {
+      out.print(F("   \"tariffs\": ["));
+      for( uint8_t i = 0; i < tariff_count; i++ ) {
+        out.printf("%s{ \"in\": %.1f,", i ? ", " : "", b->in[i] / 10.0);
+        out.printf(" \"out\": %.1f }", b->out[i] / 10.0);
+      }
+      out.print(F("],\n"));
     }
   }
   else {
-    syslog.logf(LOG_ERR, "Unknown topic '%s'", topic);
+    out.printf("   \"peak_w\": %u,\n   \"peak_time\": \"", b->peak_w);
+    print_time(out, b->peak_time);
+    out.print(F("\"\n  }"));
+    out.print(end);
+  }
+}
+
+bool print_json( Print &out, web_cursor_t *cursor ) {
+  switch( cursor->section ) {
+  case 0:
+    out.print(F("{\n"
+                " \"meta\": {\n"
+                "  \"device\": \"" HOSTNAME "\",\n"
+                "  \"program\": \"" PROGNAME "\",\n"
+                "  \"version\": \"" VERSION "\",\n"
+                "  \"started\": \""));
+    out.print(start_time);
+    out.print(F("\",\n"));
+    return web_next(cursor);
+  case 1:
+    out.print(F("  \"posted\": \""));
+    print_time(out, post_time);
+    out.print(F("\",\n  \"received\": \""));
+    print_time_ms(out, recv_time_ms);
+    out.printf("\",\n  \"received_ms\": %llu\n },\n", recv_time_ms);
+    return web_next(cursor);
+  case 2:
+    out.printf(" \"clock\": {\n  \"offset_ms\": %lld,\n", clock_offset_ms);
+    out.printf("  \"base_ms\": %lld,\n", clock_base_ms);
+    out.printf("  \"jitter_ms\": %u,\n", clock_jitter_ms);
+    out.printf("  \"jitter_max_ms\": %u,\n", clock_jitter_max_ms);
+    out.printf("  \"samples\": %u,\n", clock_sample_count);
+    out.printf("  \"drift_ppm\": %.1f,\n", (clock_ms_per_s / 1000 - 1) * 1e6);
+    out.printf("  \"esp_drift_ppm\": %.1f,\n", (clock_esp_ms_per_ms - 1) * 1e6);
+    return web_next(cursor);
+  case 3:
+    out.printf("  \"residual_ms\": %d,\n", clock_residual_ms);
+    out.printf("  \"residual_rms_ms\": %.1f,\n", clock_residual_rms_ms);
+    out.printf("  \"residual_max_ms\": %u,\n", clock_residual_max_ms);
+    out.printf("  \"duplicates\": %u,\n", clock_duplicates);
+    out.printf("  \"skipped\": %u,\n", clock_skipped);
+    out.printf("  \"slips\": %u,\n", clock_slips);
+    out.printf("  \"resets\": %u\n },\n", clock_resets);
+    return web_next(cursor);
+  case 4: {
+    char reading[WEB_PART_BYTES];
+    itron_json(reading, sizeof(reading), &itron, recv_detailed);
+    out.print(reading);
+    return web_next(cursor);
+  }
+  case 5:
+    out.printf(" \"power\": {\n  \"in\": %u,\n  \"out\": %u,\n", power_in_w, power_out_w);
+    if( itron.power_valid & (SML_POWER_L1 * 7) ) {
+      out.printf("  \"phases\": [%d, %d, %d],\n", itron.phase[0], itron.phase[1], itron.phase[2]);
+    }
+    out.printf("  \"source\": \"%s\"\n },\n", (itron.power_valid & SML_POWER_TOTAL) ? "meter" : "counter");
+    out.print(F(" \"totals\": {\n"));
+    return web_next(cursor);
+  case 6: {
+    // rows: three parts of each bucket
+    const struct { const char *name; const energy_bucket_t *bucket; } buckets[] = {
+      { "day", &energy.day }, { "prev_day", &energy.prev_day }, { "month", &energy.month }, { "prev_month", &energy.prev_month } };
+    if( cursor->row < 3 * ARRAY_SIZE(buckets) ) {
+      print_energy_bucket(out, buckets[cursor->row / 3].name, buckets[cursor->row / 3].bucket, cursor->row % 3, ",\n");
+      cursor->row++;
+      return true;
+    }
+    out.printf("  \"unattributed\": {\n   \"in\": %.1f,\n", energy.gap_in / 10.0);
+    out.printf("   \"out\": %.1f,\n   \"gaps\": %u,\n   \"last\": \"", energy.gap_out / 10.0, energy.gaps);
+    print_time(out, energy.gap_time);
+    out.print(F("\"\n  }\n },\n"));
+    return web_next(cursor);
+  }
+  case 7:
+    out.printf(" \"status\": {\n  \"influx\": {\n   \"status\": %d,\n", influx_status);
+    out.printf("   \"posts\": %u,\n", influx_posts);
+    out.printf("   \"errors\": %u,\n", influx_errors);
+    out.printf("   \"connects\": %u\n  },\n", influx_connects);
+    return web_next(cursor);
+  case 8:
+    out.printf("  \"spool\": {\n   \"records\": %u,\n", spool_records);
+    out.printf("   \"segments\": %u,\n", spool_last + 1 - spool_first);
+    out.printf("   \"progress\": %u,\n", spool_run ? spool_run * 100 / (spool_run + spool_records) : 0);
+    out.printf("   \"replayed\": %u,\n", spool_replayed);
+    out.printf("   \"dropped\": %u\n  },\n", spool_dropped);
+    return web_next(cursor);
+  case 9: {
+    size_t modbus_active = 0;
+    for( size_t i = 0; i < MODBUS_MAX_CLIENTS; i++ ) {
+      modbus_active += modbus_clients[i].client ? 1 : 0;
+    }
+    out.printf("  \"modbus\": {\n   \"clients\": %u,\n", modbus_active);
+    out.printf("   \"requests\": %u,\n", modbus_requests);
+    out.printf("   \"errors\": %u,\n", modbus_errors);
+    out.printf("   \"rejected\": %u,\n", modbus_rejected);
+    out.printf("   \"latency_max_us\": %u\n  },\n", modbus_latency_max_us);
+    return web_next(cursor);
+  }
+  case 10:
+    out.printf("  \"web\": {\n   \"clients\": %u,\n", web_clients);
+    out.printf("   \"rejected\": %u,\n", web_rejected);
+    out.printf("   \"part_max\": %u,\n", web_part_max);
+    out.printf("   \"truncated\": %u\n  },\n", web_truncated);
+    return web_next(cursor);
+  case 11:
+    out.printf("  \"restart\": {\n   \"planned\": %s,\n", state_restored ? "true" : "false");
+    out.printf("   \"gap_ms\": %lld\n  },\n", restart_gap_ms);
+    return web_next(cursor);
+  case 12:
+    out.printf("  \"heap\": {\n   \"free\": %u,\n", ESP.getFreeHeap());
+    out.printf("   \"max_block\": %u,\n", ESP.getMaxFreeBlockSize());
+    out.printf("   \"fragmentation\": %u\n  },\n", ESP.getHeapFragmentation());
+    out.printf("  \"log\": {\n   \"dropped\": %u,\n", log_dropped);
+    out.printf("   \"limited\": %u\n  },\n", log_limited);
+    out.printf("  \"tasks\": {\n   \"idle_ms\": %llu", sched_idle_ms);
+    return web_next(cursor);
+  case 13:
+    if( cursor->row < TASK_COUNT ) {
+      const task_t *t = &tasks[cursor->row++];
+      out.printf(",\n   \"%s\": { \"runs\": %u, \"misses\": %u,", t->name, t->runs, t->misses);
+      out.printf(" \"overruns\": %u, \"max_us\": %u,", t->overruns, t->max_us);
+      out.printf(" \"avg_us\": %u }", t->runs ? (uint32_t)(t->total_us / t->runs) : 0);
+      return true;
+    }
+    out.print(F("\n  },\n"));
+    return web_next(cursor);
+  case 14:
+    out.printf("  \"power\": {\n   \"mode\": %u,\n", POWER_MODE);
+    out.printf("   \"cpu_mhz\": %u,\n", ESP.getCpuFreqMHz());
+    out.printf("   \"light_sleep_ms\": %llu,\n", power_light_ms);
+    out.printf("   \"wakeups\": %u,\n", power_wakeups);
+    out.printf("   \"frames\": %u,\n", power_frames);
+    out.printf("   \"wakeups_per_frame\": %.1f,\n", power_frames ? (double)power_wakeups / power_frames : 0.0);
+    out.printf("   \"current_ma\": %.1f\n  }", power_current_ma(sched_idle_ms));
+    return web_next(cursor);
+  #ifdef DTU_TOPIC
+  case 15:
+    if( !cursor->row ) {
+      out.print(F(",\n  \"inverters\": {"));
+    }
+    if( cursor->row < inverter_count ) {
+      const inverter_t *inv = &inverters[cursor->row];
+      out.printf("%s\n   \"%s\": {\n    \"name\": \"", cursor->row++ ? "," : "", inv->serial);
+      out.print(inv->name);
+      out.printf("\",\n    \"max_limit\": %u,\n", inv->max_limit);
+      out.printf("    \"priority\": %u,\n", inv->priority);
+      out.printf("    \"limit\": %u,\n", inv->curr_limit);
+      out.printf("    \"dynamic\": %s,\n", inv->dynamic ? "true" : "false");
+      out.printf("    \"reachable\": %s\n   }", inv->reachable ? "true" : "false");
+      return true;
+    }
+    out.print(F("\n  },\n  \"control\": {\n"));
+    out.printf("   \"commands\": %u,\n", cmd_count);
+    out.printf("   \"retries\": %u,\n", cmd_retries);
+    out.printf("   \"failed\": %u,\n", cmd_failed);
+    out.printf("   \"no_effect\": %u", cmd_no_effect);
+    return web_next(cursor);
+  case 16: {
+    const struct { const char *name; const latency_t *latency; } latencies[] = {
+      { "publish", &latency_publish }, { "ack", &latency_ack }, { "effect", &latency_effect }, { "total", &latency_total } };
+    for( size_t i = 0; i < ARRAY_SIZE(latencies); i++ ) {
+      const latency_t *l = latencies[i].latency;
+      out.printf(",\n   \"%s_ms\": { \"p50\": %u,", latencies[i].name, latency_percentile(l, 50));
+      out.printf(" \"p90\": %u, \"p99\": %u }", latency_percentile(l, 90), latency_percentile(l, 99));
+    }
+    out.print(F("\n  }"));
+    return web_next(cursor);
+  }
+  #endif
+  #ifdef WLED_LEDS
+  case 17: {
+    uint32_t now_ms = millis();
+    if( (wled_r || wled_g || wled_b) && (now_ms - wled_update) >= (wled_secs * 1000) ) {
+      wled_change += wled_secs * 1000;
+      wled_r = 0;
+      wled_g = 0;
+      wled_b = 0;
+    }
+    out.printf(",\n  \"wled\": {\n   \"color\": \"%06x\",\n", (wled_r << 16) + (wled_g << 8) + wled_b);
+    out.printf("   \"since\": %u,\n", (now_ms - wled_change) / 1000);
+    out.printf("   \"level\": %u,\n", wled_level);
+    out.printf("   \"packets\": %u\n  }", wled_packets);
+    return web_next(cursor);
+  }
+  #endif
+  case 18:
+    out.print(F("\n }\n}\n"));
+    return false;
+  default:
+    return web_next(cursor);  // section not in this build
   }
 }
 
-void handle_mqtt() {
-  static const int32_t interval = 5000;  // if disconnected try reconnect this often in ms
-  static uint32_t prev = -interval;      // first connect attempt without delay
-  static char msg[128];
-
-  if (mqtt.connected()) {
-    mqtt.loop();
+/*
+All entries of the last record of any SML meter
+ Numbers with unit code, unit symbol, scaler, raw and scaled value,
+ octet strings as hex (at most SML_OBIS_OCTETS bytes) with their length.
+ */
+bool print_obis( Print &out, web_cursor_t *cursor ) {
+  if( cursor->section == 0 ) {
+    out.print(F("{\n \"received\": \""));
+    print_time_ms(out, obis_time_ms);
+    out.printf("\",\n \"count\": %u,\n", obis_table.count);
+    out.printf(" \"dropped\": %u,\n \"entries\": [", obis_table.dropped);
+    return web_next(cursor);
   }
-  else {
-    uint32_t now = millis();
-    if (now - prev > interval) {
-      prev = now;
-
-      if (mqtt.connect(HOSTNAME, HOSTNAME "/LWT", 0, true, "Offline")
-      && mqtt.publish(HOSTNAME "/LWT", "Online", true)
-      && mqtt.publish(HOSTNAME "/Version", VERSION, true)
-      && mqtt.subscribe(topic_reachable)
-      && mqtt.subscribe(topic_limit)
-      && mqtt.subscribe(topic_dynamic)
-      && mqtt.subscribe(topic_name)) {
-        snprintf(msg, sizeof(msg), "Connected to MQTT broker %s:%d using topic %s", MQTT_BROKER, MQTT_PORT, HOSTNAME);
-        syslog.log(LOG_NOTICE, msg);
+  if( cursor->row < obis_table.count ) {
+    const sml_obis_entry_t *entry = &obis_table.entry[cursor->row];
+    char obis[24];
+    double value;
+    out.printf("%s\n  { \"obis\": \"%s\", ", cursor->row++ ? "," : "", sml_obis_str(obis, sizeof(obis), entry->obis));
+    if( sml_obis_value(entry, &value) ) {
+      out.printf("\"unit\": %u, \"symbol\": \"%s\", ", entry->unit, sml_unit_name(entry->unit));
+      out.printf("\"scaler\": %d, ", entry->scaler);
+      if( entry->type == 5 ) {
+        out.printf("\"raw\": %lld, ", entry->value.i);
       }
       else {
-        int error = mqtt.state();
-        mqtt.disconnect();
-        snprintf(msg, sizeof(msg), "Connect to MQTT broker %s:%d failed with code %d", MQTT_BROKER, MQTT_PORT, error);
-        syslog.log(LOG_ERR, msg);
+        out.printf("\"raw\": %llu, ", entry->value.u);
       }
+      out.printf("\"value\": %.*f }", entry->scaler < 0 ? -entry->scaler : 0, value);
+    }
+    else {
+      out.print(F("\"octets\": \""));
+      print_hex(out, entry->value.octets, min((size_t)entry->len, sizeof(entry->value.octets)), '-');
+      out.printf("\", \"len\": %u }", entry->len);
     }
+    return true;
+  }
+  out.print(F("\n ]\n}\n"));
+  return false;
+}
+
+/*
+Send readings newer than since as binary
+ uint32 count, then count records of uint32 time [s], uint16 in [W], uint16 out [W]
+ all little endian as in memory. Records are copied from the ring while sending.
+ */
+void send_readings( AsyncWebServerRequest *request, readings_t *readings, uint32_t since ) {
+  uint32_t first = (readings->count > readings->size) ? readings->count - readings->size : 0;
+  while( first < readings->count && readings->entry[first % readings->size].time <= since ) {
+    first++;
   }
+  uint32_t count = readings->count - first;
+  size_t len = sizeof(count) + count * sizeof(reading_t);
+
+  request->send(request->beginResponse("application/octet-stream", len,
+    [readings, first, count](uint8_t *buf, size_t maxLen, size_t index) -> size_t {
+      size_t done = 0;
+      while( done < maxLen && index < sizeof(count) + count * sizeof(reading_t) ) {
+        const uint8_t *src;
+        size_t pos;
+        size_t part;
+        if( index < sizeof(count) ) {
+          src = (const uint8_t *)&count;
+          pos = index;
+          part = sizeof(count) - pos;
+        }
+        else {
+          size_t rec = (index - sizeof(count)) / sizeof(reading_t);
+          src = (const uint8_t *)&readings->entry[(first + rec) % readings->size];
+          pos = (index - sizeof(count)) % sizeof(reading_t);
+          part = sizeof(reading_t) - pos;
+        }
+        part = min(part, maxLen - done);
+        memcpy(&buf[done], &src[pos], part);
+        done += part;
+        index += part;
+      }
+      return done;
+    }));
 }
+
+#ifdef SML_INJECT
+/*
+SML injection for load tests (debug builds only)
+ POST a capture (from /sml?n=) to /inject?rate=<frames/s>&repeat=<passes>.
+ The inject task hands its records one by one to frame_decode() like the
+ IR head does, rate 0 as fast as the scheduler allows. Latency runs from
+ the due time of a frame (the task start for rate 0) to the end of its
+ decoding. GET /inject shows frames/s, latency percentiles and the deadline
+ misses of all tasks since the start. Injected records count in clock
+ statistics, energy totals, InfluxDB and MQTT like real ones.
+ */
+#ifndef SML_INJECT_BYTES
+#define SML_INJECT_BYTES 4096  // largest capture accepted
 #endif
 
-const char *main_page() {
-  // Standard page
-  static const char fmt[] =
-      "<!doctype html>\n"
-      "<html lang=\"en\">\n"
-      " <head>\n"
-      "  <title>" PROGNAME " v" VERSION "</title>\n"
-      "  <meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n"
-      "  <meta charset=\"utf-8\">\n"
-      "  <meta http-equiv=\"expires\" content=\"5\">\n"
-      " </head>\n"
-      " <body>\n"
-      "  <h1>" PROGNAME " v" VERSION "</h1>\n"
-      "  <table><tr>\n"
-      "   <td><form action=\"monitor\">\n"
-      "    <input type=\"submit\" name=\"monitor\" value=\"Monitor\" />\n"
-      "   </form></td>\n"
-      "   <td><form action=\"json\">\n"
-      "    <input type=\"submit\" name=\"json\" value=\"JSON\" />\n"
-      "   </form></td>\n"
-      "   <td><form action=\"sml\">\n"
-      "    <input type=\"submit\" name=\"sml\" value=\"SML\" />\n"
-      "   </form></td>\n"
-      "   <td><form action=\"reset\" method=\"post\">\n"
-      "    <input type=\"submit\" name=\"reset\" value=\"Reset\" />\n"
-      "   </form></td>\n"
-      "  </tr></table>\n"
-      "  <div>Post firmware image to /update<div>\n"
-      "  <div>Influx status: %d<div>\n"
-      "  <div>Detailed info: %s<div>\n"
-      #ifdef DTU_TOPIC
-        "  <div>Inverter '%s' limit: %s %u W<div>\n"
-      #endif
-      #ifdef WLED_LEDS
-        "  <div>WLED status: %06x since %u seconds<div>\n"
-      #endif
-      "  <div>Last update: %s<div>\n"
-      " </body>\n"
-      "</html>\n";
-  static char page[sizeof(fmt) + 150] = "";
-  static char curr_time[30];
-  time_t now;
-  time(&now);
-  strftime(curr_time, sizeof(curr_time), "%FT%T%Z", localtime(&now));
-  #ifdef WLED_LEDS
-  uint32_t now_ms = millis();
-  if( (wled_r || wled_g || wled_b) && (now_ms - wled_update) >= (wled_secs * 1000) ) {
-    wled_change += wled_secs * 1000;
-    wled_r = 0;
-    wled_g = 0;
-    wled_b = 0;
+uint8_t inject_buf[SML_INJECT_BYTES];
+size_t inject_size = 0;      // bytes of a posted capture not yet started
+size_t inject_len = 0;       // bytes of the injected capture, 0: not running
+size_t inject_pos = 0;       // next record in the capture
+uint32_t inject_rate = 0;    // frames/s, 0: as fast as possible
+uint32_t inject_repeat = 1;  // passes over the capture
+uint32_t inject_pass = 0;
+uint32_t inject_frames = 0;  // frames decoded
+uint32_t inject_dropped = 0; // frames without free slot
+uint64_t inject_start_us = 0;
+uint64_t inject_last_us = 0; // end of the last decoding
+uint32_t inject_latency_max_us = 0;
+latency_t inject_latency = { {0}, 0 };  // [us]
+uint32_t inject_misses[TASK_COUNT];     // deadline misses of the tasks at the start
+
+bool print_inject( Print &out, web_cursor_t *cursor ) {
+  if( cursor->section == 0 ) {
+    uint64_t us = inject_last_us - inject_start_us;
+    out.printf("{\n \"running\": %s,\n", inject_len ? "true" : "false");
+    out.printf(" \"rate\": %u,\n", inject_rate);
+    out.printf(" \"pass\": %u,\n \"repeat\": %u,\n", inject_pass, inject_repeat);
+    out.printf(" \"frames\": %u,\n \"dropped\": %u,\n", inject_frames, inject_dropped);
+    out.printf(" \"frames_per_s\": %.1f,\n", us ? inject_frames * 1e6 / us : 0.0);
+    out.printf(" \"latency_us\": { \"p50\": %u,", latency_percentile(&inject_latency, 50));
+    out.printf(" \"p99\": %u, \"max\": %u },\n", latency_percentile(&inject_latency, 99), inject_latency_max_us);
+    out.printf(" \"heap_free\": %u,\n \"misses\": {", ESP.getFreeHeap());
+    return web_next(cursor);
   }
-  #endif
-  snprintf(page, sizeof(page), fmt, influx_status, recv_detailed ? "yes" : "no",
-  #ifdef DTU_TOPIC
-           inverter,
-           dynamic ? "dynamic" : "static",
-           curr_limit,
-  #endif
-  #ifdef WLED_LEDS
-           (wled_r << 16) + (wled_g << 8) + wled_b,
-           (now_ms - wled_change) / 1000,
-  #endif
-           curr_time);
-  return page;
+  if( cursor->row < TASK_COUNT ) {
+    size_t i = cursor->row++;
+    out.printf("%s\n  \"%s\": %u", i ? "," : "", tasks[i].name, tasks[i].misses - inject_misses[i]);
+    return true;
+  }
+  out.print(F("\n }\n}\n"));
+  return false;
+}
+
+// Collect the posted capture, a new post stops a running injection
+void inject_body( AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total ) {
+  if( index == 0 ) {
+    inject_len = 0;
+    inject_size = total;
+  }
+  if( total <= sizeof(inject_buf) ) {
+    memcpy(&inject_buf[index], data, len);
+  }
+}
+
+void inject_start( AsyncWebServerRequest *request ) {
+  size_t size = inject_size;
+  inject_size = 0;
+  if( size < sizeof(CAPTURE_MAGIC) || size > sizeof(inject_buf) || memcmp(inject_buf, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) ) {
+    request->send(400, "text/plain", "Post a capture from /sml?n= (at most SML_INJECT_BYTES)\n");
+    return;
+  }
+  inject_rate = request->hasParam("rate") ? strtoul(request->getParam("rate")->value().c_str(), 0, 10) : 0;
+  inject_repeat = request->hasParam("repeat") ? max(1UL, strtoul(request->getParam("repeat")->value().c_str(), 0, 10)) : 1;
+  inject_pass = 0;
+  inject_pos = sizeof(CAPTURE_MAGIC);
+  inject_frames = 0;
+  inject_dropped = 0;
+  inject_latency.count = 0;
+  inject_latency_max_us = 0;
+  inject_start_us = micros64();
+  inject_last_us = inject_start_us;
+  for( size_t i = 0; i < TASK_COUNT; i++ ) {
+    inject_misses[i] = tasks[i].misses;
+  }
+  inject_len = size;
+  task_wake(TASK_INJECT);
+  slog(LOG_NOTICE, "Inject %u bytes at %u frames/s, %u passes", size, inject_rate, inject_repeat);
+  web_send(request, 200, "application/json", print_inject);
 }
+#endif
 
 // Define web pages for update, reset or for event infos
 void setup_webserver() {
-  web_server.on("/json", []() {
-    static const char fmt[] = "{\n"
-                              " \"meta\": {\n"
-                              "  \"device\": \"" HOSTNAME "\",\n"
-                              "  \"program\": \"" PROGNAME "\",\n"
-                              "  \"version\": \"" VERSION "\",\n"
-                              "  \"started\": \"%s\",\n"
-                              "  \"posted\": \"%s\",\n"
-                              "  \"received\": \"%s\"\n"
-                              " },\n"
-                              " \"energy\": {\n"
-                              "  \"id\": \"%3.3s\",\n"
-                              "  \"serial\": \"%s\",\n"
-                              "  \"detailed\": \"%s\",\n"
-                              "  \"uptime\": %u,\n"
-                              "  \"aplus\": %.1f,\n"
-                              "  \"aminus\": %.1f\n"
-                              " }\n"
-                              "}\n";
-    static char msg[sizeof(fmt) + 3 * 22 + 30 + 4 * 10];
-    static char inf_time[30];
-    static char rec_time[30];
-    strftime(inf_time, sizeof(inf_time), "%FT%T%Z", localtime(&post_time));
-    strftime(rec_time, sizeof(rec_time), "%FT%T%Z", localtime(&recv_time));
-    char *serial = to_hex(itron.serial, sizeof(itron.serial), '-');
-    snprintf(msg, sizeof(msg), fmt, start_time, inf_time, rec_time,
-             itron.id, serial, recv_detailed ? "yes" : "no", itron.uptime, itron.aPlus/10.0, itron.aMinus/10.0);
-    web_server.send(200, "application/json", msg);
+  web_server.on("/json", HTTP_GET, [](AsyncWebServerRequest *request) {
+    web_send(request, 200, "application/json", print_json);
+  });
+
+  // download last raw SML record or with n=<records> captured records in capture format
+  web_server.on("/sml", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if( web_admit(request) ) {
+      #ifdef SML_CAPTURE
+      if( request->hasParam("n") ) {
+        request->send(new CaptureResponse(strtoul(request->getParam("n")->value().c_str(), 0, 10)));
+        return;
+      }
+      #endif
+      if( frame_last ) {
+        request->send(new FrameResponse(frame_last));
+      }
+      else {
+        request->send(204);  // no record yet
+      }
+    }
   });
 
-  // download last raw SML record
-  web_server.on("/sml", []() {
-    web_server.send(200, "application/octet-stream", sml_raw, sml_len);
+  #ifdef SML_INJECT
+  web_server.on("/inject", HTTP_GET, [](AsyncWebServerRequest *request) {
+    web_send(request, 200, "application/json", print_inject);
+  });
+
+  // Decode a posted capture like records from the IR head
+  web_server.on("/inject", HTTP_POST, inject_start, nullptr, inject_body);
+  #endif
+
+  // Decoded entries of the last record, for meters other than the Itron 3.HZ too
+  web_server.on("/obis", HTTP_GET, [](AsyncWebServerRequest *request) {
+    web_send(request, 200, "application/json", print_obis);
   });
 
   // Call this page to reset the ESP
-  web_server.on("/reset", HTTP_POST, []() {
-    syslog.log(LOG_NOTICE, "RESET");
-    web_server.send(200, "text/html",
-                    "<html>\n"
-                    " <head>\n"
-                    "  <title>" PROGNAME " v" VERSION "</title>\n"
-                    "  <meta http-equiv=\"refresh\" content=\"7; url=/\"> \n"
-                    " </head>\n"
-                    " <body>Resetting...</body>\n"
-                    "</html>\n");
-    delay(200);
-    ESP.restart();
+  web_server.on("/reset", HTTP_POST, [](AsyncWebServerRequest *request) {
+    slog(LOG_NOTICE, "RESET");
+    request->send(200, "text/html",
+                  "<html>\n"
+                  " <head>\n"
+                  "  <title>" PROGNAME " v" VERSION "</title>\n"
+                  "  <meta http-equiv=\"refresh\" content=\"7; url=/\"> \n"
+                  " </head>\n"
+                  " <body>Resetting...</body>\n"
+                  "</html>\n");
+    restart_ms = millis();  // restart from loop() after the response is out
+  });
+
+  // Firmware update form, post firmware image here
+  web_server.on("/update", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "text/html",
+                  "<html><body><form method=\"POST\" action=\"/update\" enctype=\"multipart/form-data\">\n"
+                  " <input type=\"file\" accept=\".bin\" name=\"image\">\n"
+                  " <input type=\"submit\" value=\"Update\">\n"
+                  "</form></body></html>\n");
   });
 
-  // Call this page to monitor power closely
-  web_server.on("/monitor", []() {
-    static const char fmt[] = 
-      "<!doctype html>\n"
-      "<html lang=\"en\">\n"
-      " <head>\n"
-      "  <title>" PROGNAME " v" VERSION "</title>\n"
-      "  <meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n"
-      "  <meta charset=\"utf-8\">\n"
-      "  <meta http-equiv=\"refresh\" content=\"2; url=/monitor\"> \n"
-      " </head>\n"
-      " <body><h1> " HOSTNAME " Monitor v" VERSION "</h1><table>\n"
-      "  <tr><th align=\"right\">Power</th><th align=\"right\">Wh</th><th align=\"right\">W</th></tr>\n"
-      "  <tr><th align=\"right\">A+</th><td align=\"right\">%.1f</td><td align=\"right\">%.1f</td></tr>\n"
-      "  <tr><th align=\"right\">A-</th><td align=\"right\">%.1f</td><td align=\"right\">%.1f</td></tr>\n"
-      " </table></body>\n"
-      "</html>\n";
-    static char msg[sizeof(fmt) + 4 * 20];
-    static uint32_t uptime = 0;
-    static uint64_t aPlus = 0;
-    static uint64_t aMinus = 0;
-    static uint64_t aPlusW = 0;   // now 1/10W
-    static uint64_t aMinusW = 0;  // now 1/10W
-    if( uptime != itron.uptime && (itron.aPlus != aPlus || itron.aMinus != aMinus) ) {
-      if( uptime ) {
-        aPlusW = (itron.aPlus - aPlus) * 3600 / (itron.uptime - uptime);
-        aMinusW = (itron.aMinus - aMinus) * 3600 / (itron.uptime - uptime);
+  // Firmware update, flashes each uploaded chunk as it arrives
+  web_server.on("/update", HTTP_POST, [](AsyncWebServerRequest *request) {
+    bool ok = !Update.hasError();
+    AsyncWebServerResponse *response = request->beginResponse(ok ? 200 : 500, "text/plain", ok ? "Update Success! Rebooting...\n" : "Update failed\n");
+    response->addHeader("Connection", "close");
+    request->send(response);
+    if( ok ) {
+      restart_ms = millis();
+    }
+  }, [](AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len, bool final) {
+    if( index == 0 ) {
+      slog(LOG_NOTICE, "Update with '%s' started", filename.c_str());
+      Update.runAsync(true);
+      if( !Update.begin((ESP.getFreeSketchSpace() - 0x1000) & 0xfffff000) ) {
+        slog(LOG_ERR, "Update begin failed with error %u", Update.getError());
       }
-      uptime = itron.uptime;
-      aPlus = itron.aPlus;
-      aMinus= itron.aMinus;
     }
-    snprintf(msg, sizeof(msg), fmt, itron.aPlus/10.0, aPlusW/10.0, itron.aMinus/10.0, aMinusW/10.0);
-    web_server.send(200, "text/html", msg);
+    if( !Update.hasError() && Update.write(data, len) != len ) {
+      slog(LOG_ERR, "Update write at %u failed with error %u", index, Update.getError());
+    }
+    if( final ) {
+      if( Update.end(true) ) {
+        slog(LOG_NOTICE, "Update with %u bytes finished", index + len);
+      }
+      else {
+        slog(LOG_ERR, "Update end failed with error %u", Update.getError());
+      }
+    }
+  });
+
+  // Readings for the dashboard charts: set=live|history, since=unix time
+  web_server.on("/readings", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if( web_admit(request) ) {
+      bool history = request->hasParam("set") && request->getParam("set")->value() == "history";
+      uint32_t since = request->hasParam("since") ? strtoul(request->getParam("since")->value().c_str(), 0, 10) : 0;
+      send_readings(request, history ? &history_readings : &live_readings, since);
+    }
+  });
+
+  // Monitor is part of the dashboard now
+  web_server.on("/monitor", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->redirect("/");
   });
 
-  // Index page
-  web_server.on("/", []() {
-    web_server.send(200, "text/html", main_page());
+  // Dashboard, precompressed in flash and cached by the browser
+  web_server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if( request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == DASHBOARD_ETAG ) {
+      request->send(304);
+      return;
+    }
+    if( web_admit(request) ) {
+      AsyncWebServerResponse *response = request->beginResponse_P(200, "text/html", dashboard_gz, sizeof(dashboard_gz));
+      response->addHeader("Content-Encoding", "gzip");
+      response->addHeader("Cache-Control", "public, max-age=86400");
+      response->addHeader("ETag", DASHBOARD_ETAG);
+      request->send(response);
+    }
   });
 
   // Catch all page
-  web_server.onNotFound([]() {
-    web_server.send(404, "text/html", main_page());
+  web_server.onNotFound([](AsyncWebServerRequest *request) {
+    request->send(404, "text/plain", "Not found\n");
   });
 
   web_server.begin();
 
   MDNS.addService("http", "tcp", WEBSERVER_PORT);
-  syslog.logf(LOG_NOTICE, "Serving HTTP on port %d", WEBSERVER_PORT);
+  slog(LOG_NOTICE, "Serving HTTP on port %d", WEBSERVER_PORT);
+}
+
+/*
+State kept over a planned restart (reset or firmware update)
+ Before the restart the last reading is posted and the last valid reading
+ (counters, uptime and serial) and the inverter limits are saved with a crc
+ in RTC user memory, which survives a reset but not a power loss. Magic and
+ size carry the layout, so a new image ignores a state it cannot read.
+ At boot a valid state is used once:
+ decoding starts without the 20 s safety delay, plausibility checks and
+ inverter control continue with the saved values. The time between the
+ last record before and the first record after the restart is in /json.
+ */
+#define STATE_VERSION 2   // increment if saved_state_t changes
+#define STATE_MAGIC (0x534d4c00 | STATE_VERSION)  // "SML" and the layout version
+#define STATE_RTC_OFFSET 32     // [4 byte blocks], eboot uses the first 128 bytes for OTA
+#ifndef SML_START_DELAY_MS
+#define SML_START_DELAY_MS 20000  // start decoding late after unplanned resets (allows OTA if decoding crashes)
+#endif
+uint32_t sml_hold_ms = 0;  // millis() while decoding is held back for the start delay
+bool sml_started = false;
+
+// Only plain values, the layout must not depend on the parser or on pointers of one image
+typedef struct saved_state {
+  uint32_t magic;
+  uint32_t crc;        // crc32 of the rest
+  uint32_t size;       // sizeof(saved_state_t) of the image that saved it
+  uint64_t time_ms;    // unix time [ms] of the last valid record
+  uint64_t aPlus;      // last valid reading
+  uint64_t aMinus;
+  uint32_t uptime;
+  uint8_t valid;
+  char serial[sizeof(((itron_3hz_t *)0)->serial)];
+  uint32_t power_in_w;
+  uint32_t power_out_w;
+  #ifdef DTU_TOPIC
+  uint8_t inverters;   // inverter_count when saved
+  uint16_t limits[MAX_INVERTERS];
+  #endif
+} saved_state_t;
+
+uint32_t state_crc( const saved_state_t *state ) {
+  return crc32((const uint8_t *)state + offsetof(saved_state_t, size), sizeof(*state) - offsetof(saved_state_t, size));
+}
+
+bool save_state() {
+  saved_state_t state;
+  memset(&state, 0, sizeof(state));
+  state.magic = STATE_MAGIC;
+  state.size = sizeof(state);
+  state.time_ms = recv_time_ms;
+  state.aPlus = last_valid.aPlus;
+  state.aMinus = last_valid.aMinus;
+  state.uptime = last_valid.uptime;
+  state.valid = last_valid.valid;
+  memcpy(state.serial, last_valid.serial, sizeof(state.serial));
+  state.power_in_w = power_in_w;
+  state.power_out_w = power_out_w;
+  #ifdef DTU_TOPIC
+  state.inverters = inverter_count;
+  for( size_t i = 0; i < inverter_count; i++ ) {
+    state.limits[i] = inverters[i].curr_limit;
+  }
+  #endif
+  state.crc = state_crc(&state);
+  if( !ESP.rtcUserMemoryWrite(STATE_RTC_OFFSET, (uint32_t *)&state, sizeof(state)) ) {
+    slog(LOG_ERR, "Save state: RTC memory write of %u bytes failed", sizeof(state));
+    return false;
+  }
+  return true;
+}
+
+// Use saved state once, returns true if there was one
+bool restore_state() {
+  saved_state_t state;
+  if( !ESP.rtcUserMemoryRead(STATE_RTC_OFFSET, (uint32_t *)&state, sizeof(state))
+   || state.magic != STATE_MAGIC || state.size != sizeof(state) || state.crc != state_crc(&state) ) {
+    return false;
+  }
+  uint32_t magic = 0;  // invalidate, an unplanned reset must not use it again
+  if( !ESP.rtcUserMemoryWrite(STATE_RTC_OFFSET, &magic, sizeof(magic)) ) {
+    return false;  // could not invalidate, better start without it
+  }
+
+  memset(&last_valid, 0, sizeof(last_valid));
+  last_valid.aPlus = state.aPlus;
+  last_valid.aMinus = state.aMinus;
+  last_valid.uptime = state.uptime;
+  last_valid.valid = state.valid;
+  memcpy(last_valid.serial, state.serial, sizeof(last_valid.serial));
+  itron = last_valid;
+  recv_time_ms = state.time_ms;
+  restored_time_ms = state.time_ms;
+  power_in_w = state.power_in_w;
+  power_out_w = state.power_out_w;
+  #ifdef DTU_TOPIC
+  if( state.inverters == inverter_count ) {
+    for( size_t i = 0; i < inverter_count; i++ ) {
+      inverters[i].curr_limit = state.limits[i];
+    }
+  }
+  #endif
+  return true;
+}
+
+// Flush data of the last record and save state before a planned restart
+void prepare_restart() {
+  if( last_valid.valid == 0x3f ) {
+    post_data();
+    #ifdef DTU_TOPIC
+    publish_data();
+    #endif
+  }
+  if( save_state() ) {
+    slog(LOG_NOTICE, "Restart with saved state, last record at %llu ms", recv_time_ms);
+  }
+  energy_save();
+  for( size_t i = 0; i <= LOG_QUEUE_SIZE; i++ ) {
+    log_drain();
+  }
 }
 
 void setup() {
@@ -579,6 +3161,7 @@ void setup() {
   digitalWrite(DB_LED_PIN, DB_LED_ON);
   analogWriteRange(PWMRANGE);
 
+  Serial.setRxBufferSize(SERIAL_RX_BUFFER);
   Serial.begin(SERIAL_SPEED);
   Serial.println("\nStarting " PROGNAME " v" VERSION " " __DATE__ " " __TIME__);
 
@@ -612,20 +3195,31 @@ void setup() {
   snprintf(msg, sizeof(msg), "%s Version %s, WLAN IP is %s", PROGNAME, VERSION,
            WiFi.localIP().toString().c_str());
   Serial.printf(msg);
-  syslog.logf(LOG_NOTICE, msg);
+  slog(LOG_NOTICE, "%s", msg);
 
+  setenv("TZ", TZ_INFO, 1);
+  tzset();
   ntp.begin();
 
   MDNS.begin(HOSTNAME);
 
-  esp_updater.setup(&web_server);
+  setup_spool();
+  setup_energy();
   setup_webserver();
+  setup_modbus();
+  setup_power();
 
 #ifdef DTU_TOPIC
+  setup_inverters();
   mqtt.setServer(MQTT_BROKER, MQTT_PORT);
   mqtt.setCallback(mqtt_callback);
 #endif
 
+  state_restored = restore_state();
+  if( state_restored ) {
+    slog(LOG_NOTICE, "Restored state of last record at %llu ms", restored_time_ms);
+  }
+
   // Test wled status info
   // itron.valid = 0x3f;
   // for( uint16_t w = 0; w < 900; w++ ) {
@@ -643,6 +3237,7 @@ void setup() {
   // itron.valid = 0x0;
 
   last_counter_reset = millis();
+  sml_hold_ms = millis();
 }
 
 bool check_ntptime() {
@@ -651,7 +3246,7 @@ bool check_ntptime() {
     have_time = true;
     time_t now = time(NULL);
     strftime(start_time, sizeof(start_time), "%FT%T%Z", localtime(&now));
-    syslog.logf(LOG_NOTICE, "Booted at %s", start_time);
+    slog(LOG_NOTICE, "Booted at %s", start_time);
   }
   return have_time;
 }
@@ -682,8 +3277,6 @@ void breathe() {
   }
 }
 
-typedef enum { SML_NONE=0, SML_OPEN=0x0101, SML_LIST=0x0701, SML_CLOSE=0x0201 } sml_message_t;
-
 // Validate meter reading is within configured limits
 // Compares power calculated from energy delta against max thresholds
 // Returns false if power exceeds limits
@@ -692,10 +3285,7 @@ typedef enum { SML_NONE=0, SML_OPEN=0x0101, SML_LIST=0x0701, SML_CLOSE=0x0201 }
 bool is_power_valid( uint64_t current_reading_1_10Wh, uint64_t previous_reading_1_10Wh, uint32_t delta_time_s, bool is_aplus ) {
   if( delta_time_s == 0 ) return true;  // skip validation on first reading
   
-  // Calculate power in W from energy delta over time
-  // (reading1 - reading0) * (1/10 Wh) / time_h * 3600 = power_W
-  // = (reading1 - reading0) * 360 / time_s
-  uint64_t power_W = (current_reading_1_10Wh - previous_reading_1_10Wh) * 360 / delta_time_s;
+  uint64_t power_W = sml_power_w(current_reading_1_10Wh, previous_reading_1_10Wh, delta_time_s);
   
   uint32_t max_power_W = is_aplus ? USAGE_KW_MAX * 1000 : PROD_KW_MAX * 1000;
   
@@ -705,8 +3295,8 @@ bool is_power_valid( uint64_t current_reading_1_10Wh, uint64_t previous_reading_
 char *itronString( itron_3hz_t *itron ) {
   static char msg[200];
 
-  char *serial = to_hex(itron->serial, sizeof(itron->serial), '-');
-  serial[sizeof(itron->serial) * 3 - 1] = '\0'; // cut last separator 
+  char serial[SERIAL_HEX_SIZE];
+  hex_str(serial, sizeof(serial), itron->serial, sizeof(itron->serial), '-');
 
   snprintf(msg, sizeof(msg), 
     "valid[0x3f]=0x%02x, detailed=%s, id='%3.3s', serial='%s', record=%llu, uptime[s]=%u, A+[Wh]=%.1f, A-[Wh]=%.1f",
@@ -715,262 +3305,68 @@ char *itronString( itron_3hz_t *itron ) {
   return msg;
 }
 
-uint64_t pow10( uint64_t val, int8_t exp ) {
-  if( exp < 0 ) {
-    while( exp++ ) {
-      val /= 10;
-    }
-  }
-  else {
-    while( exp-- ) {
-      val *= 10;
-    }
-  }
-  return val;
-}
 
-/*
-Parse relevant data from Itron 3.Hz meter
- itron: pointer to structure with relevant values
- level: list level
- pos:   in current sml value structure
- type:  data type (0, 4, 5, 6 from SML)
- data:  data of given type or 0 for end marker
- */
-void parse_itron_3hz( itron_3hz_t *itron, size_t level, size_t pos, size_t type, const void *data ) {
-  static bool fileOpen = false;
-  static sml_message_t messageType = SML_NONE;
-  static bool isMeterId = false;
-  static bool isMeterSerial = false;
-  static bool isMeterAplus = false;
-  static bool isMeterAminus = false;
-  static uint8_t unit = 0;
-  static int8_t scale = 0;
-  
-  if( level == 2 && pos == 0 && type == 6 ) {  // SML message type
-    messageType = (sml_message_t)*(uint64_t *)data;
-    if( messageType == SML_OPEN ) {
-      fileOpen = true;
-    }
-    else if( messageType == SML_CLOSE ) {
-      fileOpen = false;
-    }
-  }
-  else if( messageType == SML_OPEN && level == 3 && pos == 2 && type == 0 ) {  // file id
-    size_t len = sizeof(uint64_t);
-    uint8_t *record = (uint8_t *)data;
-    while( len-- ) {
-      itron->file = (itron->file << 8) | *(record++);
-    }
-    itron->valid |= 4;
-  }
-  else if( fileOpen && messageType == SML_LIST ) {
-    if( level == 4 && pos == 1 && type == 6 ) {  // uptime
-      itron->uptime = *(uint64_t *)data;
-      itron->valid |= 8;
-    }
-    else if( level == 5 ) {  // SML value structure
-      if( pos == 0 && type == 0 ) {  // obis id
-        char *obis = (char *)data;
-        if( obis[0] == 0x01 && obis[1] == 0 ) {
-          if( obis[2] == 0x60 && obis[3] == 0x32 && obis[4] == 0x01) {
-            isMeterId = true;
-          }
-          else if( obis[2] == 0x60 && obis[3] == 0x01 && obis[4] == 0x00) {
-            isMeterSerial = true;
-          }
-          else if( obis[2] == 0x01 && obis[3] == 0x08 && obis[4] == 0x00) {
-            isMeterAplus = true;
-          }
-          else if( obis[2] == 0x02 && obis[3] == 0x08 && obis[4] == 0x00) {
-            isMeterAminus = true;
-          }
-        }
-      }
-      else if( (isMeterAplus || isMeterAminus) && pos == 3 && type == 6 ) {  // unit
-        unit = *(uint64_t *)data;
-      }
-      else if( (isMeterAplus || isMeterAminus) && pos == 4 && type == 5 ) {  // scale
-        scale = *(int64_t *)data;
-        // scale ==  3: coarse kWh readings after power failure
-        // scale == -1: fine 1/10Wh readings (needs itr pin and menu setting)
-        itron->detailed = (scale == 3) ? false : true;
-      }
-      else if( pos == 5 ) {  // SML value
-        if( isMeterId && type == 0 ) {  // meter id
-          memcpy(itron->id, data, sizeof(itron->id));
-          itron->valid |= 1;
-          isMeterId = false;
-        }
-        else if( isMeterSerial && type == 0 ) {  // meter serial
-          memcpy(itron->serial, data, sizeof(itron->serial));
-          itron->valid |= 2;
-          isMeterSerial = false;
-        }
-        else if( isMeterAplus && type == 6 ) {  // A+ value
-          if( unit == 30 ) {  // expecting [Wh]
-            itron->aPlus = pow10(*(uint64_t *)data, scale+1);
-            itron->valid |= 16;
-          }
-          unit = 0;
-          scale = 0;
-          isMeterAplus = false;
-        }
-        else if( isMeterAminus && type == 6 ) {  // A- value
-          if( unit == 30 ) {  // expecting [Wh]
-            itron->aMinus = pow10(*(uint64_t *)data, scale+1);
-            itron->valid |= 32;
-          }
-          unit = 0;
-          scale = 0;
-          isMeterAminus = false;
-        }
-      }
-    }
-  }
-}
 
-char *spaces(char *s, size_t indent) {
-  while( indent-- ) {
-    *(s++) = ' ';
-    *(s++) = ' ';
-  }
-  return s;
+#ifdef SML_DEBUG
+// Log one decoded sml item indented by its list level (only for debugging, costs a syslog per item)
+void sml_debug( size_t level, size_t pos, size_t type, size_t len, const char *fmt, ... ) {
+  char msg[128];
+  size_t indent = min(level * 2, sizeof(msg) / 2);
+  memset(msg, ' ', indent);
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(&msg[indent], sizeof(msg) - indent, fmt, args);
+  va_end(args);
+  slog(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, len, msg);
 }
+#endif
 
-/*
-SML parser (assuming valid SML 1.x)
- itron: pointer to structure to store relevant values
- data:  sml data of unknown length (whole record or list)
- items: list items (or high number if unknown)
- level: of nested lists
- */
-char *read_sml( itron_3hz_t *itron, char *data, size_t items, size_t level ) {
-  static char msg[1024];
-  size_t pos = 0;
 
-  while( items-- ) {
-    size_t type = (*data >> 4) & 0x7;
-    
-    size_t len = *data & 0xf;
-    while( *(data++) & 0x80 ) {
-      len = (len << 4) + (*data & 0xf);
-    }
-
-    //size_t l = len;  // for syslog length
-    uint64_t u = 0;
-    int64_t i = 0;
-    char *s;
-
-    switch( type ) {
-      case 0:  // octet
-        if( len == 0 ) {
-          parse_itron_3hz(itron, level, pos, type, 0);
-          // print end
-          s = spaces(msg, level);
-          snprintf(s, 4, "end");
-          //syslog.logf(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, l, msg);
-          return data;
-        }
-        else {
-          parse_itron_3hz(itron, level, pos, type, data);
-          if( --len == 0 ) {
-            // print default
-            s = spaces(msg, level);
-            snprintf(s, 8, "default");
-            //syslog.logf(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, l, msg);
-          } 
-          else {
-            // print string(len)
-            s = spaces(msg, level);
-            while( len-- ) {
-              snprintf(s, 4, "%02x ", *(data++));
-              s += 3;
-            }
-            //syslog.logf(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, l, msg);
-          }
-        }
-        break;
-      case 4:  // bool
-        parse_itron_3hz(itron, level, pos, type, data);
-        if( *(data++) ) {
-          // print true
-          s = spaces(msg, level);
-          snprintf(s, 5, "true");
-          //syslog.logf(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, l, msg);
-        } else {
-          // print false
-          s = spaces(msg, level);
-          snprintf(s, 6, "false");
-          //syslog.logf(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, l, msg);
-        }
-        break;
-      case 5:  // int
-        while( len-- >= 2 ) {
-          i = (i << 8) | *(data++);
-        }
-        parse_itron_3hz(itron, level, pos, type, &i);
-        // print i
-        s = spaces(msg, level);
-        snprintf(s, 20, "%lld", i);
-        //syslog.logf(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, l, msg);
-        break;
-      case 6:  // unsigned int
-        while (len-- >= 2) {
-          u = (u << 8) | *(data++);
-        }
-        parse_itron_3hz(itron, level, pos, type, &u);
-        // print u
-        s = spaces(msg, level);
-        snprintf(s, 20, "%llu", u);
-        //syslog.logf(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, l, msg);
-        break;
-      case 7:  // list
-        s = spaces(msg, level);
-        snprintf(s, 17, "list[%u]", len);
-        //syslog.logf(LOG_DEBUG, "Sml[%2u,%2u,%2u]=%s\n", pos, type, l, msg);
-        data = read_sml(itron, data, len, level + 1);
-        break;
-    }
-    pos++;
-  }
-  return data;
-}
+// Set by sml_data() for task_publish(), the network work runs outside the serial task
+bool publish_due = false;  // periodic InfluxDB post and MQTT publish of the last record
+#ifdef DTU_TOPIC
+bool control_due = false;  // inverter limit control for the last record
+#endif
 
-void sml_data( char *data, size_t len ) {
+void sml_data( char *data, size_t len, uint64_t time_ms ) {
   static const uint32_t max_count = 60;  // send ~once per minute
   static uint32_t count = max_count;
-  static uint32_t last_uptime = 0;
-  static uint64_t last_aPlus = 0;
-  static uint64_t last_aMinus = 0;
 
-  sml_len = min(len, (size_t)sizeof(sml_raw));
-  memcpy(sml_raw, data, sml_len);
-  
+  uint8_t reason = CAPTURE_OK;
+
   memset(&itron, 0, sizeof(itron));
+  itron.obis = &obis_table;
   read_sml(&itron, data, 0xffff, 0);
-  if( itron.valid == 0x3f ) {
-    recv_time = time(NULL);
+  obis_time_ms = time_ms;
+  if( itron.valid != 0x3f ) {
+    reason |= CAPTURE_INVALID;
+  }
+  else {
     recv_detailed = itron.detailed;
+    if( !recv_detailed ) {
+      reason |= CAPTURE_COARSE;
+    }
     
     // Validate readings are within configured power limits
-    if( last_uptime > 0 ) {
-      uint32_t delta_time_s = itron.uptime - last_uptime;
+    if( last_valid.uptime > 0 ) {
+      uint32_t delta_time_s = itron.uptime - last_valid.uptime;
       if( delta_time_s > 0 ) {
         bool valid = true;
         // Check A+ (production)
-        if( itron.aPlus >= last_aPlus ) {
-          if( !is_power_valid(itron.aPlus, last_aPlus, delta_time_s, true) ) {
-            syslog.logf(LOG_WARNING, "Rejected reading: A+ delta=%llu in %u s exceeds PROD_KW_MAX=%u", 
-                        itron.aPlus - last_aPlus, delta_time_s, PROD_KW_MAX);
+        if( itron.aPlus >= last_valid.aPlus ) {
+          if( !is_power_valid(itron.aPlus, last_valid.aPlus, delta_time_s, true) ) {
+            slog(LOG_WARNING, "Rejected reading: A+ delta=%llu in %u s exceeds PROD_KW_MAX=%u", 
+                        itron.aPlus - last_valid.aPlus, delta_time_s, PROD_KW_MAX);
+            reason |= CAPTURE_REJECT_APLUS;
             valid = false;
           }
         }
         // Check A- (consumption)
-        if( itron.aMinus >= last_aMinus ) {
-          if( !is_power_valid(itron.aMinus, last_aMinus, delta_time_s, false) ) {
-            syslog.logf(LOG_WARNING, "Rejected reading: A- delta=%llu in %u s exceeds USAGE_KW_MAX=%u", 
-                        itron.aMinus - last_aMinus, delta_time_s, USAGE_KW_MAX);
+        if( itron.aMinus >= last_valid.aMinus ) {
+          if( !is_power_valid(itron.aMinus, last_valid.aMinus, delta_time_s, false) ) {
+            slog(LOG_WARNING, "Rejected reading: A- delta=%llu in %u s exceeds USAGE_KW_MAX=%u", 
+                        itron.aMinus - last_valid.aMinus, delta_time_s, USAGE_KW_MAX);
+            reason |= CAPTURE_REJECT_AMINUS;
             valid = false;
           }
         }
@@ -983,133 +3379,307 @@ void sml_data( char *data, size_t len ) {
     
     // Store current values for next comparison (only if reading was valid)
     if( itron.valid == 0x3f ) {
-      last_uptime = itron.uptime;
-      last_aPlus = itron.aPlus;
-      last_aMinus = itron.aMinus;
+      recv_time_ms = time_ms;
+      update_clock(time_ms, itron.uptime);
+      last_valid = itron;
+      if( restored_time_ms ) {
+        restart_gap_ms = recv_time_ms - restored_time_ms;
+        restored_time_ms = 0;
+        slog(LOG_NOTICE, "First record %lld ms after the last before the restart", restart_gap_ms);
+      }
+      update_power(recv_time_ms / 1000);
+      energy_add(&itron, recv_time_ms);
     }
   }
 
+  #ifdef SML_CAPTURE
+  capture_frame(data, len, reason, time_ms);
+  #endif
+
   count++;
   if( count > max_count ) {
     count = 0;
+    publish_due = true;
+    task_wake(TASK_PUBLISH);
     if( itron.valid == 0x3f ) {  // all bits/entries set: publish itron data
-      post_data();
-      #ifdef DTU_TOPIC
-      publish_data();
-      #endif
       if( recv_detailed ) {
-        syslog.logf(LOG_INFO, "Itron %s", itronString(&itron));
+        slog(LOG_INFO, "Itron %s", itronString(&itron));
       }
       else {
-        syslog.logf(LOG_WARNING, "Itron %s", itronString(&itron));
+        slog(LOG_WARNING, "Itron %s", itronString(&itron));
       }
     }
     else {
-      syslog.logf(LOG_NOTICE, "Sml[%u]=%s", len, to_hex(data, len, ','));
-      syslog.logf(LOG_NOTICE, "Itron invalid: %s", itronString(&itron));
+      char hex[3 * 56];  // log the record in pieces that fit a log queue entry
+      for( size_t pos = 0; pos < len; pos += sizeof(hex) / 3 ) {
+        slog(LOG_NOTICE, "Sml[%u@%u]=%s", len, pos, hex_str(hex, sizeof(hex), &data[pos], len - pos, ','));
+      }
+      slog(LOG_NOTICE, "Itron invalid: %s", itronString(&itron));
     }
   }
 
   #ifdef DTU_TOPIC
-  check_limit();
+  control_due = true;
+  task_wake(TASK_PUBLISH);
   #endif
 
   #ifdef WLED_LEDS
-  send_wled();
+  task_wake(TASK_WLED);
   #endif
 }
 
-typedef enum { MODE_NONE, MODE_START, MODE_VER, MODE_DATA, MODE_END, MODE_FINISH } read_mode_t;
+#ifndef SERIAL_STAGING
+#define SERIAL_STAGING 128  // bytes fetched from the serial buffer at once
+#endif
+
+// Decode a complete record and hand its slot over to /sml without copying
+void frame_decode( frame_slot_t *slot ) {
+  slot->time_ms = epoch_ms();  // timestamp of the record travels with the reading
+  sml_data(slot->data, slot->len, slot->time_ms);
+  frame_release(frame_last);
+  frame_last = slot;
+}
+
+// Handle a framing event: buffer for a new record (none drops it), decode a complete one
+void sml_frame_event( sml_framer_t *framer, sml_put_t event ) {
+  static frame_slot_t *slot = 0;  // frame buffer currently filled
+
+  switch( event ) {
+    case SML_PUT_BEGIN:
+      counter_events++;  // reset inactivity counter
+      power_frame_begin_ms = millis();
+      if( !slot && !(slot = frame_acquire()) ) {
+        frame_drops++;  // all frame buffers in use
+      }
+      framer->buf = slot ? slot->data : 0;
+      framer->size = slot ? sizeof(slot->data) : 0;
+      break;
+    case SML_PUT_DONE:
+      power_frame_end_ms = millis();
+      power_frame_ms = power_frame_end_ms - power_frame_begin_ms;
+      power_frames++;
+      slot->len = framer->count;
+      frame_decode(slot);
+      slot = frame_acquire();  // keep capturing in a free one
+      break;
+    default:
+      break;
+  }
+}
 
+/*
+Read meter data
+ Bytes are fetched in blocks into a staging buffer, mirrored and framed
+ with sml_frame_write(), which skips to escape bytes and copies the record
+ data word by word. Define SML_BYTE_FRAMING for the byte by byte reference
+ path with sml_frame_put().
+ */
 void read_serial_sml() {
-  static char data[2560];  // enough for 2s at 9600 baud
-  static read_mode_t mode = MODE_NONE;
-  static size_t count = 0;
-  int ch;
+  static sml_framer_t framer = { SML_FRAME_NONE, 0, 0, 0 };
 
+  #ifdef SML_BYTE_FRAMING
+  int ch;
   while( (ch = Serial.read()) >= 0 ) {
     // Mirror all incoming data to IR LED output
     mirror.write(ch);
-    
-    switch( mode ) {
-      case MODE_NONE:
-        if( ch == 0x1b ) {
-          mode = MODE_START;
-          count = 1;
-        }
-        break;
-      case MODE_START:
-        if( ch == 0x1b ) {
-          if( ++count == 4 ) {
-            mode = MODE_VER;
-            count = 0;
-          }
-        }
-        else {
-          mode = MODE_NONE;
-        }
-        break;
-      case MODE_VER:
-        if (ch == 0x01) {
-          if (++count == 4) {
-            mode = MODE_DATA;
-            counter_events++;  // reset inactivity counter
-            count = 0;
-          }
-        } else {
-          mode = MODE_NONE;
-        }
-        break;
-      case MODE_DATA:
-        data[count++] = ch;
-        if( count % 4 == 1 && ch == 0x1b ) {
-          mode = MODE_END;
-        }
-        break;
-      case MODE_END:
-        data[count++] = ch;
-        if( count % 4 != 0 && ch != 0x1b ) {
-          mode = MODE_DATA;
-        }
-        else if (count % 4 == 0 ) {
-          mode = MODE_FINISH;
-          count -= 4;
-        }
-        break;
-      case MODE_FINISH:
-        if (ch == 0x1a) {
-          sml_data(data, count);
-        }
-        mode = MODE_NONE;
-        break;
+    sml_frame_event(&framer, sml_frame_put(&framer, ch));
+  }
+  #else
+  static uint8_t staging[SERIAL_STAGING] __attribute__((aligned(4)));
+  int avail;
+  while( (avail = Serial.available()) > 0 ) {
+    size_t len = Serial.read(staging, min((size_t)avail, sizeof(staging)));
+    // Mirror all incoming data to IR LED output
+    mirror.write(staging, len);
+    size_t pos = 0;
+    while( pos < len ) {
+      sml_put_t event;
+      pos += sml_frame_write(&framer, &staging[pos], len - pos, &event);
+      sml_frame_event(&framer, event);
     }
   }
+  #endif
 }
 
-void loop() {
-  static uint32_t updateDelay = 0;
-  static bool smlRead = false;
+#ifndef MQTT_LOOP_MS
+#define MQTT_LOOP_MS (POWER_MODE ? POWER_BATCH_MS : 20)  // serve the MQTT connection this often
+#endif
 
-  ntp.update();
-  if (check_ntptime()) {
-    breathe();
+#define LOG_DRAIN_MS 10  // send queued syslog messages this often
+
+#ifndef MQTT_RECONNECT_MS
+#define MQTT_RECONNECT_MS 5000  // if disconnected try to reconnect this often
+#endif
+
+void task_serial() {
+  if( !sml_started ) {
+    // delay reading sml (for OTA update if reading sml causes reboots)
+    if( !state_restored && millis() - sml_hold_ms <= SML_START_DELAY_MS ) {
+      return;
+    }
+    sml_started = true;
+  }
+  read_serial_sml();
+  tasks[TASK_SERIAL].due_ms = millis() + power_serial_ms(millis());
+}
+
+#ifdef SML_INJECT
+// Decode the next record of an injected capture, then wait for the next by the rate
+void task_inject() {
+  if( !inject_len ) {
+    return;
+  }
+  uint32_t n = inject_frames + inject_dropped;
+  uint64_t due_us = inject_rate ? inject_start_us + (uint64_t)n * 1000000 / inject_rate : micros64();
+  capture_header_t header;
+  if( inject_pos + sizeof(header) > inject_len ) {
+    if( ++inject_pass >= inject_repeat || !n ) {
+      inject_len = 0;
+      slog(LOG_NOTICE, "Injected %u frames, %u dropped", inject_frames, inject_dropped);
+      return;
+    }
+    inject_pos = sizeof(CAPTURE_MAGIC);
+  }
+  memcpy(&header, &inject_buf[inject_pos], sizeof(header));
+  const uint8_t *data = &inject_buf[inject_pos + sizeof(header)];
+  inject_pos += sizeof(header) + header.len;
+  if( inject_pos > inject_len ) {
+    inject_len = 0;
+    slog(LOG_ERR, "Injected capture truncated after %u frames", n);
+    return;
+  }
+
+  frame_slot_t *slot = header.len <= FRAME_SIZE ? frame_acquire() : 0;
+  if( slot ) {
+    memcpy(slot->data, data, header.len);
+    slot->len = header.len;
+    frame_decode(slot);
+    inject_frames++;
+  }
+  else {
+    inject_dropped++;
+  }
+  inject_last_us = micros64();
+  if( slot ) {
+    uint32_t us = inject_last_us > due_us ? inject_last_us - due_us : 0;
+    latency_add(&inject_latency, due_us, inject_last_us);
+    inject_latency_max_us = max(inject_latency_max_us, us);
+  }
+
+  uint64_t next_us = inject_rate ? inject_start_us + (uint64_t)(n + 1) * 1000000 / inject_rate : inject_last_us;
+  tasks[TASK_INJECT].due_ms = millis() + (next_us > inject_last_us ? (next_us - inject_last_us + 999) / 1000 : 0);
+}
+#endif
+
+// Post, publish and control inverters for the record sml_data() marked, off the capture path
+void task_publish() {
+  if( publish_due ) {
+    publish_due = false;
+    #ifdef SML_OBIS_INFLUX
+    post_obis(obis_time_ms);
+    #endif
+    if( itron.valid == 0x3f ) {
+      post_data();
+      #ifdef DTU_TOPIC
+      publish_data();
+      #endif
+    }
+  }
+  #ifdef DTU_TOPIC
+  if( control_due ) {
+    control_due = false;
+    if( itron.valid == 0x3f ) {
+      track_limit_effect();
+    }
+    check_limit();
   }
-  else { // delay reading sml (for OTA update if reading sml causes reboots)
-    updateDelay = millis();
+  #endif
+}
+
+void task_restart() {
+  if( restart_ms && millis() - restart_ms > 200 ) {
+    prepare_restart();
+    ESP.restart();
   }
+}
+
+// Woken by slog(), then sends one message every LOG_DRAIN_MS until the queue is empty
+void task_log() {
+  if( log_drain() ) {
+    tasks[TASK_LOG].due_ms = millis() + LOG_DRAIN_MS;
+  }
+}
 
-  if( millis() - updateDelay > 20000 ) { 
-    smlRead = true;
+void task_ntp() {
+  ntp.update();
+  if( !check_ntptime() ) {
+    sml_hold_ms = millis();
   }
+}
 
-  if( smlRead ) {
-    read_serial_sml();
+void task_breathe() {
+  if( !POWER_MODE && check_ntptime() ) {
+    breathe();
   }
+}
 
+// In priority order of the enum, name, function, period, deadline [ms], slice [us], flags
+task_t tasks[TASK_COUNT] = {
+  { "serial", task_serial, SERIAL_SERVICE_MS, SERIAL_SERVICE_MS, 50000, 0 },
+#ifdef SML_INJECT
+  { "inject", task_inject, 1000, 10, 50000, 0 },
+#endif
+  { "restart", task_restart, 200, 100, 1000000, TASK_NET },
+  { "publish", task_publish, 1000, 100, 50000, TASK_NET },  // woken by sml_data()
 #ifdef DTU_TOPIC
-  handle_mqtt();
+  { "mqtt", handle_mqtt, MQTT_LOOP_MS, 100, 20000, TASK_NET },
+  { "mqtt_connect", connect_mqtt, MQTT_RECONNECT_MS, 1000, 500000, TASK_NET },
+#endif
+#ifdef WLED_LEDS
+  { "wled", send_wled, 1000, 100, 5000, TASK_NET },  // woken by each record
 #endif
+  { "ntp", task_ntp, 1000, 1000, 100000, TASK_NET },
+  { "breathe", task_breathe, POWER_MODE ? 60000 : 20, 20, 1000, 0 },
+  { "log", task_log, 1000, 1000, 10000, TASK_IDLE | TASK_NET },
+  { "spool", spool_replay, SPOOL_REPLAY_MS, 1000, 200000, TASK_IDLE | TASK_NET },
+};
 
-  web_server.handleClient();
-  delay(1);
+void loop() {
+  uint32_t now = millis();
+  bool pending = sml_started && Serial.available() > 0;  // meter data waiting
+  uint32_t hold = power_hold_ms(now);
+  uint32_t wait = POWER_FRAME_MS;
+  for( size_t i = 0; i < TASK_COUNT; i++ ) {
+    task_t *t = &tasks[i];
+    if( (t->flags & TASK_IDLE) && pending ) {
+      continue;
+    }
+    int32_t late = now - t->due_ms;
+    uint32_t until = late < 0 ? -late : 0;
+    if( (t->flags & TASK_NET) && hold > until ) {
+      until = hold;
+    }
+    if( until ) {
+      wait = min(wait, until);
+      continue;
+    }
+    if( (uint32_t)late > t->deadline_ms && !(POWER_MODE && (t->flags & TASK_NET)) ) {  // held back on purpose
+      t->misses++;
+    }
+    t->due_ms = now + t->period_ms;
+    uint32_t start = micros();
+    t->run();
+    uint32_t us = micros() - start;
+    t->runs++;
+    t->total_us += us;
+    if( us > t->max_us ) {
+      t->max_us = us;
+    }
+    if( us > t->slice_us ) {
+      t->overruns++;
+    }
+    return;
+  }
+  sched_idle_ms += wait;
+  power_sleep(wait);
 }
@@ -0,0 +1,385 @@
+/*
+Decode archived SML records into InfluxDB line protocol or CSV
+
+ Input files are capture files from /sml?n= (SMLCAP, records with receive
+ time) or raw SML streams as read from the meter (records between
+ 1b1b1b1b 01010101 and 1b1b1b1b 1a). Files are memory mapped and split
+ into chunks at record boundaries. Worker threads decode the chunks with
+ the firmware decoder (lib/sml), each worker takes chunks from its own
+ queue and steals from the fullest other queue when it runs dry. Workers
+ only start chunks within CHUNK_WINDOW chunks per thread of the oldest
+ unwritten one and wait for the writer otherwise, so memory for results
+ stays bounded if a chunk is slow. The plausibility check needs the
+ previous valid reading, so it runs in input order while the results are
+ written.
+
+ Build: pio run -e smldecode  ->  .pio/build/smldecode/program
+ Usage: program [options] file...  (see --help)
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sml.h>
+
+#define CAPTURE_MAGIC "SMLCAP\x01"  // 8 bytes with terminating 0
+#define CHUNK_BYTES (1 << 20)       // input per task
+#define CHUNK_WINDOW 4              // chunks per thread decoded ahead of the writer
+#define FRAME_SIZE 65536            // longest raw record
+
+static const uint8_t start_seq[] = { 0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x01, 0x01, 0x01 };
+
+#pragma pack(push, 1)
+typedef struct capture_header {
+  uint32_t len;
+  uint32_t sec;
+  uint16_t ms;
+  uint8_t reason;
+  uint8_t reserved;
+} capture_header_t;
+#pragma pack(pop)
+
+typedef struct options {
+  bool csv;
+  unsigned threads;
+  int64_t offset_ms;     // raw streams: unix time [ms] of meter uptime 0
+  uint32_t usage_kw_max; // A+ plausibility limit
+  uint32_t prod_kw_max;  // A- plausibility limit
+} options_t;
+
+// Decoded record, in input order within a chunk
+typedef struct result {
+  uint64_t time_ms;
+  itron_3hz_t itron;
+} result_t;
+
+typedef struct chunk {
+  const uint8_t *begin;
+  const uint8_t *end;
+  bool capture;   // capture records instead of raw stream
+  std::vector<result_t> results;
+  bool done;
+} chunk_t;
+
+// Per worker queue of chunk indices, owner takes from the front, thieves from the back
+typedef struct worker_queue {
+  std::mutex lock;
+  std::deque<size_t> chunks;
+} worker_queue_t;
+
+static options_t opt = { false, 0, 0, 20, 15 };
+static std::vector<chunk_t> chunks;
+static std::vector<worker_queue_t> queues;
+static std::mutex done_lock;  // guards chunk_t::done and written
+static std::condition_variable done_cond;
+static size_t written;        // chunks written, workers start chunks below written + window
+static size_t window;         // CHUNK_WINDOW * threads
+static std::atomic<size_t> queued;  // chunks not taken by a worker yet
+
+static void decode_record( chunk_t *chunk, const char *data, uint64_t time_ms ) {
+  result_t result;
+  memset(&result, 0, sizeof(result));
+  // read_sml() does not write, the firmware hands it a writable buffer only by convention
+  read_sml(&result.itron, (char *)data, 0xffff, 0);
+  result.time_ms = time_ms ? time_ms : opt.offset_ms + result.itron.uptime * 1000LL;
+  chunk->results.push_back(result);
+}
+
+static void decode_capture( chunk_t *chunk ) {
+  const uint8_t *pos = chunk->begin;
+  while( pos + sizeof(capture_header_t) <= chunk->end ) {
+    capture_header_t header;
+    memcpy(&header, pos, sizeof(header));
+    pos += sizeof(header);
+    decode_record(chunk, (const char *)pos, header.sec * 1000ULL + header.ms);
+    pos += header.len;
+  }
+}
+
+// Decode records starting in [begin, end), the last one may end behind end
+static void decode_raw( chunk_t *chunk, const uint8_t *file_end ) {
+  static thread_local char frame[FRAME_SIZE];
+  sml_framer_t framer = { SML_FRAME_NONE, 0, frame, sizeof(frame) };
+  for( const uint8_t *pos = chunk->begin; pos < file_end; pos++ ) {
+    if( pos >= chunk->end && framer.mode <= SML_FRAME_START ) {
+      break;  // next record belongs to the next chunk
+    }
+    if( sml_frame_put(&framer, *pos) == SML_PUT_DONE ) {
+      decode_record(chunk, frame, 0);
+    }
+  }
+}
+
+// Take a chunk with index below limit: own queue from the front, else steal from
+// the back of the fullest queue (or its front if the back is beyond limit)
+static bool take_chunk( size_t self, size_t limit, size_t *index ) {
+  {
+    std::lock_guard<std::mutex> guard(queues[self].lock);
+    if( !queues[self].chunks.empty() && queues[self].chunks.front() < limit ) {
+      *index = queues[self].chunks.front();
+      queues[self].chunks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  for( ;; ) {
+    size_t victim = self;
+    size_t most = 0;
+    for( size_t i = 0; i < queues.size(); i++ ) {
+      std::lock_guard<std::mutex> guard(queues[i].lock);
+      if( i != self && queues[i].chunks.size() > most && queues[i].chunks.front() < limit ) {
+        most = queues[i].chunks.size();
+        victim = i;
+      }
+    }
+    if( victim == self ) {
+      return false;
+    }
+    std::lock_guard<std::mutex> guard(queues[victim].lock);
+    std::deque<size_t> &q = queues[victim].chunks;
+    if( q.empty() || q.front() >= limit ) {
+      continue;  // someone else was faster, look again
+    }
+    if( q.back() < limit ) {
+      *index = q.back();
+      q.pop_back();
+    }
+    else {
+      *index = q.front();
+      q.pop_front();
+    }
+    queued--;
+    return true;
+  }
+}
+
+static void worker( size_t self, const uint8_t *file_end ) {
+  size_t index;
+  for( ;; ) {
+    size_t limit;
+    {
+      std::lock_guard<std::mutex> guard(done_lock);
+      limit = written + window;
+    }
+    if( !take_chunk(self, limit, &index) ) {
+      if( queued == 0 ) {
+        return;
+      }
+      // wait for the writer to move the window
+      std::unique_lock<std::mutex> guard(done_lock);
+      done_cond.wait(guard, [limit] { return written + window > limit || queued == 0; });
+      continue;
+    }
+    chunk_t *chunk = &chunks[index];
+    if( chunk->capture ) {
+      decode_capture(chunk);
+    }
+    else {
+      decode_raw(chunk, file_end);
+    }
+    std::lock_guard<std::mutex> guard(done_lock);
+    chunk->done = true;
+    done_cond.notify_all();
+  }
+}
+
+// Split capture records into chunks of about CHUNK_BYTES
+static void split_capture( const uint8_t *data, size_t size ) {
+  const uint8_t *pos = data + sizeof(CAPTURE_MAGIC);
+  const uint8_t *end = data + size;
+  const uint8_t *begin = pos;
+  while( pos + sizeof(capture_header_t) <= end ) {
+    capture_header_t header;
+    memcpy(&header, pos, sizeof(header));
+    if( pos + sizeof(header) + header.len > end ) {
+      fprintf(stderr, "truncated record at offset %zu\n", (size_t)(pos - data));
+      break;
+    }
+    pos += sizeof(header) + header.len;
+    if( pos - begin >= CHUNK_BYTES ) {
+      chunks.push_back({ begin, pos, true, {}, false });
+      begin = pos;
+    }
+  }
+  if( pos > begin ) {
+    chunks.push_back({ begin, pos, true, {}, false });
+  }
+}
+
+// Split raw stream into chunks of about CHUNK_BYTES starting at start sequences
+static void split_raw( const uint8_t *data, size_t size ) {
+  const uint8_t *end = data + size;
+  const uint8_t *begin = (const uint8_t *)memmem(data, size, start_seq, sizeof(start_seq));
+  while( begin ) {
+    const uint8_t *next = 0;
+    if( end - begin > CHUNK_BYTES ) {
+      next = (const uint8_t *)memmem(begin + CHUNK_BYTES, end - begin - CHUNK_BYTES, start_seq, sizeof(start_seq));
+    }
+    chunks.push_back({ begin, next ? next : end, false, {}, false });
+    begin = next;
+  }
+}
+
+// Plausibility check as in sml_data(): power from the previous valid reading within limits
+static const char *check( const itron_3hz_t *itron, itron_3hz_t *last ) {
+  if( itron->valid != 0x3f ) {
+    return "invalid";
+  }
+  if( last->uptime > 0 && itron->uptime > last->uptime ) {
+    uint32_t delta_time_s = itron->uptime - last->uptime;
+    if( itron->aPlus >= last->aPlus && sml_power_w(itron->aPlus, last->aPlus, delta_time_s) > opt.usage_kw_max * 1000ULL ) {
+      return "rejected";
+    }
+    if( itron->aMinus >= last->aMinus && sml_power_w(itron->aMinus, last->aMinus, delta_time_s) > opt.prod_kw_max * 1000ULL ) {
+      return "rejected";
+    }
+  }
+  *last = *itron;
+  return 0;
+}
+
+static void write_results( FILE *out, const chunk_t *chunk, itron_3hz_t *last, size_t *counts ) {
+  char line[200];
+  for( const result_t &r : chunk->results ) {
+    const char *status = check(&r.itron, last);
+    if( opt.csv ) {
+      char serial[SERIAL_HEX_SIZE];
+      hex_str(serial, sizeof(serial), r.itron.serial, sizeof(r.itron.serial), '-');
+      fprintf(out, "%llu,%u,%s,%.1f,%.1f,%s,%s\n", (unsigned long long)r.time_ms, r.itron.uptime, serial,
+        r.itron.aPlus / 10.0, r.itron.aMinus / 10.0, r.itron.detailed ? "fine" : "coarse", status ? status : "ok");
+    }
+    else if( !status ) {
+      int len = itron_line(line, sizeof(line), &r.itron, r.time_ms);
+      fwrite(line, 1, len, out);
+    }
+    counts[status ? (status[0] == 'i' ? 1 : 2) : 0]++;
+  }
+}
+
+static void usage( const char *prog ) {
+  fprintf(stderr,
+    "Usage: %s [options] file...\n"
+    " -c, --csv            write CSV (time_ms,uptime,serial,aplus_wh,aminus_wh,resolution,status)\n"
+    "                      instead of line protocol of valid records\n"
+    " -t, --threads N      worker threads (default: all cores)\n"
+    " -o, --offset-ms MS   raw streams: unix time [ms] at meter uptime 0\n"
+    " -u, --usage-kw KW    reject A+ power above KW (default 20)\n"
+    " -p, --prod-kw KW     reject A- power above KW (default 15)\n", prog);
+  exit(1);
+}
+
+int main( int argc, char *argv[] ) {
+  static const struct option long_options[] = {
+    { "csv", no_argument, 0, 'c' },
+    { "threads", required_argument, 0, 't' },
+    { "offset-ms", required_argument, 0, 'o' },
+    { "usage-kw", required_argument, 0, 'u' },
+    { "prod-kw", required_argument, 0, 'p' },
+    { 0, 0, 0, 0 }
+  };
+  int c;
+  while( (c = getopt_long(argc, argv, "ct:o:u:p:", long_options, 0)) != -1 ) {
+    switch( c ) {
+      case 'c': opt.csv = true; break;
+      case 't': opt.threads = strtoul(optarg, 0, 10); break;
+      case 'o': opt.offset_ms = strtoll(optarg, 0, 10); break;
+      case 'u': opt.usage_kw_max = strtoul(optarg, 0, 10); break;
+      case 'p': opt.prod_kw_max = strtoul(optarg, 0, 10); break;
+      default: usage(argv[0]);
+    }
+  }
+  if( optind >= argc ) {
+    usage(argv[0]);
+  }
+  if( !opt.threads ) {
+    opt.threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+  }
+
+  static char out_buf[1 << 20];
+  setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+  if( opt.csv ) {
+    printf("time_ms,uptime,serial,aplus_wh,aminus_wh,resolution,status\n");
+  }
+
+  itron_3hz_t last;
+  memset(&last, 0, sizeof(last));
+  size_t counts[3] = { 0, 0, 0 };  // ok, invalid, rejected
+  int rc = 0;
+
+  for( int arg = optind; arg < argc; arg++ ) {
+    int fd = open(argv[arg], O_RDONLY);
+    struct stat st;
+    if( fd < 0 || fstat(fd, &st) < 0 ) {
+      perror(argv[arg]);
+      rc = 1;
+      continue;
+    }
+    if( st.st_size == 0 ) {
+      close(fd);
+      continue;
+    }
+    const uint8_t *data = (const uint8_t *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( data == MAP_FAILED ) {
+      perror(argv[arg]);
+      rc = 1;
+      continue;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    chunks.clear();
+    if( (size_t)st.st_size >= sizeof(CAPTURE_MAGIC) && memcmp(data, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) == 0 ) {
+      split_capture(data, st.st_size);
+    }
+    else {
+      split_raw(data, st.st_size);
+    }
+
+    // deal chunks round robin, so workers start near the front and results get done in order
+    queues = std::vector<worker_queue_t>(opt.threads);
+    for( size_t i = 0; i < chunks.size(); i++ ) {
+      queues[i % opt.threads].chunks.push_back(i);
+    }
+    written = 0;
+    window = CHUNK_WINDOW * opt.threads;
+    queued = chunks.size();
+    std::vector<std::thread> workers;
+    for( size_t i = 0; i < opt.threads; i++ ) {
+      workers.emplace_back(worker, i, data + st.st_size);
+    }
+
+    for( chunk_t &chunk : chunks ) {
+      {
+        std::unique_lock<std::mutex> guard(done_lock);
+        done_cond.wait(guard, [&chunk] { return chunk.done; });
+      }
+      write_results(stdout, &chunk, &last, counts);
+      std::vector<result_t>().swap(chunk.results);
+      std::lock_guard<std::mutex> guard(done_lock);
+      written++;
+      done_cond.notify_all();
+    }
+    for( std::thread &t : workers ) {
+      t.join();
+    }
+    munmap((void *)data, st.st_size);
+  }
+
+  fflush(stdout);
+  fprintf(stderr, "%zu ok, %zu invalid, %zu rejected records\n", counts[0], counts[1], counts[2]);
+  return rc;
+}